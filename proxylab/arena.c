@@ -0,0 +1,136 @@
+#include "arena.h"
+
+struct arena_block_s {
+    struct arena_block_s *next;     /* older blocks */
+    size_t size;
+    size_t used;
+    char data[] __attribute__ ((aligned (ARENA_ALIGN)));
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct arena_s *head;
+    unsigned int count;
+} arena_free = {PTHREAD_MUTEX_INITIALIZER, NULL, 0};
+
+static struct arena_block_s *block_new (size_t size)
+{
+    struct arena_block_s *block = (struct arena_block_s *)
+        Malloc (sizeof (struct arena_block_s) + size);
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+/* Free every block newer than keep. */
+static void free_blocks_until (struct arena_s *arena,
+                               struct arena_block_s *keep)
+{
+    struct arena_block_s *block;
+
+    while (arena->head != keep) {
+        block = arena->head;
+        arena->head = block->next;
+        Free (block);
+    }
+}
+
+struct arena_s *arena_new (void)
+{
+    struct arena_s *arena;
+
+    pthread_mutex_lock (&arena_free.lock);
+    arena = arena_free.head;
+    if (arena) {
+        arena_free.head = arena->next_free;
+        arena_free.count--;
+    }
+    pthread_mutex_unlock (&arena_free.lock);
+    if (arena)
+        return arena;
+
+    arena = (struct arena_s *) Malloc (sizeof (struct arena_s));
+    arena->head = block_new (ARENA_BLOCK_SIZE);
+    arena->next_free = NULL;
+    return arena;
+}
+
+/*
+ * Back to the free list with only its first block, emptied; past
+ * ARENA_MAXFREE idle arenas it is freed instead.
+ */
+void arena_release (struct arena_s *arena)
+{
+    struct arena_block_s *first;
+
+    assert (arena != NULL);
+    for (first = arena->head; first->next; first = first->next)
+        ;
+    free_blocks_until (arena, first);
+    first->used = 0;
+
+    pthread_mutex_lock (&arena_free.lock);
+    if (arena_free.count != ARENA_MAXFREE) {
+        arena->next_free = arena_free.head;
+        arena_free.head = arena;
+        arena_free.count++;
+        arena = NULL;
+    }
+    pthread_mutex_unlock (&arena_free.lock);
+
+    if (arena) {
+        Free (first);
+        Free (arena);
+    }
+}
+
+void *arena_alloc (struct arena_s *arena, size_t size)
+{
+    struct arena_block_s *block = arena->head;
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    if (block->size - block->used < size) {
+        block = block_new (size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+        block->next = arena->head;
+        arena->head = block;
+    }
+    ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void *arena_calloc (struct arena_s *arena, size_t size)
+{
+    return memset (arena_alloc (arena, size), 0, size);
+}
+
+char *arena_strndup (struct arena_s *arena, const char *str, size_t len)
+{
+    char *copy = (char *) arena_alloc (arena, len + 1);
+
+    memcpy (copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+char *arena_strdup (struct arena_s *arena, const char *str)
+{
+    return arena_strndup (arena, str, strlen (str));
+}
+
+struct arena_mark_s arena_mark (struct arena_s *arena)
+{
+    struct arena_mark_s mark = {arena->head, arena->head->used};
+
+    return mark;
+}
+
+/* Forget everything allocated since mark was taken. */
+void arena_rewind (struct arena_s *arena, struct arena_mark_s mark)
+{
+    free_blocks_until (arena, mark.block);
+    arena->head->used = mark.used;
+}
@@ -0,0 +1,40 @@
+#ifndef _PROXYLAB_ARENA_H_
+#define _PROXYLAB_ARENA_H_
+
+#include "csapp.h"
+
+#define ARENA_BLOCK_SIZE (32 * 1024)    /* what an arena starts with */
+#define ARENA_ALIGN 16
+#define ARENA_MAXFREE 256               /* idle arenas kept for reuse */
+
+/*
+ * Bump-pointer allocator for memory that lives exactly as long as a
+ * connection (or one request on it).  Nothing is freed on its own:
+ * arena_rewind() drops everything allocated since a mark, and
+ * arena_release() drops the lot and puts the arena on a free list for
+ * the next connection, so a steady stream of connections settles into
+ * no malloc() calls at all.
+ */
+struct arena_block_s;
+
+struct arena_s {
+    struct arena_block_s *head;     /* newest block, the one bumped */
+    struct arena_s *next_free;
+};
+
+struct arena_mark_s {
+    struct arena_block_s *block;
+    size_t used;
+};
+
+extern struct arena_s *arena_new (void);
+extern void arena_release (struct arena_s *arena);
+extern void *arena_alloc (struct arena_s *arena, size_t size);
+extern void *arena_calloc (struct arena_s *arena, size_t size);
+extern char *arena_strdup (struct arena_s *arena, const char *str);
+extern char *arena_strndup (struct arena_s *arena, const char *str,
+                            size_t len);
+extern struct arena_mark_s arena_mark (struct arena_s *arena);
+extern void arena_rewind (struct arena_s *arena, struct arena_mark_s mark);
+
+#endif
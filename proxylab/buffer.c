@@ -1,65 +1,84 @@
 #include "buffer.h"
 #include "network.h"
+#include "proxy.h"
 #include "MITLogModule.h"
 
 #define BUFFER_HEAD(x) (x)->head
 #define BUFFER_TAIL(x) (x)->tail
 
-#include "MITLogModule.h"
-
-struct bufline_s {
-    char *string;  /* the actual string of data */
-    struct bufline_s *next; /* pointer to next in linked list */
-    size_t length;          /* length of the string of data */
-    size_t pos;             /* start sending from this offset */
-    unsigned int primary;   /* whether used for cache key */
+/*
+ * A buffer is a list of fixed-size chunks.  Appends copy into the tail
+ * chunk and only take a new one when it fills, so a response's header
+ * lines share a chunk or two instead of costing two allocations each,
+ * and the whole buffer goes out in a single writev().  Emptied chunks
+ * go back to a shared pool rather than to free().
+ */
+struct bufchunk_s {
+    struct bufchunk_s *next;
+    size_t start;               /* first byte not yet sent */
+    size_t end;                 /* one past the last byte written */
+    char data[BUFFER_CHUNK_SIZE];
 };
 
 struct buffer_s {
-    struct bufline_s *head; /* top of the buffer */
-    struct bufline_s *tail; /* bottom of the buffer */
+    struct bufchunk_s *head; /* top of the buffer */
+    struct bufchunk_s *tail; /* bottom of the buffer, the one appended to */
     size_t size;            /* total size of the buffer */
+    size_t consumed;        /* bytes sent from the front since last clear */
+    struct {
+        size_t from, length;    /* counted from the last clear */
+    } keys[BUFFER_MAXKEYS];     /* the parts that make up the cache key */
+    unsigned int nkeys;
+    struct arena_s *arena;  /* holds the buffer_s itself, or NULL */
 };
 
-static struct bufline_s *makenewline (char *data, size_t length, unsigned int pri)
-{
-    struct bufline_s *newline;
-
-    assert (data != NULL);
-    assert (length > 0);
+static struct {
+    pthread_mutex_t lock;
+    struct bufchunk_s *head;
+    unsigned int count;
+} chunk_free = {PTHREAD_MUTEX_INITIALIZER, NULL, 0};
 
-    newline = (struct bufline_s *) Malloc (sizeof (struct bufline_s));
-    if (!newline)
-        return NULL;
+static struct bufchunk_s *chunk_new (void)
+{
+    struct bufchunk_s *chunk;
 
-    newline->string = (char *) Malloc (length);
-    if (!newline->string) {
-        Free (newline);
-        return NULL;
+    pthread_mutex_lock (&chunk_free.lock);
+    chunk = chunk_free.head;
+    if (chunk) {
+        chunk_free.head = chunk->next;
+        chunk_free.count--;
     }
+    pthread_mutex_unlock (&chunk_free.lock);
+    if (!chunk)
+        chunk = (struct bufchunk_s *) Malloc (sizeof (struct bufchunk_s));
 
-    memcpy (newline->string, data, length);
-
-    newline->next = NULL;
-    newline->length = length;
-    newline->primary = pri;
-
-    newline->pos = 0;
-
-    return newline;
+    chunk->next = NULL;
+    chunk->start = chunk->end = 0;
+    return chunk;
 }
 
-static void free_line (struct bufline_s *line)
+/* Back to the pool, or freed past BUFFER_MAXFREE idle chunks. */
+static void chunk_release (struct bufchunk_s *chunk)
 {
-    assert (line != NULL);
-
-    if (!line)
-        return;
-
-    if (line->string)
-        Free (line->string);
+    pthread_mutex_lock (&chunk_free.lock);
+    if (chunk_free.count != BUFFER_MAXFREE) {
+        chunk->next = chunk_free.head;
+        chunk_free.head = chunk;
+        chunk_free.count++;
+        chunk = NULL;
+    }
+    pthread_mutex_unlock (&chunk_free.lock);
+    if (chunk)
+        Free (chunk);
+}
 
-    Free (line);
+static void init_buffer (struct buffer_s *buffptr, struct arena_s *arena)
+{
+    BUFFER_HEAD (buffptr) = BUFFER_TAIL (buffptr) = NULL;
+    buffptr->size = 0;
+    buffptr->consumed = 0;
+    buffptr->nkeys = 0;
+    buffptr->arena = arena;
 }
 
 struct buffer_s *new_buffer (void)
@@ -69,25 +88,58 @@ struct buffer_s *new_buffer (void)
     buffptr = (struct buffer_s *) Malloc (sizeof (struct buffer_s));
     if (!buffptr)
             return NULL;
-    BUFFER_HEAD (buffptr) = BUFFER_TAIL (buffptr) = NULL;
-    buffptr->size = 0;
+    init_buffer (buffptr, NULL);
 
     return buffptr;
 }
 
-void delete_buffer (struct buffer_s *buffptr)
+/*
+ * A buffer whose struct lives in arena, for connections that keep it
+ * for their whole life.  Its chunks still come from the pool, so
+ * clearing it gives them back without waiting for the arena.
+ */
+struct buffer_s *new_arena_buffer (struct arena_s *arena)
 {
-    struct bufline_s *next;
+    struct buffer_s *buffptr;
+
+    buffptr = (struct buffer_s *) arena_alloc (arena, sizeof (struct buffer_s));
+    init_buffer (buffptr, arena);
+
+    return buffptr;
+}
+
+/*
+ * Drop the contents but keep the buffer itself, along with one empty
+ * chunk for whatever it holds next.
+ */
+void clear_buffer (struct buffer_s *buffptr)
+{
+    struct bufchunk_s *next;
 
     assert (buffptr != NULL);
 
-    while (BUFFER_HEAD (buffptr)) {
-        next = BUFFER_HEAD (buffptr)->next;
-        free_line (BUFFER_HEAD (buffptr));
-        BUFFER_HEAD (buffptr) = next;
+    if (BUFFER_HEAD (buffptr)) {
+        while ((next = BUFFER_HEAD (buffptr)->next) != NULL) {
+            chunk_release (BUFFER_HEAD (buffptr));
+            BUFFER_HEAD (buffptr) = next;
+        }
+        BUFFER_HEAD (buffptr)->start = BUFFER_HEAD (buffptr)->end = 0;
     }
+    BUFFER_TAIL (buffptr) = BUFFER_HEAD (buffptr);
+    buffptr->size = 0;
+    buffptr->consumed = 0;
+    buffptr->nkeys = 0;
+}
 
-    Free (buffptr);
+void delete_buffer (struct buffer_s *buffptr)
+{
+    assert (buffptr != NULL);
+
+    clear_buffer (buffptr);
+    if (BUFFER_HEAD (buffptr))
+        chunk_release (BUFFER_HEAD (buffptr));
+    if (!buffptr->arena)
+        Free (buffptr);
 }
 
 size_t buffer_size (struct buffer_s *buffptr)
@@ -95,112 +147,267 @@ size_t buffer_size (struct buffer_s *buffptr)
     return buffptr->size;
 }
 
+/* Room at the end of the tail chunk, adding a chunk if there is none. */
+static struct bufchunk_s *tail_with_room (struct buffer_s *buffptr)
+{
+    struct bufchunk_s *tail = BUFFER_TAIL (buffptr);
+
+    if (tail && tail->end != BUFFER_CHUNK_SIZE)
+        return tail;
+
+    tail = chunk_new ();
+    if (BUFFER_TAIL (buffptr))
+        BUFFER_TAIL (buffptr)->next = tail;
+    else
+        BUFFER_HEAD (buffptr) = tail;
+    BUFFER_TAIL (buffptr) = tail;
+    return tail;
+}
+
 int add_to_buffer (struct buffer_s *buffptr, char *data, 
                    size_t length)
 {
     return add_to_buffer_primary(buffptr, data, length, 0);
 }
 
+/*
+ * Append length bytes.  With primary set they also count toward the
+ * cache key; a primary piece that directly follows the previous one
+ * extends it, so BUFFER_MAXKEYS only limits separate runs.
+ */
 int add_to_buffer_primary (struct buffer_s *buffptr, char *data, 
                            size_t length, unsigned int primary)
 {
-    struct bufline_s *newline;
+    struct bufchunk_s *tail;
+    size_t offset = buffptr->consumed + buffptr->size;
+    size_t n;
 
     assert (buffptr != NULL);
     assert (data != NULL);
     assert (length > 0);
-    if (BUFFER_HEAD (buffptr) == NULL)
-        assert (buffptr->size == 0);
-    else
-        assert (buffptr->size > 0);
-    if (!(newline = makenewline (data, length, primary)))
-        return -1;
-
-    if (buffptr->size == 0)
-        BUFFER_HEAD (buffptr) = BUFFER_TAIL (buffptr) = newline;
-    else {
-        BUFFER_TAIL (buffptr)->next = newline;
-        BUFFER_TAIL (buffptr) = newline;
+
+    if (primary) {
+        unsigned int last = buffptr->nkeys - 1;
+
+        if (buffptr->nkeys
+            && buffptr->keys[last].from + buffptr->keys[last].length == offset) {
+            buffptr->keys[last].length += length;
+        } else if (buffptr->nkeys == BUFFER_MAXKEYS) {
+            return -1;
+        } else {
+            buffptr->keys[buffptr->nkeys].from = offset;
+            buffptr->keys[buffptr->nkeys].length = length;
+            buffptr->nkeys++;
+        }
     }
 
-    buffptr->size += length;
+    while (length > 0) {
+        tail = tail_with_room (buffptr);
+        n = min (length, BUFFER_CHUNK_SIZE - tail->end);
+        memcpy (tail->data + tail->end, data, n);
+        tail->end += n;
+        data += n;
+        length -= n;
+        buffptr->size += n;
+    }
     return 0;
 }
 
+/* Copy length bytes starting offset bytes into the buffer to dst. */
+static void copy_out (struct buffer_s *buffptr, size_t offset, char *dst,
+                      size_t length)
+{
+    struct bufchunk_s *chunk = BUFFER_HEAD (buffptr);
+    size_t n;
+
+    while (chunk && offset >= chunk->end - chunk->start) {
+        offset -= chunk->end - chunk->start;
+        chunk = chunk->next;
+    }
+    while (length > 0) {
+        assert (chunk != NULL);
+        n = min (length, chunk->end - chunk->start - offset);
+        memcpy (dst, chunk->data + chunk->start + offset, n);
+        dst += n;
+        length -= n;
+        offset = 0;
+        chunk = chunk->next;
+    }
+}
+
 int buffer_to_str(struct buffer_s* buffptr, char** str)
 {
-    char* p;
     assert(buffptr != NULL);
-    struct bufline_s* ptr = BUFFER_HEAD(buffptr);
     *str = (char*)Malloc(buffptr -> size + 1);
-    p = (*str);
-    while (ptr) {
-        memcpy(p, ptr -> string, ptr -> length);
-        p = p + ptr -> length; 
-        ptr = ptr -> next;
-    }
-    (*p) = '\0';
+    copy_out(buffptr, 0, *str, buffptr -> size);
+    (*str)[buffptr -> size] = '\0';
     return 0;
 }
 
 int buffer_to_key(struct buffer_s* buffptr, char** str)
 {
     char* p;
-    ssize_t size = 0;
-    struct bufline_s* ptr = BUFFER_HEAD(buffptr);
-    while(ptr){
-        if(ptr -> primary) size = size + ptr -> length;
-        ptr = ptr -> next;
-    }
+    size_t size = 0;
+    unsigned int i;
+
+    assert(buffptr != NULL);
+    for(i = 0; i != buffptr -> nkeys; i++)
+        size = size + buffptr -> keys[i].length;
     *str = (char*)Malloc(size + 1);
     p = (*str);
-    ptr = BUFFER_HEAD(buffptr);
-    while(ptr){
-        if(ptr -> primary){
-            memcpy(p, ptr -> string, ptr -> length);
-            p = p + ptr -> length; 
-        }
-        ptr = ptr -> next;
+    for(i = 0; i != buffptr -> nkeys; i++){
+        /* The key has to be taken before its bytes are sent. */
+        assert(buffptr -> keys[i].from >= buffptr -> consumed);
+        copy_out(buffptr, buffptr -> keys[i].from - buffptr -> consumed,
+                 p, buffptr -> keys[i].length);
+        p = p + buffptr -> keys[i].length;
     }
     (*p) = '\0';
     return 0;
 }
 
-int buffer_from_str(struct buffer_s* buffptr, char* str)
+/*
+ * Point iov at the unsent chunks, up to BUFFER_MAXIOV of them, starting
+ * from chunk.  Returns how many entries were filled; *total, if given,
+ * gets the number of bytes they cover.
+ */
+static int fill_iov (struct bufchunk_s *chunk, struct iovec *iov,
+                     size_t *total)
 {
-    assert(buffptr != NULL);
-    assert(str != NULL);
-
-    char* temp;
-    char* p = str;
-    ssize_t len = 0;
-    while(p < str + strlen(str)){
-        temp = strstr(p, "\n");
-        if(temp == NULL) break;
-        len = temp - p + 1;
-        char* line = (char*)Malloc(len);
-        memcpy(line, p, len);
-        add_to_buffer(buffptr, line, len);
-        p = temp + 1;
+    int n = 0;
+    size_t bytes = 0;
+
+    for (; chunk && n != BUFFER_MAXIOV; chunk = chunk->next) {
+        if (chunk->end == chunk->start)
+            continue;
+        iov[n].iov_base = chunk->data + chunk->start;
+        iov[n].iov_len = chunk->end - chunk->start;
+        bytes += iov[n].iov_len;
+        n++;
     }
-    return 0;
+    if (total)
+        *total = bytes;
+    return n;
 }
 
+/* Write the whole buffer, leaving its contents in place. */
 int write_buffer(struct buffer_s* buffptr, int fd)
 {
+    struct iovec iov[BUFFER_MAXIOV];
+    struct bufchunk_s* chunk;
+    int i, n;
+
     assert(buffptr != NULL);
-    struct bufline_s* line = buffptr -> head;
-    while(line != NULL){
-        if(safe_write(fd, line -> string, line -> length) < 0){
+    chunk = BUFFER_HEAD(buffptr);
+    while((n = fill_iov(chunk, iov, NULL)) > 0){
+        if(safe_writev(fd, iov, n) < 0){
             MITLogWrite(MITLOG_LEVEL_ERROR, "write buffer error!");
             return -1;
         }
-        line = line -> next;
+        for(i = 0; i != n; chunk = chunk -> next)
+            if(chunk -> end != chunk -> start)
+                i++;
     }
     return 0;
 }
 
-int read_buffer(struct buffer_s* buffptr, int fd)
+/*
+ * Append whatever is waiting on fd, at most length bytes, received
+ * straight into the tail chunk and a fresh one after it.  Returns the
+ * number of bytes read, 0 on end of file, or -errno (-EAGAIN when a
+ * non-blocking socket has nothing to give).
+ */
+ssize_t read_buffer(struct buffer_s* buffptr, int fd, size_t length)
 {
-   return 0; 
+    struct iovec iov[2];
+    struct bufchunk_s *tail, *spare = NULL;
+    ssize_t len;
+    size_t room;
+    int n = 1;
+
+    assert(buffptr != NULL);
+    assert(length > 0);
+
+    tail = tail_with_room(buffptr);
+    room = BUFFER_CHUNK_SIZE - tail -> end;
+    iov[0].iov_base = tail -> data + tail -> end;
+    iov[0].iov_len = min(length, room);
+    if(length > room){
+        spare = chunk_new();
+        iov[1].iov_base = spare -> data;
+        iov[1].iov_len = min(length - room, BUFFER_CHUNK_SIZE);
+        n = 2;
+    }
+
+    do {
+        len = readv(fd, iov, n);
+    } while (len < 0 && errno == EINTR);
+
+    if(len > 0){
+        buffptr -> size += len;
+        if((size_t) len <= room){
+            tail -> end += len;
+        } else {
+            tail -> end = BUFFER_CHUNK_SIZE;
+            spare -> end = len - room;
+            spare -> next = tail -> next;
+            tail -> next = spare;
+            BUFFER_TAIL(buffptr) = spare;
+            spare = NULL;
+        }
+    }
+    if(spare)
+        chunk_release(spare);
+    return len < 0 ? -errno : len;
+}
+
+/*
+ * Send as much of the buffer as fd accepts without blocking, dropping
+ * what went out.  Returns the number of bytes sent (possibly 0 when
+ * the socket is full) or -errno on a hard error.
+ */
+ssize_t send_buffer(struct buffer_s* buffptr, int fd)
+{
+    struct iovec iov[BUFFER_MAXIOV];
+    struct msghdr msg;
+    struct bufchunk_s* chunk;
+    ssize_t len;
+    size_t sent = 0, want, n;
+
+    assert(buffptr != NULL);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    while(buffptr -> size > 0){
+        msg.msg_iovlen = fill_iov(BUFFER_HEAD(buffptr), iov, &want);
+        len = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(len < 0){
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -errno;
+        }
+
+        sent += len;
+        buffptr -> size -= len;
+        buffptr -> consumed += len;
+        if((size_t) len < want)
+            want = 0;           /* a short write: the socket is full */
+        while(len > 0){
+            chunk = BUFFER_HEAD(buffptr);
+            n = min((size_t) len, chunk -> end - chunk -> start);
+            chunk -> start += n;
+            len -= n;
+            if(chunk -> start == chunk -> end && chunk -> next){
+                BUFFER_HEAD(buffptr) = chunk -> next;
+                chunk_release(chunk);
+            }
+        }
+        if(want == 0)
+            break;
+    }
+    if(buffptr -> size == 0)
+        clear_buffer(buffptr);
+    return sent;
 }
@@ -2,9 +2,17 @@
 #define _PROXYLAB_BUFFER_H_
 
 #include "csapp.h"
+#include "arena.h"
+
+#define BUFFER_CHUNK_SIZE (8 * 1024)
+#define BUFFER_MAXFREE 1024     /* idle chunks kept for reuse */
+#define BUFFER_MAXIOV 64        /* chunks handed to one writev() */
+#define BUFFER_MAXKEYS 4        /* separate runs of cache key data */
 
 struct buffer_s;
 extern struct buffer_s *new_buffer (void);
+extern struct buffer_s *new_arena_buffer (struct arena_s *arena);
+extern void clear_buffer (struct buffer_s *buffptr);
 extern void delete_buffer (struct buffer_s *buffptr);
 extern size_t buffer_size (struct buffer_s *buffptr);
 
@@ -14,9 +22,9 @@ extern int add_to_buffer_primary (struct buffer_s *buffptr, char *data,
                                   size_t length, unsigned int primary);
 extern int buffer_to_str(struct buffer_s *buffptr, char** str);
 extern int buffer_to_key(struct buffer_s *buffptr, char** str);
-extern int buffer_from_str(struct buffer_s *buffptr, char* str);
 
 extern int write_buffer(struct buffer_s *buffptr, int fd);
-extern int read_buffer(struct buffer_s *buffptr, int fd);
+extern ssize_t read_buffer(struct buffer_s *buffptr, int fd, size_t length);
+extern ssize_t send_buffer(struct buffer_s *buffptr, int fd);
 
 #endif
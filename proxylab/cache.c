@@ -1,75 +1,448 @@
 #include "cache.h"
 #include "proxy.h"
 
-int cache_init(struct cache_s **cache)
+/* FNV-1a; only used to pick a shard. */
+static uint32_t cache_hash(const char *key)
 {
+    uint32_t hash = 2166136261u;
+
+    while(*key){
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct cache_shard_s *cache_shard(struct cache_s *cache,
+                                         const char *key)
+{
+    return &cache -> shards[cache_hash(key) % cache -> nshards];
+}
+
+int cache_init(struct cache_s **cache, const struct policy_ops_s *policy)
+{
+    unsigned int i;
+    struct cache_shard_s *shard;
+
     *cache = (struct cache_s*)Malloc(sizeof(struct cache_s));
     if(*cache == NULL) 
         return -1;
     
-    (*cache) -> map = hashmap_create(CACHE_BUCKET);
-    
-    if((*cache) -> map == NULL)
-        return -1;
-
+    /*
+     * No more shards than leaves each one room for the biggest object:
+     * a smaller share would make every such insert evict, even with the
+     * cache as a whole nowhere near full.
+     */
+    (*cache) -> nshards = CACHE_SHARDS;
+    if((*cache) -> nshards > MAX_CACHE_SIZE / MAX_OBJECT_SIZE)
+        (*cache) -> nshards = MAX_CACHE_SIZE / MAX_OBJECT_SIZE;
+    if((*cache) -> nshards == 0)
+        (*cache) -> nshards = 1;
+    (*cache) -> shard_size = MAX_CACHE_SIZE / (*cache) -> nshards;
     (*cache) -> curr_size = 0;
-    
-    if(!pthread_rwlock_init(&((*cache) -> lock), NULL))
+    (*cache) -> shards = (struct cache_shard_s*)Calloc((*cache) -> nshards,
+                                                       sizeof(struct cache_shard_s));
+    if((*cache) -> shards == NULL)
         return -1;
+
+    for(i = 0; i != (*cache) -> nshards; i++){
+        shard = &(*cache) -> shards[i];
+        shard -> map = hashmap_create(CACHE_BUCKET);
+        if(shard -> map == NULL)
+            return -1;
+        shard -> curr_size = 0;
+        shard -> flights = NULL;
+        if(sketch_init(&shard -> sketch, CACHE_SKETCH_WIDTH) < 0)
+            return -1;
+        shard -> policy = policy_new(policy, (*cache) -> shard_size);
+        if(shard -> policy == NULL)
+            return -1;
+        if(pthread_mutex_init(&shard -> lock, NULL) != 0)
+            return -1;
+    }
     return 0;
 }
 
-int cache_query(struct cache_s *cache, 
-                const char* key, void **value)
+size_t cache_size(struct cache_s *cache)
 {
-    pthread_rwlock_rdlock(&cache -> lock);
-    hashmap_entry_by_key(cache -> map, key, value);
-    pthread_rwlock_unlock(&cache -> lock);
-    return 0;
+    return __atomic_load_n(&cache -> curr_size, __ATOMIC_RELAXED);
+}
+
+/*
+ * The biggest response worth capturing: with a disk tier, objects too
+ * big for memory still go to disk.
+ */
+size_t cache_object_limit(void)
+{
+    return store_enabled() ? STORE_MAX_OBJECT : MAX_OBJECT_SIZE;
+}
+
+static struct cache_object_s *cache_object_new(const char *value, size_t len,
+                                               time_t expires)
+{
+    struct cache_object_s *object;
+
+    object = (struct cache_object_s*)Malloc(sizeof(struct cache_object_s) + len);
+    if(!object)
+        return NULL;
+    object -> refcount = 1;
+    object -> len = len;
+    object -> expires = expires;
+    object -> segment = NULL;
+    memcpy(object -> inline_data, value, len);
+    object -> data = object -> inline_data;
+    return object;
+}
+
+/* A referenced object for key from the disk tier, or NULL. */
+static struct cache_object_s *cache_object_stored(const char *key)
+{
+    struct cache_object_s *object;
+    struct store_segment_s *segment;
+    const char *data;
+    size_t len;
+    time_t expires;
+
+    if((data = store_get(key, &len, &expires, &segment)) == NULL)
+        return NULL;
+    object = (struct cache_object_s*)Malloc(sizeof(struct cache_object_s));
+    object -> refcount = 1;
+    object -> len = len;
+    object -> expires = expires;
+    object -> data = data;
+    object -> segment = segment;
+    return object;
+}
+
+/* Whether object may still be served without asking the origin. */
+int cache_object_fresh(struct cache_object_s *object, time_t now)
+{
+    return __atomic_load_n(&object -> expires, __ATOMIC_RELAXED) > now;
+}
+
+/*
+ * The origin says object, found stale under key, is still current.  It
+ * is refreshed in place, whether or not it is still in its shard, and
+ * so is key's record in the disk tier, which is where a memory object
+ * evicted meanwhile went, and where later lookups of a disk object
+ * read their expiry from.
+ */
+void cache_refresh(struct cache_s *cache, const char* key,
+                   struct cache_object_s *object, time_t expires)
+{
+    __atomic_store_n(&object -> expires, expires, __ATOMIC_RELAXED);
+    store_refresh(key, expires);
+}
+
+void cache_release(struct cache_object_s *object)
+{
+    if(__atomic_sub_fetch(&object -> refcount, 1, __ATOMIC_ACQ_REL) == 0){
+        if(object -> segment)
+            store_segment_release(object -> segment);
+        Free(object);
+    }
+}
+
+/* The map stores only the pointer to each object. */
+static struct cache_object_s *entry_object(void *data)
+{
+    return *(struct cache_object_s **)data;
+}
+
+/* Account for an object that has left the shard's map. */
+static void shard_forget(struct cache_s *cache, struct cache_shard_s *shard,
+                         struct cache_object_s *object)
+{
+    shard -> curr_size = shard -> curr_size - object -> len;
+    __atomic_sub_fetch(&cache -> curr_size, object -> len, __ATOMIC_RELAXED);
+    cache_release(object);
+}
+
+/* Drop key's entry, if any, with the shard lock held. */
+static void shard_remove(struct cache_s *cache, struct cache_shard_s *shard,
+                         const char *key)
+{
+    void *data;
+
+    if(hashmap_entry_by_key(shard -> map, key, &data) > 0){
+        struct cache_object_s *object = entry_object(data);
+
+        hashmap_remove(shard -> map, key);
+        policy_remove(shard -> policy, key);
+        shard_forget(cache, shard, object);
+    }
+}
+
+/* Look key up with the shard lock held, taking a reference on a hit. */
+static struct cache_object_s *shard_lookup(struct cache_shard_s *shard,
+                                           const char *key)
+{
+    struct cache_object_s *object = NULL;
+    void *data;
+
+    if(hashmap_entry_by_key(shard -> map, key, &data) > 0){
+        object = entry_object(data);
+        __atomic_add_fetch(&object -> refcount, 1, __ATOMIC_RELAXED);
+        policy_hit(shard -> policy, key);
+    }
+    return object;
+}
+
+static struct cache_flight_s *shard_flight(struct cache_shard_s *shard,
+                                           const char *key)
+{
+    struct cache_flight_s *flight;
+
+    for(flight = shard -> flights; flight; flight = flight -> next)
+        if(!strcmp(flight -> key, key))
+            return flight;
+    return NULL;
+}
+
+static void flight_put(struct cache_flight_s *flight)
+{
+    if(--flight -> users > 0)
+        return;
+    pthread_cond_destroy(&flight -> done);
+    Free(flight -> key);
+    Free(flight);
+}
+
+/*
+ * Returns a referenced object, or NULL on a miss.  Only the pointer
+ * is touched under the lock, so the hold time does not depend on the
+ * size of the object.  A hit also refreshes the entry's recency, so
+ * the shard lock is taken exclusively.
+ */
+struct cache_object_s *cache_query(struct cache_s *cache, 
+                                   const char* key)
+{
+    struct cache_shard_s *shard = cache_shard(cache, key);
+    struct cache_object_s *object;
+
+    pthread_mutex_lock(&shard -> lock);
+    sketch_increment(&shard -> sketch, key);
+    object = shard_lookup(shard, key);
+    pthread_mutex_unlock(&shard -> lock);
+    if(object == NULL)
+        object = cache_object_stored(key);
+    return object;
+}
+
+/*
+ * cache_query() that coalesces concurrent misses.  The first miss for
+ * a key returns NULL with *leader set; it must fetch the object and
+ * then call cache_flight_end() whether or not the fetch worked.  Later
+ * misses for the same key sleep until the leader is done and then look
+ * again.  If the object still is not there (the fetch failed, was too
+ * big to cache, or took longer than CACHE_FLIGHT_TIMEOUT) they return
+ * NULL with *leader clear and fetch for themselves.
+ */
+struct cache_object_s *cache_query_or_lead(struct cache_s *cache,
+                                           const char* key, int *leader)
+{
+    struct cache_shard_s *shard = cache_shard(cache, key);
+    struct cache_object_s *object;
+    struct cache_flight_s *flight;
+    struct timespec deadline;
+
+    *leader = 0;
+    pthread_mutex_lock(&shard -> lock);
+    sketch_increment(&shard -> sketch, key);
+    if((object = shard_lookup(shard, key)) != NULL){
+        pthread_mutex_unlock(&shard -> lock);
+        return object;
+    }
+
+    /*
+     * The disk tier has its own lock, so it is asked only once the
+     * shard lock is dropped; the flight keeps other misses waiting
+     * meanwhile, and is ended at once if the disk has the object.
+     */
+    if((flight = shard_flight(shard, key)) == NULL){
+        flight = (struct cache_flight_s*)Malloc(sizeof(struct cache_flight_s));
+        flight -> key = strdup(key);
+        flight -> users = 1;
+        flight -> finished = 0;
+        pthread_cond_init(&flight -> done, NULL);
+        flight -> next = shard -> flights;
+        shard -> flights = flight;
+        pthread_mutex_unlock(&shard -> lock);
+        if((object = cache_object_stored(key)) != NULL){
+            cache_flight_end(cache, key);
+            return object;
+        }
+        *leader = 1;
+        return NULL;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CACHE_FLIGHT_TIMEOUT;
+    flight -> users++;
+    while(!flight -> finished){
+        if(pthread_cond_timedwait(&flight -> done, &shard -> lock,
+                                  &deadline) == ETIMEDOUT)
+            break;
+    }
+    flight_put(flight);
+
+    object = shard_lookup(shard, key);
+    pthread_mutex_unlock(&shard -> lock);
+    if(object == NULL)
+        object = cache_object_stored(key);
+    return object;
+}
+
+void cache_flight_end(struct cache_s *cache, const char* key)
+{
+    struct cache_shard_s *shard = cache_shard(cache, key);
+    struct cache_flight_s **pp, *flight;
+
+    pthread_mutex_lock(&shard -> lock);
+    for(pp = &shard -> flights; (flight = *pp) != NULL; pp = &flight -> next){
+        if(!strcmp(flight -> key, key)){
+            *pp = flight -> next;
+            flight -> finished = 1;
+            pthread_cond_broadcast(&flight -> done);
+            flight_put(flight);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard -> lock);
+}
+
+/*
+ * The origin sent something for key that is not cached: no copy of
+ * the old one, in memory or on disk, may be served after it.
+ */
+void cache_remove(struct cache_s *cache, const char* key)
+{
+    struct cache_shard_s *shard = cache_shard(cache, key);
+
+    pthread_mutex_lock(&shard -> lock);
+    shard_remove(cache, shard, key);
+    pthread_mutex_unlock(&shard -> lock);
+    store_remove(key);
+}
+
+/* Write what eviction took out of memory to the disk tier. */
+static void cache_spill(struct cache_spill_s *spill, unsigned int n)
+{
+    unsigned int i;
+
+    for(i = 0; i != n; i++){
+        store_put(spill[i].key, spill[i].object -> data, spill[i].object -> len,
+                  __atomic_load_n(&spill[i].object -> expires, __ATOMIC_RELAXED));
+        Free(spill[i].key);
+        cache_release(spill[i].object);
+    }
 }
 
+/*
+ * Whether key is worth evicting victim for: TinyLFU admission, so a
+ * burst of one-off requests cannot flush objects that keep being asked
+ * for.  Ties go to the object already cached.
+ */
+static int shard_admit(struct cache_shard_s *shard, const char *key,
+                       const char *victim)
+{
+    return sketch_estimate(&shard -> sketch, key)
+           > sketch_estimate(&shard -> sketch, victim);
+}
+
+/*
+ * Objects too big for memory go straight to the disk tier, if there is
+ * one, and objects evicted from memory follow them there.  So does an
+ * object that would need an eviction but is asked for less often than
+ * the entry it would displace.  The disk writes happen after the shard
+ * lock is dropped.  A key kept in memory, or evicted without being
+ * written, loses its disk copy, so an older version never comes back
+ * from there.
+ */
 int cache_update(struct cache_s *cache, 
                  const char* key, const char* value, 
-                 size_t len)
+                 size_t len, time_t expires)
 {
-    pthread_rwlock_wrlock(&cache -> lock);
-    ssize_t freed_size = MAX_CACHE_SIZE - cache -> curr_size;
-    ssize_t size;
+    struct cache_shard_s *shard;
+    struct cache_object_s *object, *object_old;
+    struct cache_spill_s spill[CACHE_MAXSPILL];
+    unsigned int nspill = 0;
+    const char *victim;
+    void *data;
     
+    /* An older copy left in memory would hide the new one on disk. */
     if(len > MAX_OBJECT_SIZE){
-        //MITLogWrite(MITLOG_LEVEL_WARNING,
-        //            "object size (%d) exceeds the MAX_OBJECT_SIZE(%d)",
-        //            len, MAX_OBJECT_SIZE);
-        pthread_rwlock_unlock(&cache -> lock);
+        shard = cache_shard(cache, key);
+        pthread_mutex_lock(&shard -> lock);
+        shard_remove(cache, shard, key);
+        pthread_mutex_unlock(&shard -> lock);
+        store_put(key, value, len, expires);
         return 0;
     }
-    
-    if(len > MAX_CACHE_SIZE - cache -> curr_size){
-        //MITLogWrite(MITLOG_LEVEL_WARNING,
-        //            "Cache (size: %d) is almost full."
-        //            "Should evict object for incoming object"
-        //            "(size: %d)", cache -> curr_size, len);
-        while(freed_size < len){
-            if((size = hashmap_remove_lru(cache -> map)) < 0){
-                pthread_rwlock_unlock(&cache -> lock);
-                return -1;
+
+    /* The copy is made before the lock is taken. */
+    if((object = cache_object_new(value, len, expires)) == NULL)
+        return -1;
+
+    shard = cache_shard(cache, key);
+    pthread_mutex_lock(&shard -> lock);
+
+    /* Two misses for the same key can race here; keep only the newest. */
+    shard_remove(cache, shard, key);
+
+    /*
+     * Only evict while both the whole cache is over budget and this
+     * shard is over its share; shards over their share give the space
+     * back the next time they are written to.  Admission is judged
+     * against the first victim only.
+     */
+    if(cache_size(cache) + len > MAX_CACHE_SIZE
+       && shard -> curr_size + len > cache -> shard_size
+       && (victim = policy_victim(shard -> policy)) != NULL
+       && !shard_admit(shard, key, victim)){
+        pthread_mutex_unlock(&shard -> lock);
+        cache_release(object);
+        store_put(key, value, len, expires);
+        return 0;
+    }
+
+    while(cache_size(cache) + len > MAX_CACHE_SIZE
+          && shard -> curr_size + len > cache -> shard_size){
+        if((victim = policy_victim(shard -> policy)) == NULL)
+            break;
+        if(hashmap_entry_by_key(shard -> map, victim, &data) > 0){
+            object_old = entry_object(data);
+            if(store_enabled() && nspill != CACHE_MAXSPILL){
+                spill[nspill].key = strdup(victim);
+                spill[nspill].object = object_old;
+                __atomic_add_fetch(&object_old -> refcount, 1, __ATOMIC_RELAXED);
+                nspill++;
+            } else {
+                store_remove(victim);
             }
+            hashmap_remove(shard -> map, victim);
             //MITLogWrite(MITLOG_LEVEL_COMMON, "successfully evict %d bytes", size);
-            cache -> curr_size = cache -> curr_size - size;
-            freed_size += size;
+            shard_forget(cache, shard, object_old);
         }
+        policy_evict(shard -> policy);
     }
 
-    if(hashmap_insert(cache -> map, key, value, len) < 0){
-        pthread_rwlock_unlock(&cache -> lock);
+    if(hashmap_insert(shard -> map, key, &object, sizeof(object)) < 0){
+        pthread_mutex_unlock(&shard -> lock);
+        cache_release(object);
+        store_remove(key);
+        cache_spill(spill, nspill);
         return -1;
     }
-    cache -> curr_size = cache -> curr_size + len;
+    policy_insert(shard -> policy, key, len);
+    shard -> curr_size = shard -> curr_size + len;
+    __atomic_add_fetch(&cache -> curr_size, len, __ATOMIC_RELAXED);
 
-    MITLogWrite(MITLOG_LEVEL_COMMON, "New cache object added, current size: %d",
-                cache -> curr_size);
+    pthread_mutex_unlock(&shard -> lock);
+    store_remove(key);
+    cache_spill(spill, nspill);
 
-    pthread_rwlock_unlock(&cache -> lock);
+    MITLogWrite(MITLOG_LEVEL_COMMON, "New cache object added, current size: %lu",
+                (unsigned long)cache_size(cache));
     return 0;
 }
-
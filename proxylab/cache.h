@@ -3,22 +3,96 @@
 
 #include "csapp.h"
 #include "hashmap.h"
+#include "policy.h"
+#include "sketch.h"
+#include "store.h"
 
 #define CACHE_BUCKET 128
+#define CACHE_SHARDS 16          /* at most; see cache_init() */
+#define CACHE_FLIGHT_TIMEOUT 30   /* seconds a miss waits on another fetch */
+#define CACHE_MAXSPILL 64         /* evictions written to disk per update */
+#define CACHE_SKETCH_WIDTH 1024   /* counters per sketch row, per shard */
 
-struct cache_s{
+/*
+ * An immutable cached response.  The shard that holds it owns one
+ * reference, and cache_query() hands out another.  Eviction only drops
+ * the shard's reference, so a reader can keep sending from data until
+ * it calls cache_release().  An object found in the disk tier is never
+ * in a shard: its data points into a store segment, which it keeps
+ * mapped until the last reference goes.  Only expires ever changes,
+ * when a revalidation finds the object still current.
+ */
+struct cache_object_s {
+    int refcount;
+    size_t len;
+    time_t expires;                     /* stale from then on */
+    const char *data;
+    struct store_segment_s *segment;    /* or NULL if data is inline */
+    char inline_data[];
+};
+
+/* An evicted object on its way to the disk tier. */
+struct cache_spill_s {
+    char *key;
+    struct cache_object_s *object;
+};
+
+/*
+ * An origin fetch in progress for key.  Later misses for the same key
+ * wait on done instead of going to the origin themselves.
+ */
+struct cache_flight_s {
+    char *key;
+    unsigned int users;         /* leader plus waiters still holding it */
+    unsigned int finished;
+    pthread_cond_t done;
+    struct cache_flight_s *next;
+};
+
+/*
+ * Each shard is an independent cache with its own lock, its own share
+ * of MAX_CACHE_SIZE and its own instance of the eviction policy.  A
+ * shard may run past its share while the cache as a whole is under
+ * budget, so the global limit is only approximately enforced.  The
+ * sketch counts lookups, hits and misses alike, and decides whether a
+ * new object is worth an eviction.
+ */
+struct cache_shard_s {
+    pthread_mutex_t lock;
     size_t curr_size;
-    pthread_rwlock_t lock;
 
     struct hashmap_s* map;
+    struct cache_flight_s* flights;
+    struct sketch_s sketch;
+    struct policy_s* policy;
+};
+
+struct cache_s{
+    unsigned int nshards;
+    size_t shard_size;          /* fair share of each shard */
+    size_t curr_size;           /* sum over shards, updated atomically */
+
+    struct cache_shard_s* shards;
 };
 
 extern struct cache_s *CACHE;
-extern int cache_init(struct cache_s **cache);
-extern int cache_query(struct cache_s *cache, 
-                       const char* key, void **value);
+extern int cache_init(struct cache_s **cache,
+                      const struct policy_ops_s *policy);
+extern struct cache_object_s *cache_query(struct cache_s *cache, 
+                                          const char* key);
+extern struct cache_object_s *cache_query_or_lead(struct cache_s *cache,
+                                                  const char* key,
+                                                  int *leader);
+extern void cache_flight_end(struct cache_s *cache, const char* key);
+extern void cache_release(struct cache_object_s *object);
 extern int cache_update(struct cache_s *cache, 
                         const char* key, const char* value, 
-                        size_t len);
+                        size_t len, time_t expires);
+extern void cache_remove(struct cache_s *cache, const char* key);
+extern int cache_object_fresh(struct cache_object_s *object, time_t now);
+extern void cache_refresh(struct cache_s *cache, const char* key,
+                          struct cache_object_s *object, time_t expires);
+extern size_t cache_size(struct cache_s *cache);
+extern size_t cache_object_limit(void);
 
 #endif
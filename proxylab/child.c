@@ -2,45 +2,38 @@
 #include "csapp.h"
 #include "proxy.h"
 #include "reqs.h"
+#include "sbuf.h"
 #include "MITLogModule.h"
 
 static int listenfd;
-
-enum child_status_t { T_CONNECTED, T_WAITING };
-
-struct child_s {
-    enum child_status_t status;
-    int connfd;
-};
-
-static struct child_s *child_ptr;
+static struct sbuf_s connq;
+static unsigned int nworkers;
+static unsigned int lingering;  /* workers holding a persistent client */
 
 void *child_main (void *ptr_void)
 {
-    struct child_s* ptr = (struct child_s*)ptr_void;
-    handle_connection(ptr -> connfd);
-    ptr -> status = T_WAITING;
+    int connfd;
+
+    Pthread_detach(Pthread_self());
+    while(1){
+        connfd = sbuf_remove(&connq);
+        handle_connection(connfd);
+    }
     return NULL;
 }
 
-int child_make(struct child_s *ptr)
+short int child_pool_create (unsigned int n)
 {
+    unsigned int i;
     pthread_t thread;
-    Pthread_create(&thread, NULL, child_main, (void *)ptr);
-    if(!thread) return 0;
-    else return -1;
-}
 
-short int child_pool_create (void)
-{
-    unsigned int i;
+    assert(n > 0 && n <= CHILD_MAXSERVERS);
 
-    child_ptr = (struct child_s*)Malloc(CHILD_MAXCLIENTS * 
-                                        sizeof(struct child_s));
-    if(!child_ptr) return -1;
+    if(sbuf_init(&connq, CHILD_MAXCLIENTS) < 0) return -1;
 
-    for(i = 0; i != CHILD_MAXCLIENTS; i++){
-        child_ptr[i].status = T_WAITING;
+    nworkers = n;
+    for(i = 0; i != nworkers; i++){
+        Pthread_create(&thread, NULL, child_main, NULL);
     }
     return 0;
 }
@@ -56,32 +49,77 @@ void child_close_sock(void)
     close(listenfd);
 }
 
+/* Both read 0 until child_pool_create() has made the queue. */
+unsigned int child_queue_depth(void)
+{
+    return nworkers ? sbuf_depth(&connq) : 0;
+}
+
+unsigned int child_queue_peak(void)
+{
+    return nworkers ? sbuf_peak(&connq) : 0;
+}
+
+/*
+ * A worker that keeps a client connection open between requests sits
+ * idle until the next request comes or CLIENT_IDLE_TIMEOUT runs out,
+ * and the pool has no other way to serve the connections queued
+ * meanwhile.  So a client is only kept while nothing is queued, and
+ * only by up to 1/CHILD_LINGER_SHARE of the workers at once; the rest
+ * close after each response.  That costs those clients a new
+ * connection per request, which is cheaper than the queue stalling
+ * behind idle ones.  Returns 1 if the caller may keep its client, and
+ * must then call child_linger_end() once it lets go of it.
+ */
+int child_linger_begin(void)
+{
+    unsigned int n = __atomic_load_n(&lingering, __ATOMIC_RELAXED);
+
+    if(child_queue_depth() > 0)
+        return 0;
+    do{
+        if(n >= nworkers / CHILD_LINGER_SHARE)
+            return 0;
+    } while(!__atomic_compare_exchange_n(&lingering, &n, n + 1, 0,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+void child_linger_end(void)
+{
+    __atomic_sub_fetch(&lingering, 1, __ATOMIC_RELAXED);
+}
+
 void child_main_loop(void)
 {
-    unsigned int i;
     int connfd;
-    unsigned int busy = 1;
+    unsigned int saturated = 0;
 
     while(1){
         if(QUIT) return;
         socklen_t size = sizeof(struct sockaddr_in);
         struct sockaddr_in their_addr;
-        connfd = Accept(listenfd, (struct sockaddr*)&their_addr, &size); 
-
-        while(1){
-            for(i = 0; i != CHILD_MAXCLIENTS; i++){
-                struct child_s child = child_ptr[i];
-                if(child.status == T_WAITING){
-                    child.status = T_CONNECTED;
-                    child.connfd = connfd;
-                    child_ptr[i] = child;
-                    child_make(&child_ptr[i]);
-                    busy = 0;
-                    break;
-                }
-            }
-            if(!busy) break;
+        connfd = accept(listenfd, (struct sockaddr*)&their_addr, &size);
+        if(connfd < 0){
+            if(errno != EINTR && errno != ECONNABORTED)
+                MITLogWrite(MITLOG_LEVEL_ERROR, "accept failed: %s",
+                            strerror(errno));
+            continue;
         }
+
+        /* Report once per saturation episode, not once per accept. */
+        if(child_queue_depth() == CHILD_MAXCLIENTS){
+            if(!saturated)
+                MITLogWrite(MITLOG_LEVEL_WARNING,
+                            "worker pool saturated: %u workers busy, "
+                            "%u connections queued (peak %u)",
+                            nworkers, CHILD_MAXCLIENTS, child_queue_peak());
+            saturated = 1;
+        } else {
+            saturated = 0;
+        }
+
+        /* Blocks, rather than spins, while every slot is taken. */
+        sbuf_insert(&connq, connfd);
     }
 }
-
@@ -1,14 +1,18 @@
 #ifndef _PROXYLAB_CHILD_H
 #define _PROXYLAB_CHILD_H
 
-#define CHILD_MAXCLIENTS 128
-#define CHILD_MAXSPARESERVERS 64
-#define CHILD_MINSPARESERVERS 4
-#define CHILD_STARTSERVERS 16
+#define CHILD_MAXCLIENTS 128      /* accepted connections waiting for a worker */
+#define CHILD_MAXSERVERS 1024     /* upper bound on the worker pool */
+#define CHILD_STARTSERVERS 16     /* default size of the worker pool */
+#define CHILD_LINGER_SHARE 2      /* at most 1/N of the workers hold idle clients */
 
-extern short int child_pool_create (void);
+extern short int child_pool_create (unsigned int nworkers);
 extern int child_listening_sock (int port);
 extern void child_close_sock (void);
 extern void child_main_loop (void);
+extern unsigned int child_queue_depth (void);
+extern unsigned int child_queue_peak (void);
+extern int child_linger_begin (void);
+extern void child_linger_end (void);
 
 #endif
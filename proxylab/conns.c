@@ -2,44 +2,96 @@
 #include "proxy.h"
 #include "csapp.h"
 
+/*
+ * Everything a connection allocates for its own lifetime comes from
+ * one arena, taken from the free list here and handed back whole by
+ * destroy_conn().  Per-request memory is what gets allocated after
+ * request_mark, and reset_conn() rewinds to it.
+ */
 struct conn_s *initialize_conn(int client_fd, const char* ipaddr,
                                const char* string_addr,
                                const char* sock_ipaddr)
 {
-    struct conn_s *connptr = (struct conn_s*)Malloc(sizeof(struct conn_s));
+    struct arena_s *arena = arena_new();
+    struct conn_s *connptr = (struct conn_s*)arena_alloc(arena,
+                                                         sizeof(struct conn_s));
+    connptr -> arena = arena;
+    connptr -> state = CONN_READ_REQUEST;
     connptr -> client_fd = client_fd;
     connptr -> server_fd = -1;
-    connptr -> cbuffer = new_buffer();
-    connptr -> sbuffer = new_buffer();
+    connptr -> cbuffer = new_arena_buffer(arena);
+    connptr -> sbuffer = new_arena_buffer(arena);
+    connptr -> creader = reader_new(client_fd, arena);
+    connptr -> sreader = reader_new(-1, arena);
     connptr -> request_line = NULL;
     connptr -> connect_method = 0;
     connptr -> error_number = -1;
     connptr -> error_string = NULL;
     connptr -> protocol.major = connptr -> protocol.minor = 0;
     connptr -> content_length.server = connptr -> content_length.client = -1;
+    connptr -> keepalive.server = connptr -> keepalive.client = 0;
+    connptr -> chunked.server = connptr -> chunked.client = 0;
+    connptr -> status = 0;
+    memset(&connptr -> freshreq, 0, sizeof(connptr -> freshreq));
+    memset(&connptr -> freshresp, 0, sizeof(connptr -> freshresp));
+    connptr -> cond.etag = connptr -> cond.since = NULL;
     connptr -> server_ip_addr = (sock_ipaddr ?
-                                 strdup(sock_ipaddr) : NULL);
-    connptr -> client_ip_addr = strdup(ipaddr);
-    connptr -> client_string_addr = strdup(string_addr);
+                                 arena_strdup(arena, sock_ipaddr) : NULL);
+    connptr -> client_ip_addr = arena_strdup(arena, ipaddr);
+    connptr -> client_string_addr = arena_strdup(arena, string_addr);
+    connptr -> request_mark = arena_mark(arena);
 
     return connptr;
 }
 
+/*
+ * Get a persistent client connection ready for its next request.  The
+ * buffers are emptied but kept, except for what the client reader
+ * holds, which is the start of the next request; the origin connection
+ * has either been handed back to the pool or is closed here.  The
+ * last request's arena memory goes in one step.
+ */
+void reset_conn(struct conn_s* connptr)
+{
+    assert(connptr != NULL);
+    if(connptr -> server_fd != -1){
+        Close(connptr -> server_fd);
+        connptr -> server_fd = -1;
+    }
+    reader_reset(connptr -> sreader, -1);
+    clear_buffer(connptr -> cbuffer);
+    clear_buffer(connptr -> sbuffer);
+    connptr -> request_line = NULL;
+    if(connptr -> error_string){
+        Free(connptr -> error_string);
+        connptr -> error_string = NULL;
+    }
+    arena_rewind(connptr -> arena, connptr -> request_mark);
+
+    connptr -> state = CONN_READ_REQUEST;
+    connptr -> connect_method = 0;
+    connptr -> error_number = -1;
+    connptr -> content_length.server = connptr -> content_length.client = -1;
+    connptr -> chunked.server = connptr -> chunked.client = 0;
+    connptr -> status = 0;
+    memset(&connptr -> freshreq, 0, sizeof(connptr -> freshreq));
+    memset(&connptr -> freshresp, 0, sizeof(connptr -> freshresp));
+    connptr -> cond.etag = connptr -> cond.since = NULL;
+}
+
 void destroy_conn(struct conn_s* connptr)
 {
     assert(connptr != NULL);
     if(connptr -> client_fd != -1) Close(connptr -> client_fd);
     if(connptr -> server_fd != -1) Close(connptr -> server_fd);
 
-    if(connptr -> cbuffer) delete_buffer(connptr -> cbuffer);
-    if(connptr -> sbuffer) delete_buffer(connptr -> sbuffer);
-    if(connptr -> request_line) Free(connptr -> request_line);
+    /* These only let go of what they took from the heap. */
+    delete_buffer(connptr -> cbuffer);
+    delete_buffer(connptr -> sbuffer);
+    reader_delete(connptr -> creader);
+    reader_delete(connptr -> sreader);
 
     if(connptr -> error_string) Free(connptr -> error_string);
-    if(connptr -> server_ip_addr) Free(connptr -> server_ip_addr);
-    if(connptr -> client_ip_addr) Free(connptr -> client_ip_addr);
-    if(connptr -> client_string_addr) Free(connptr -> client_string_addr);
 
-    Free(connptr);
+    arena_release(connptr -> arena);
 }
-
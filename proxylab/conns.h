@@ -2,14 +2,41 @@
 #define _PROXYLAB_CONNS_H_
 
 #include "buffer.h"
+#include "fresh.h"
+#include "reader.h"
+
+/*
+ * Where a connection is in its life.  The threaded engine walks these
+ * in order inside handle_connection(); the event engine stores the
+ * state and resumes from it whenever one of the sockets is ready.
+ */
+enum conn_state_t {
+    CONN_READ_REQUEST,          /* waiting for the request line */
+    CONN_READ_HEADERS,          /* waiting for the blank line after headers */
+    CONN_READ_BODY,             /* waiting for the rest of a request body */
+    CONN_RESOLVE,               /* waiting for a resolver thread (epoll) */
+    CONN_CONNECT_UPSTREAM,      /* connecting to, or writing to, the origin */
+    CONN_RELAY,                 /* sending the response to the client */
+    CONN_TUNNEL,                /* relaying a CONNECT tunnel both ways */
+    CONN_DONE
+};
 
 struct conn_s{
+    enum conn_state_t state;
+
+    struct arena_s* arena;              /* holds this struct too */
+    struct arena_mark_s request_mark;   /* where per-request memory starts */
+
     int client_fd;
     int server_fd;
 
     struct buffer_s* cbuffer;
     struct buffer_s* sbuffer;
 
+    /* Input from each side; creader may already hold pipelined requests. */
+    struct reader_s* creader;
+    struct reader_s* sreader;
+
     char* request_line;
 
     unsigned int connect_method;
@@ -20,6 +47,30 @@ struct conn_s{
         long int server;
         long int client;
     } content_length;
+
+    /* Whether each side may keep its connection open after this request. */
+    struct {
+        unsigned int server;
+        unsigned int client;
+    } keepalive;
+
+    /* Whether each side's response body is in chunked encoding. */
+    struct {
+        unsigned int server;
+        unsigned int client;
+    } chunked;
+
+    int status;                 /* status code of the origin's response */
+
+    /* What the request and the response say about caching. */
+    struct fresh_request_s freshreq;
+    struct fresh_response_s freshresp;
+
+    /* The client's own validators, sent on unless we have ours. */
+    struct {
+        char *etag;             /* If-None-Match */
+        char *since;            /* If-Modified-Since */
+    } cond;
     
     char *server_ip_addr;
     char *client_ip_addr;
@@ -34,6 +85,7 @@ struct conn_s{
 extern struct conn_s *initialize_conn(int client_fd, const char* ipaddr,
                                       const char* string_addr,
                                       const char* sock_ipaddr);
+extern void reset_conn(struct conn_s *connptr);
 extern void destroy_conn(struct conn_s *connptr);
 
 #endif
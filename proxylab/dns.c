@@ -0,0 +1,313 @@
+#include "dns.h"
+#include "proxy.h"
+#include "hashmap.h"
+#include "MITLogModule.h"
+
+#define DNS_KEY_LENGTH (HOSTNAME_LENGTH + 8)
+
+/* What the map holds for each host:port; updated in place. */
+struct dns_entry_s {
+    int error;                  /* EAI_* code of a cached failure, or 0 */
+    int naddrs;
+    time_t expires;
+    unsigned int hits;          /* since it was last resolved */
+    unsigned int refreshing;    /* queued for the refresher */
+    struct dns_addr_s addrs[DNS_MAXADDRS];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    hashmap_t map;
+    unsigned int nentries;
+    unsigned int positive_ttl;
+    unsigned int negative_ttl;
+
+    /* Lookups for the resolver threads: refreshes and dns_resolve_async(). */
+    struct dns_query_s *queue_head, *queue_tail;
+    struct dns_stats_s stats;
+} dns;
+
+static void make_key (char *key, const char *host, int port)
+{
+    snprintf (key, DNS_KEY_LENGTH, "%s:%d", host, port);
+}
+
+/* Call getaddrinfo() and flatten what it finds into entry. */
+static void dns_lookup (const char *host, int port,
+                        struct dns_entry_s *entry)
+{
+    struct addrinfo hints, *res, *ptr;
+    char portstr[12];
+
+    memset (&hints, 0, sizeof (struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    snprintf (portstr, sizeof (portstr), "%d", port);
+
+    memset (entry, 0, sizeof (struct dns_entry_s));
+    entry->error = getaddrinfo (host, portstr, &hints, &res);
+    if (entry->error != 0)
+        return;
+
+    for (ptr = res; ptr && entry->naddrs != DNS_MAXADDRS;
+         ptr = ptr->ai_next) {
+        struct dns_addr_s *addr = &entry->addrs[entry->naddrs];
+
+        if (ptr->ai_addrlen > sizeof (addr->addr))
+            continue;
+        addr->family = ptr->ai_family;
+        addr->socktype = ptr->ai_socktype;
+        addr->protocol = ptr->ai_protocol;
+        addr->addrlen = ptr->ai_addrlen;
+        memcpy (&addr->addr, ptr->ai_addr, ptr->ai_addrlen);
+        entry->naddrs++;
+    }
+    freeaddrinfo (res);
+    if (entry->naddrs == 0)
+        entry->error = EAI_NONAME;
+}
+
+/* Out of memory is about us, not the name, so it is not cached. */
+static int dns_cacheable (const struct dns_entry_s *entry)
+{
+    return entry->error != EAI_MEMORY && entry->error != EAI_SYSTEM;
+}
+
+/* Store entry under key, with the lock held. */
+static void dns_store (const char *key, struct dns_entry_s *entry,
+                       time_t now)
+{
+    entry->expires = now + (entry->error ? dns.negative_ttl
+                                         : dns.positive_ttl);
+    entry->hits = 0;
+    entry->refreshing = 0;
+
+    if (hashmap_search (dns.map, key) > 0) {
+        hashmap_remove (dns.map, key);
+        dns.nentries--;
+    }
+    while (dns.nentries >= DNS_MAXENTRIES
+           && hashmap_remove_lru (dns.map) > 0)
+        dns.nentries--;
+    if (hashmap_insert (dns.map, key, entry, sizeof (*entry)) >= 0)
+        dns.nentries++;
+}
+
+static int dns_copy (const struct dns_entry_s *entry,
+                     struct dns_addr_s *addrs, int max)
+{
+    int n = min (entry->naddrs, max);
+
+    if (entry->error)
+        return entry->error < 0 ? entry->error : -entry->error;
+    memcpy (addrs, entry->addrs, n * sizeof (struct dns_addr_s));
+    return n;
+}
+
+/* Add query to the resolver threads' queue; lock held. */
+static void dns_enqueue (struct dns_query_s *query, const char *host,
+                         int port)
+{
+    query->host = strdup (host);
+    query->port = port;
+    query->next = NULL;
+    if (dns.queue_tail)
+        dns.queue_tail->next = query;
+    else
+        dns.queue_head = query;
+    dns.queue_tail = query;
+    pthread_cond_signal (&dns.wakeup);
+}
+
+/*
+ * Queries with no done callback are refreshes of popular entries, and
+ * a failed refresh keeps the old answer until it expires.  Anyone else
+ * gets whatever getaddrinfo() said, failures included.
+ */
+static void *dns_resolver (void *ptr_void)
+{
+    struct dns_query_s *query;
+    struct dns_entry_s entry;
+    char key[DNS_KEY_LENGTH];
+
+    Pthread_detach (Pthread_self ());
+    while (1) {
+        pthread_mutex_lock (&dns.lock);
+        while (!dns.queue_head)
+            pthread_cond_wait (&dns.wakeup, &dns.lock);
+        query = dns.queue_head;
+        dns.queue_head = query->next;
+        if (!dns.queue_head)
+            dns.queue_tail = NULL;
+        pthread_mutex_unlock (&dns.lock);
+
+        dns_lookup (query->host, query->port, &entry);
+        make_key (key, query->host, query->port);
+        Free (query->host);
+        query->host = NULL;
+
+        pthread_mutex_lock (&dns.lock);
+        if (query->done == NULL) {
+            dns.stats.refreshes++;
+            if (entry.error == 0) {
+                dns_store (key, &entry, time (NULL));
+            } else {
+                struct dns_entry_s *old;
+                if (hashmap_entry_by_key (dns.map, key, (void **) &old) > 0) {
+                    old->refreshing = 0;
+                    old->hits = 0;
+                }
+            }
+        } else if (dns_cacheable (&entry)) {
+            dns_store (key, &entry, time (NULL));
+        }
+        pthread_mutex_unlock (&dns.lock);
+
+        if (query->done == NULL) {
+            Free (query);
+            continue;
+        }
+        query->result = dns_copy (&entry, query->addrs, DNS_MAXADDRS);
+        query->done (query);
+    }
+    return NULL;
+}
+
+int dns_init (unsigned int positive_ttl, unsigned int negative_ttl)
+{
+    pthread_t thread;
+    unsigned int i;
+
+    if (pthread_mutex_init (&dns.lock, NULL) != 0
+        || pthread_cond_init (&dns.wakeup, NULL) != 0)
+        return -1;
+    dns.map = hashmap_create_nocase (DNS_BUCKETS);
+    if (!dns.map)
+        return -1;
+    dns.nentries = 0;
+    dns.positive_ttl = positive_ttl;
+    dns.negative_ttl = negative_ttl;
+    dns.queue_head = dns.queue_tail = NULL;
+    memset (&dns.stats, 0, sizeof (dns.stats));
+
+    for (i = 0; i != DNS_RESOLVERS; i++)
+        Pthread_create (&thread, NULL, dns_resolver, NULL);
+    return 0;
+}
+
+/* Queue a popular entry that is close to expiry; lock held. */
+static void dns_maybe_refresh (struct dns_entry_s *entry, const char *host,
+                               int port, time_t now)
+{
+    struct dns_query_s *query;
+
+    if (entry->error || entry->refreshing
+        || entry->hits < DNS_REFRESH_HITS
+        || entry->expires - now > min (DNS_REFRESH_AHEAD,
+                                       dns.positive_ttl / 2))
+        return;
+
+    query = (struct dns_query_s *) Malloc (sizeof (struct dns_query_s));
+    query->done = NULL;
+    dns_enqueue (query, host, port);
+    entry->refreshing = 1;
+}
+
+/*
+ * The cached answer for key, as dns_resolve() returns it, or 0 if there
+ * is none; lock held.  An entry always has an address or an error, so
+ * 0 cannot be an answer.
+ */
+static int dns_hit (const char *key, const char *host, int port,
+                    struct dns_addr_s *addrs, int max, time_t now)
+{
+    struct dns_entry_s *cached;
+
+    if (hashmap_entry_by_key (dns.map, key, (void **) &cached) > 0
+        && cached->expires > now) {
+        dns.stats.hits++;
+        if (cached->error)
+            dns.stats.negative_hits++;
+        cached->hits++;
+        dns_maybe_refresh (cached, host, port, now);
+        return dns_copy (cached, addrs, max);
+    }
+    dns.stats.misses++;
+    return 0;
+}
+
+int dns_resolve (const char *host, int port, struct dns_addr_s *addrs,
+                 int max)
+{
+    char key[DNS_KEY_LENGTH];
+    struct dns_entry_s entry;
+    time_t now = time (NULL);
+    int n;
+
+    assert (host != NULL);
+    assert (max > 0);
+
+    make_key (key, host, port);
+
+    pthread_mutex_lock (&dns.lock);
+    n = dns_hit (key, host, port, addrs, max, now);
+    pthread_mutex_unlock (&dns.lock);
+    if (n != 0)
+        return n;
+
+    /* Concurrent misses for one name each resolve it; the last one wins. */
+    dns_lookup (host, port, &entry);
+    if (dns_cacheable (&entry)) {
+        pthread_mutex_lock (&dns.lock);
+        dns_store (key, &entry, now);
+        pthread_mutex_unlock (&dns.lock);
+    }
+    return dns_copy (&entry, addrs, max);
+}
+
+int dns_resolve_cached (const char *host, int port,
+                        struct dns_addr_s *addrs, int max)
+{
+    char key[DNS_KEY_LENGTH];
+    int n;
+
+    assert (host != NULL);
+    assert (max > 0);
+
+    make_key (key, host, port);
+    pthread_mutex_lock (&dns.lock);
+    n = dns_hit (key, host, port, addrs, max, time (NULL));
+    pthread_mutex_unlock (&dns.lock);
+    return n;
+}
+
+void dns_resolve_async (struct dns_query_s *query, const char *host,
+                        int port)
+{
+    assert (host != NULL);
+    assert (query->done != NULL);
+
+    pthread_mutex_lock (&dns.lock);
+    dns_enqueue (query, host, port);
+    pthread_mutex_unlock (&dns.lock);
+}
+
+void dns_forget (const char *host, int port)
+{
+    char key[DNS_KEY_LENGTH];
+
+    make_key (key, host, port);
+    pthread_mutex_lock (&dns.lock);
+    if (hashmap_remove (dns.map, key) > 0)
+        dns.nentries--;
+    pthread_mutex_unlock (&dns.lock);
+}
+
+void dns_stats (struct dns_stats_s *stats)
+{
+    pthread_mutex_lock (&dns.lock);
+    *stats = dns.stats;
+    pthread_mutex_unlock (&dns.lock);
+}
@@ -0,0 +1,68 @@
+#ifndef _PROXYLAB_DNS_H_
+#define _PROXYLAB_DNS_H_
+
+#include "csapp.h"
+
+#define DNS_BUCKETS 128
+#define DNS_MAXENTRIES 4096       /* least recently used go past this */
+#define DNS_MAXADDRS 8            /* addresses kept per host:port */
+#define DNS_POSITIVE_TTL 60       /* default seconds a resolution is kept */
+#define DNS_NEGATIVE_TTL 5        /* default seconds a failure is kept */
+#define DNS_REFRESH_HITS 4        /* hits in one TTL that make it popular */
+#define DNS_REFRESH_AHEAD 10      /* seconds before expiry it is refreshed */
+#define DNS_RESOLVERS 4           /* threads calling getaddrinfo() for others */
+
+struct dns_addr_s {
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+};
+
+struct dns_stats_s {
+    unsigned long hits;         /* answered from the cache, either way */
+    unsigned long negative_hits;
+    unsigned long misses;       /* had to call getaddrinfo() */
+    unsigned long refreshes;    /* resolved again in the background */
+};
+
+/* A lookup for a resolver thread; see dns_resolve_async(). */
+struct dns_query_s {
+    void (*done) (struct dns_query_s *query);
+    void *arg;
+    int result;                 /* as dns_resolve() returns */
+    struct dns_addr_s addrs[DNS_MAXADDRS];
+
+    char *host;                 /* the resolver's own */
+    int port;
+    struct dns_query_s *next;
+};
+
+/*
+ * Resolver cache in front of getaddrinfo(), keyed by host and port.
+ * Successful lookups are kept for the positive TTL and failures for
+ * the negative TTL.  Entries that keep getting hits are resolved again
+ * by a resolver thread shortly before they expire, so popular hosts
+ * never pay for a lookup on the request path.
+ *
+ * dns_resolve() copies up to max addresses into addrs and returns how
+ * many, or a negative EAI_* code.  dns_resolve_cached() does the same
+ * from the cache alone and returns 0 rather than block on a miss.
+ * dns_resolve_async() has a resolver thread look the name up, cache
+ * the answer, fill in the query's result and addrs and call its done()
+ * callback, set by the caller along with arg, on that thread; the query
+ * is the caller's again from then on.  dns_forget() drops an entry
+ * whose addresses turned out not to work.
+ */
+extern int dns_init (unsigned int positive_ttl, unsigned int negative_ttl);
+extern int dns_resolve (const char *host, int port,
+                        struct dns_addr_s *addrs, int max);
+extern int dns_resolve_cached (const char *host, int port,
+                               struct dns_addr_s *addrs, int max);
+extern void dns_resolve_async (struct dns_query_s *query, const char *host,
+                               int port);
+extern void dns_forget (const char *host, int port);
+extern void dns_stats (struct dns_stats_s *stats);
+
+#endif
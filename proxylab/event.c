@@ -0,0 +1,1309 @@
+#define _GNU_SOURCE             /* accept4, splice */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+#include "event.h"
+#include "csapp.h"
+#include "proxy.h"
+#include "conns.h"
+#include "reqs.h"
+#include "network.h"
+#include "dns.h"
+#include "buffer.h"
+#include "cache.h"
+#include "tunnel.h"
+#include "text.h"
+#include "MITLogModule.h"
+
+/*
+ * The event engine: every reactor thread owns an epoll set and serves
+ * any number of connections from it.  All sockets are non-blocking and
+ * each connection resumes from connptr->state whenever one of its two
+ * sockets becomes ready, so a slow client or a slow origin costs a
+ * struct instead of a thread.
+ */
+
+struct evconn_s;
+
+/* What epoll hands back: the connection and which of its sockets fired. */
+struct evhandle_s {
+    struct evconn_s *ev;
+    unsigned int server;
+    unsigned int attempt;           /* 1 + which racing connect, or 0 */
+};
+
+/* The connects racing for an origin, each with its own handle. */
+struct evrace_s {
+    struct connect_race_s race;
+    struct evhandle_s handles[DNS_MAXADDRS];
+};
+
+struct reactor_s {
+    int epfd;
+    int listenfd;
+    char *scratch;                  /* MAXBUFFSIZE bytes for the relay */
+    struct evconn_s *closed;        /* reaped after each epoll_wait() */
+    struct evconn_s *conns;         /* swept for deadlines now and then */
+    struct evconn_s *racing;        /* connecting, with attempts to time */
+    time_t swept;
+
+    /* Names looked up off the reactor come back through here. */
+    int wakefd;                     /* an eventfd, bumped per answer */
+    struct evhandle_s wakeup;       /* what epoll hands back for it */
+    pthread_mutex_t lock;
+    struct evconn_s *resolved;      /* answered, under lock */
+};
+
+struct evconn_s {
+    struct conn_s *conn;
+    struct request_s *request;
+    struct reactor_s *reactor;
+
+    struct evhandle_s client, server;
+    uint32_t client_events;         /* interest currently registered */
+    uint32_t server_events;
+    unsigned int client_registered;
+    unsigned int server_registered;
+
+    char *head;                     /* request line and headers so far */
+    size_t headlen;
+    size_t headcap;
+    size_t scanned;                 /* head[0, scanned) is split into lines */
+    size_t hdrstart;                /* first byte after the request line */
+
+    long body_left;                 /* request body still to be read */
+    struct buffer_s *toclient;      /* response bytes not yet sent */
+    struct cache_object_s *object;  /* cache hit being sent, referenced */
+    size_t object_sent;
+    char *key;
+    unsigned int cacheable;         /* a GET or HEAD, cached by key */
+    unsigned int capture;           /* still copying into conn->sbuffer */
+    unsigned int server_eof;
+    char *rhead;                    /* response head while it arrives */
+    size_t rheadlen;
+    unsigned int rparsed;           /* rhead is done with */
+    long body_togo;                 /* response body still to come, or -1 */
+    int pipefd[2];                  /* for splicing once capture is off */
+    size_t piped;                   /* bytes sitting in the pipe */
+
+    struct dns_query_s *query;      /* the lookup being waited for */
+    struct evrace_s *race;          /* set while connecting to the origin */
+    struct evconn_s *race_prev, *race_next;
+    struct evconn_s *next_resolved;
+
+    struct tunnel_s *tunnel;        /* set once a CONNECT is established */
+    unsigned int tunnel_idle;
+
+    struct evconn_s *prev, *next;   /* on reactor->conns */
+    time_t last_active;             /* when either socket last fired */
+
+    unsigned int closing;
+    struct evconn_s *next_closed;
+};
+
+static void ev_reap (struct evconn_s *ev)
+{
+    ev->next_closed = ev->reactor->closed;
+    ev->reactor->closed = ev;
+}
+
+/*
+ * Other events for the same connection may still be waiting in the
+ * current epoll_wait() batch, so the memory is only released once the
+ * batch is done.  A resolver thread still holding the connection hands
+ * it back first.
+ */
+static void ev_close (struct evconn_s *ev)
+{
+    if (ev->closing)
+        return;
+
+    ev->closing = 1;
+    ev->conn->state = CONN_DONE;
+    if (!ev->query)
+        ev_reap (ev);
+}
+
+static void ev_race_end (struct evconn_s *ev, int keep);
+
+static void ev_free (struct evconn_s *ev)
+{
+    if (ev->head)
+        Free (ev->head);
+    if (ev->key)
+        Free (ev->key);
+    if (ev->rhead)
+        Free (ev->rhead);
+    if (ev->toclient)
+        delete_buffer (ev->toclient);
+    if (ev->object)
+        cache_release (ev->object);
+    if (ev->pipefd[0] >= 0) {
+        close (ev->pipefd[0]);
+        close (ev->pipefd[1]);
+    }
+    if (ev->race)
+        ev_race_end (ev, -1);
+    if (ev->tunnel)
+        tunnel_close (ev->tunnel, ev->tunnel_idle);
+    if (ev->prev)
+        ev->prev->next = ev->next;
+    else
+        ev->reactor->conns = ev->next;
+    if (ev->next)
+        ev->next->prev = ev->prev;
+
+    /*
+     * Closing the descriptors also takes them out of the epoll set.
+     * ev and the request live in the connection's arena, so this goes
+     * last.
+     */
+    destroy_conn (ev->conn);
+}
+
+static int ev_watch (struct evconn_s *ev, unsigned int server, uint32_t events)
+{
+    struct epoll_event event;
+    uint32_t *current = server ? &ev->server_events : &ev->client_events;
+    unsigned int *registered = server ? &ev->server_registered
+                                      : &ev->client_registered;
+    int fd = server ? ev->conn->server_fd : ev->conn->client_fd;
+    int op = EPOLL_CTL_MOD;
+
+    if (!*registered)
+        op = EPOLL_CTL_ADD;
+    else if (*current == events)
+        return 0;
+
+    event.events = events;
+    event.data.ptr = server ? &ev->server : &ev->client;
+    if (epoll_ctl (ev->reactor->epfd, op, fd, &event) < 0) {
+        MITLogWrite (MITLOG_LEVEL_ERROR, "epoll_ctl on fd %d failed: %s",
+                     fd, strerror (errno));
+        return -1;
+    }
+    *registered = 1;
+    *current = events;
+    return 0;
+}
+
+/* Bytes still owed to the client. */
+static size_t ev_pending (struct evconn_s *ev)
+{
+    size_t pending = buffer_size (ev->toclient);
+
+    if (ev->object)
+        pending += ev->object->len - ev->object_sent;
+    return pending + ev->piped;
+}
+
+/* Send toclient first, then the held cache object, then the pipe. */
+static int ev_send_client (struct evconn_s *ev)
+{
+    int fd = ev->conn->client_fd;
+    ssize_t len;
+
+    if (send_buffer (ev->toclient, fd) < 0)
+        return -1;
+    if (buffer_size (ev->toclient) > 0)
+        return 0;
+    if (ev->object && ev->object_sent < ev->object->len) {
+        do {
+            len = send (fd, ev->object->data + ev->object_sent,
+                        ev->object->len - ev->object_sent, MSG_NOSIGNAL);
+        } while (len < 0 && errno == EINTR);
+        if (len < 0)
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        ev->object_sent += len;
+        if (ev->object_sent < ev->object->len)
+            return 0;
+    }
+    if (ev->piped == 0)
+        return 0;
+
+    do {
+        len = splice (ev->pipefd[0], NULL, fd, NULL, ev->piped,
+                      SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    ev->piped -= len;
+    return 0;
+}
+
+/* poll() events as epoll ones; the tunnel code speaks poll(). */
+static uint32_t ev_from_poll (short events)
+{
+    return ((events & POLLIN) ? EPOLLIN : 0)
+           | ((events & POLLOUT) ? EPOLLOUT : 0);
+}
+
+/*
+ * A tunnel first sends what was queued before it started (our 200 to
+ * the client, early client bytes to the origin) and then lets the
+ * tunnel code decide.
+ */
+static int ev_update_tunnel (struct evconn_s *ev)
+{
+    struct conn_s *connptr = ev->conn;
+    short client = 0, server = 0;
+
+    if (buffer_size (ev->toclient) == 0
+        && buffer_size (connptr->cbuffer) == 0) {
+        tunnel_events (ev->tunnel, &client, &server);
+    } else {
+        if (buffer_size (ev->toclient) > 0)
+            client = POLLOUT;
+        if (buffer_size (connptr->cbuffer) > 0)
+            server = POLLOUT;
+    }
+    if (ev_watch (ev, 0, ev_from_poll (client)) < 0)
+        return -1;
+    return ev_watch (ev, 1, ev_from_poll (server));
+}
+
+/* Derive what each socket should be waiting for from the state. */
+static int ev_update (struct evconn_s *ev)
+{
+    struct conn_s *connptr = ev->conn;
+    uint32_t events = 0;
+
+    if (connptr->state == CONN_TUNNEL)
+        return ev_update_tunnel (ev);
+
+    switch (connptr->state) {
+    case CONN_READ_REQUEST:
+    case CONN_READ_HEADERS:
+    case CONN_READ_BODY:
+        events = EPOLLIN;
+        break;
+    case CONN_RELAY:
+        if (ev_pending (ev) > 0)
+            events = EPOLLOUT;
+        break;
+    default:
+        break;
+    }
+    if (ev_watch (ev, 0, events) < 0)
+        return -1;
+
+    if (connptr->server_fd < 0)
+        return 0;
+
+    events = 0;
+    if (connptr->state == CONN_CONNECT_UPSTREAM) {
+        events = EPOLLOUT;
+    } else if (connptr->state == CONN_RELAY) {
+        if (buffer_size (connptr->cbuffer) > 0)
+            events |= EPOLLOUT;
+        if (!ev->server_eof && buffer_size (ev->toclient) < EVENT_HIGHWATER
+            && ev->piped == 0)
+            events |= EPOLLIN;
+    }
+    return ev_watch (ev, 1, events);
+}
+
+static void ev_finish (struct evconn_s *ev)
+{
+    if (ev->server_eof && ev_pending (ev) == 0)
+        ev_close (ev);
+}
+
+/* Best effort: the client is about to be dropped either way. */
+static void ev_bad_gateway (struct evconn_s *ev)
+{
+    static const char bad_gateway[] =
+        "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n"
+        "Connection: close\r\n\r\n";
+
+    send (ev->conn->client_fd, bad_gateway, sizeof (bad_gateway) - 1,
+          MSG_NOSIGNAL);
+}
+
+static int ev_connect_failed (struct evconn_s *ev)
+{
+    if (ev->conn->connect_method) {
+        MITLogWrite (MITLOG_LEVEL_ERROR, "CONNECT to %s:%d failed",
+                     ev->request->host, ev->request->port);
+        ev_bad_gateway (ev);
+    } else {
+        MITLogWrite (MITLOG_LEVEL_ERROR, "open server socket error!");
+    }
+    return -1;
+}
+
+/*
+ * Stop racing, closing every attempt but keep.  The winner leaves the
+ * epoll set under its attempt handle and comes back as the server
+ * socket.
+ */
+static void ev_race_end (struct evconn_s *ev, int keep)
+{
+    struct reactor_s *reactor = ev->reactor;
+
+    if (keep >= 0)
+        epoll_ctl (reactor->epfd, EPOLL_CTL_DEL, keep, NULL);
+    connect_race_end (&ev->race->race, keep);
+    if (ev->race_prev)
+        ev->race_prev->race_next = ev->race_next;
+    else
+        reactor->racing = ev->race_next;
+    if (ev->race_next)
+        ev->race_next->race_prev = ev->race_prev;
+    ev->race_prev = ev->race_next = NULL;
+    ev->race = NULL;
+}
+
+/*
+ * Start whatever attempts are due and watch them.  A winner becomes
+ * server_fd, still in CONN_CONNECT_UPSTREAM, so ev_update() waits for
+ * it to be writable and on_server() carries on as for any connect.
+ */
+static int ev_race_advance (struct evconn_s *ev, long long now)
+{
+    struct connect_race_s *race = &ev->race->race;
+    struct epoll_event event;
+    int first = race->started, fd, i;
+
+    fd = connect_race_advance (race, now);
+    for (i = first; i != race->started; i++) {
+        if (race->fds[i] < 0 || race->fds[i] == fd)
+            continue;
+        event.events = EPOLLOUT;
+        event.data.ptr = &ev->race->handles[i];
+        if (epoll_ctl (ev->reactor->epfd, EPOLL_CTL_ADD, race->fds[i],
+                       &event) < 0)
+            MITLogWrite (MITLOG_LEVEL_ERROR, "epoll_ctl on fd %d failed: %s",
+                         race->fds[i], strerror (errno));
+    }
+
+    if (fd < 0 && !connect_race_over (race, now))
+        return 0;
+    ev_race_end (ev, fd);
+    if (fd < 0) {
+        MITLogWrite (MITLOG_LEVEL_ERROR,
+                     "Could not establish a connection to %s",
+                     ev->request->host);
+        /* Maybe the name has moved; look it up again next time. */
+        dns_forget (ev->request->host, ev->request->port);
+        return ev_connect_failed (ev);
+    }
+
+    ev->conn->server_fd = fd;
+    if (!ev->conn->connect_method)
+        MITLogWrite (MITLOG_LEVEL_COMMON,
+                     "Cache miss for client fd %d. Connecting to host "
+                     "\"%s\" using file descriptor %d.",
+                     ev->conn->client_fd, ev->request->host, fd);
+    return 0;
+}
+
+/*
+ * Race the origin's addresses Happy Eyeballs style, as opensock() does:
+ * the reactor wakes for each stagger and for the deadline, and the
+ * first attempt to connect wins.  addrs and n as dns_resolve() gave.
+ */
+static int ev_connect_server (struct evconn_s *ev,
+                              const struct dns_addr_s *addrs, int n)
+{
+    struct reactor_s *reactor = ev->reactor;
+    int i;
+
+    if (n < 0) {
+        MITLogWrite (MITLOG_LEVEL_ERROR, "Could not retrieve info for %s",
+                     ev->request->host);
+        return ev_connect_failed (ev);
+    }
+
+    ev->race = (struct evrace_s *) arena_alloc (ev->conn->arena,
+                                                sizeof (struct evrace_s));
+    for (i = 0; i != DNS_MAXADDRS; i++) {
+        ev->race->handles[i].ev = ev;
+        ev->race->handles[i].server = 1;
+        ev->race->handles[i].attempt = i + 1;
+    }
+    connect_race_start (&ev->race->race, addrs, n);
+    ev->race_prev = NULL;
+    ev->race_next = reactor->racing;
+    if (ev->race_next)
+        ev->race_next->race_prev = ev;
+    reactor->racing = ev;
+
+    ev->conn->state = CONN_CONNECT_UPSTREAM;
+    return ev_race_advance (ev, monotonic_ms ());
+}
+
+/* Runs on a resolver thread: queue ev for its reactor and wake it. */
+static void ev_resolve_done (struct dns_query_s *query)
+{
+    struct evconn_s *ev = (struct evconn_s *) query->arg;
+    struct reactor_s *reactor = ev->reactor;
+    uint64_t one = 1;
+
+    pthread_mutex_lock (&reactor->lock);
+    ev->next_resolved = reactor->resolved;
+    reactor->resolved = ev;
+    pthread_mutex_unlock (&reactor->lock);
+    if (write (reactor->wakefd, &one, sizeof (one)) < 0 && errno != EAGAIN)
+        MITLogWrite (MITLOG_LEVEL_ERROR, "could not wake reactor: %s",
+                     strerror (errno));
+}
+
+/*
+ * getaddrinfo() would block the whole reactor, so only answers already
+ * in the DNS cache are used here.  On a miss the connection waits in
+ * CONN_RESOLVE, with no interest in the client, until a resolver thread
+ * has the answer; reactor_resolved() then picks up where this left off.
+ */
+static int ev_open_server (struct evconn_s *ev)
+{
+    struct dns_addr_s addrs[DNS_MAXADDRS];
+    int n;
+
+    n = dns_resolve_cached (ev->request->host, ev->request->port, addrs,
+                            DNS_MAXADDRS);
+    if (n != 0)
+        return ev_connect_server (ev, addrs, n);
+
+    ev->query = (struct dns_query_s *) Malloc (sizeof (struct dns_query_s));
+    ev->query->done = ev_resolve_done;
+    ev->query->arg = ev;
+    ev->conn->state = CONN_RESOLVE;
+    dns_resolve_async (ev->query, ev->request->host, ev->request->port);
+    return 0;
+}
+
+/*
+ * A cached object goes out with Connection: close after its status
+ * line, as send_response() in reqs.c would put it: this engine closes
+ * after every response.
+ */
+static int ev_send_object (struct evconn_s *ev)
+{
+    const char *eol = memchr (ev->object->data, '\n', ev->object->len);
+
+    if (eol == NULL)
+        return -1;
+    ev->object_sent = eol + 1 - ev->object->data;
+    if (add_to_buffer (ev->toclient, (char *)ev->object->data,
+                          ev->object_sent) < 0
+        || add_to_buffer (ev->toclient, "Connection: close\r\n", 19) < 0)
+        return -1;
+    return ev_send_client (ev);
+}
+
+/*
+ * Only GET and HEAD go through the cache.  A stale copy is not
+ * revalidated here, just fetched again as if it were not there.
+ */
+static int ev_dispatch (struct evconn_s *ev)
+{
+    struct conn_s *connptr = ev->conn;
+    int cacheable = !strcasecmp (ev->request->method, "GET")
+                    || !strcasecmp (ev->request->method, "HEAD");
+
+    buffer_to_key (connptr->cbuffer, &ev->key);
+    if (cacheable)
+        ev->object = cache_query (CACHE, ev->key);
+    if (ev->object != NULL && (connptr->freshreq.reload
+                               || !cache_object_fresh (ev->object,
+                                                       time (NULL)))) {
+        cache_release (ev->object);
+        ev->object = NULL;
+    }
+    if (ev->object != NULL) {
+        MITLogWrite (MITLOG_LEVEL_COMMON,
+                     "cache hit for client fd %d, host \"%s\"",
+                     connptr->client_fd, ev->request->host);
+        ev->server_eof = 1;
+        connptr->state = CONN_RELAY;
+        if (ev_send_object (ev) < 0)
+            return -1;
+        ev_finish (ev);
+        return 0;
+    }
+
+    ev->capture = ev->cacheable = cacheable;
+    return ev_open_server (ev);
+}
+
+/*
+ * A CONNECT's headers were for us.  Whatever followed them is already
+ * for the origin and waits in cbuffer until the tunnel is up.  Only the
+ * ports tunnel_port_allowed() lists may be reached.
+ */
+static int ev_connect_start (struct evconn_s *ev)
+{
+    static const char forbidden[] =
+        "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n"
+        "Connection: close\r\n\r\n";
+    struct conn_s *connptr = ev->conn;
+    size_t leftover = ev->headlen - ev->scanned;
+
+    if (!tunnel_port_allowed (ev->request->port)) {
+        MITLogWrite (MITLOG_LEVEL_ERROR,
+                     "CONNECT to %s:%d refused: port not allowed",
+                     ev->request->host, ev->request->port);
+        send (connptr->client_fd, forbidden, sizeof (forbidden) - 1,
+              MSG_NOSIGNAL);
+        return -1;
+    }
+
+    if (leftover > 0
+        && add_to_buffer (connptr->cbuffer, ev->head + ev->scanned,
+                          leftover) < 0)
+        return -1;
+
+    return ev_open_server (ev);
+}
+
+/* The origin is connected: start relaying both ways. */
+static int ev_connect_done (struct evconn_s *ev)
+{
+    static char established[] =
+        "HTTP/1.1 200 Connection established\r\n\r\n";
+    struct conn_s *connptr = ev->conn;
+    struct tunnel_s *tunnel;
+
+    tunnel = (struct tunnel_s *) arena_alloc (connptr->arena,
+                                              sizeof (struct tunnel_s));
+    if (tunnel_open (tunnel, connptr->client_fd, connptr->server_fd) < 0)
+        return -1;
+    ev->tunnel = tunnel;
+
+    MITLogWrite (MITLOG_LEVEL_COMMON,
+                 "Tunnel from client fd %d to \"%s:%d\" on file "
+                 "descriptor %d.", connptr->client_fd, ev->request->host,
+                 ev->request->port, connptr->server_fd);
+    connptr->state = CONN_TUNNEL;
+    return add_to_buffer (ev->toclient, established,
+                          sizeof (established) - 1);
+}
+
+/*
+ * Flush what was queued before the tunnel, then pump it.  Either socket
+ * being ready is reason enough to try both directions.
+ */
+static void ev_tunnel (struct evconn_s *ev, uint32_t events)
+{
+    struct conn_s *connptr = ev->conn;
+
+    if (events & EPOLLERR) {
+        ev_close (ev);
+        return;
+    }
+    if (send_buffer (ev->toclient, connptr->client_fd) < 0
+        || send_buffer (connptr->cbuffer, connptr->server_fd) < 0) {
+        ev_close (ev);
+        return;
+    }
+    if (buffer_size (ev->toclient) > 0 || buffer_size (connptr->cbuffer) > 0)
+        return;
+
+    if (tunnel_pump (ev->tunnel) != 0)
+        ev_close (ev);
+}
+
+/*
+ * Seconds a connection may sit in its state with nothing happening:
+ * a client gets as long to send its request as the threaded engine
+ * gives it, an origin EVENT_UPSTREAM_TIMEOUT to resolve, connect and
+ * answer, and a tunnel TUNNEL_IDLE_TIMEOUT without a byte either way.
+ */
+static int ev_timed_out (struct evconn_s *ev, time_t now)
+{
+    switch (ev->conn->state) {
+    case CONN_READ_REQUEST:
+    case CONN_READ_HEADERS:
+    case CONN_READ_BODY:
+        return now - ev->last_active >= CLIENT_IDLE_TIMEOUT;
+    case CONN_RESOLVE:
+    case CONN_CONNECT_UPSTREAM:
+    case CONN_RELAY:
+        return now - ev->last_active >= EVENT_UPSTREAM_TIMEOUT;
+    case CONN_TUNNEL:
+        return now - ev->tunnel->last_active >= TUNNEL_IDLE_TIMEOUT;
+    default:
+        return 0;
+    }
+}
+
+/* Close every connection that has been stuck for too long. */
+static void reactor_sweep (struct reactor_s *reactor)
+{
+    struct evconn_s *ev;
+    time_t now = time (NULL);
+
+    if (now == reactor->swept)
+        return;
+    reactor->swept = now;
+    for (ev = reactor->conns; ev; ev = ev->next) {
+        if (!ev_timed_out (ev, now))
+            continue;
+        MITLogWrite (MITLOG_LEVEL_COMMON,
+                     "Closing client fd %d, idle in state %d",
+                     ev->conn->client_fd, ev->conn->state);
+        ev->tunnel_idle = (ev->conn->state == CONN_TUNNEL);
+        ev_close (ev);
+    }
+}
+
+static int ev_headers_done (struct evconn_s *ev)
+{
+    struct conn_s *connptr = ev->conn;
+    struct http_headers_s headers;
+    size_t leftover;
+    long take;
+
+    if (connptr->connect_method)
+        return ev_connect_start (ev);
+
+    if (http_parse_headers (ev->head + ev->hdrstart,
+                            ev->scanned - ev->hdrstart, &headers) < 0
+        || process_client_headers (connptr, &headers, ev->request) < 0
+        || end_client_headers (connptr, NULL, NULL) < 0) {
+        MITLogWrite (MITLOG_LEVEL_ERROR, "failed to process headers");
+        return -1;
+    }
+
+    if (connptr->content_length.client > 0) {
+        leftover = ev->headlen - ev->scanned;
+        take = min ((long) leftover, connptr->content_length.client);
+        if (take > 0
+            && add_to_buffer (connptr->cbuffer, ev->head + ev->scanned,
+                              take) < 0)
+            return -1;
+        ev->body_left = connptr->content_length.client - take;
+        if (ev->body_left > 0) {
+            connptr->state = CONN_READ_BODY;
+            return 0;
+        }
+    }
+
+    return ev_dispatch (ev);
+}
+
+/* Split off whatever complete lines have arrived. */
+static int ev_parse_head (struct evconn_s *ev)
+{
+    struct conn_s *connptr = ev->conn;
+    char *line, *nl;
+    size_t linelen;
+
+    while ((nl = (char *) memchr (ev->head + ev->scanned, '\n',
+                                  ev->headlen - ev->scanned)) != NULL) {
+        line = ev->head + ev->scanned;
+        linelen = nl - line + 1;
+        ev->scanned += linelen;
+
+        if (connptr->state == CONN_READ_HEADERS) {
+            if (CHECK_CRLF (line, linelen))
+                return ev_headers_done (ev);
+            continue;
+        }
+
+        /* Blank lines ahead of the request line are skipped. */
+        if (CHECK_CRLF (line, linelen)) {
+            ev->hdrstart = ev->scanned;
+            continue;
+        }
+
+        connptr->request_line = arena_strndup (connptr->arena, line,
+                                               linelen);
+        chomp (connptr->request_line, linelen);
+
+        ev->request = process_request (connptr);
+        if (!ev->request) {
+            MITLogWrite (MITLOG_LEVEL_ERROR, "failed to process request");
+            return -1;
+        }
+        ev->hdrstart = ev->scanned;
+        connptr->state = CONN_READ_HEADERS;
+    }
+    return 0;
+}
+
+static int ev_read_client (struct evconn_s *ev)
+{
+    struct conn_s *connptr = ev->conn;
+    ssize_t len;
+
+    if (connptr->state == CONN_READ_BODY) {
+        len = read_buffer (connptr->cbuffer, connptr->client_fd,
+                           ev->body_left);
+        if (len == -EAGAIN)
+            return 0;
+        if (len <= 0)
+            return -1;
+        ev->body_left -= len;
+        return ev->body_left > 0 ? 0 : ev_dispatch (ev);
+    }
+
+    if (ev->headlen == ev->headcap) {
+        if (ev->headcap >= EVENT_MAXHEADERS) {
+            MITLogWrite (MITLOG_LEVEL_ERROR,
+                         "request headers on fd %d exceed %d bytes",
+                         connptr->client_fd, EVENT_MAXHEADERS);
+            return -1;
+        }
+        ev->headcap = ev->headcap ? ev->headcap * 2 : MAXLINE;
+        ev->head = (char *) Realloc (ev->head, ev->headcap);
+    }
+
+    do {
+        len = recv (connptr->client_fd, ev->head + ev->headlen,
+                    ev->headcap - ev->headlen, 0);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (len <= 0)
+        return -1;
+
+    ev->headlen += len;
+    return ev_parse_head (ev);
+}
+
+/*
+ * The response is over: at EOF, or once a Content-Length body is
+ * complete, so an origin that lingers before closing costs nothing.
+ * Only a response that ended where it said it would, and that may be
+ * kept by a shared cache (see fresh.c), is cached, in the form the
+ * threaded engine caches it (cacheable_raw_response() in reqs.c).  Any
+ * other complete response to a cacheable request drops what was cached
+ * for it.
+ */
+static void ev_server_done (struct evconn_s *ev)
+{
+    struct conn_s *connptr = ev->conn;
+    char *value = NULL;
+    size_t size;
+
+    ev->server_eof = 1;
+    if (ev->cacheable && ev->rparsed && ev->body_togo <= 0
+        && connptr->status >= 200 && connptr->status != 304) {
+        if (ev->capture && buffer_size (connptr->sbuffer) > 0
+            && connptr->freshresp.storable)
+            value = cacheable_raw_response (connptr, ev->request, &size);
+        if (value != NULL) {
+            cache_update (CACHE, ev->key, value, size,
+                          connptr->freshresp.expires);
+            Free (value);
+        } else {
+            cache_remove (CACHE, ev->key);
+        }
+    }
+    ev_finish (ev);
+}
+
+/*
+ * Watch the response head go by to learn where the body ends.  Returns
+ * how many of the len bytes still belong to the head.  A head we cannot
+ * make sense of leaves body_togo at -1: the body runs to EOF.
+ */
+static size_t ev_response_head (struct evconn_s *ev, const char *data,
+                                size_t len)
+{
+    struct http_headers_s headers;
+    char *end, *block, *value;
+    size_t from = ev->rheadlen > 3 ? ev->rheadlen - 3 : 0;
+    size_t headlen, taken;
+    int status;
+
+    if (ev->rheadlen + len > EVENT_MAXHEADERS) {
+        ev->rparsed = 1;
+        return len;
+    }
+    ev->rhead = (char *) Realloc (ev->rhead, ev->rheadlen + len);
+    memcpy (ev->rhead + ev->rheadlen, data, len);
+    ev->rheadlen += len;
+
+    end = (char *) memmem (ev->rhead + from, ev->rheadlen - from,
+                           "\r\n\r\n", 4);
+    if (!end)
+        return len;
+    headlen = end + 4 - ev->rhead;
+    taken = len - (ev->rheadlen - headlen);
+    ev->rparsed = 1;
+
+    block = (char *) memchr (ev->rhead, '\n', headlen) + 1;
+    if (sscanf (ev->rhead, "HTTP/%*u.%*u %d", &status) != 1
+        || (status >= 100 && status < 200)
+        || http_parse_headers (block, ev->rhead + headlen - block,
+                               &headers) < 0)
+        return taken;
+
+    ev->conn->status = status;
+    fresh_response (status, &headers, NULL, &ev->conn->freshreq, time (NULL),
+                    &ev->conn->freshresp);
+
+    if (!strcasecmp (ev->request->method, "HEAD") || status == 204
+        || status == 304)
+        ev->body_togo = 0;
+    else if (!http_header_get (&headers, "Transfer-Encoding")
+             && (value = http_header_get (&headers, "Content-Length")))
+        ev->body_togo = atol (value);
+    return taken;
+}
+
+/*
+ * Once the response is too big to cache and everything copied so far
+ * has gone out, the rest moves from the origin to the client through a
+ * pipe and never comes up into user space.  The origin is only read
+ * again when the pipe is empty.  Returns 1 if it did the read, 0 if the
+ * caller should copy instead, or -1 on error.
+ */
+static int ev_splice_server (struct evconn_s *ev)
+{
+    struct conn_s *connptr = ev->conn;
+    size_t size = NETWORK_SPLICE_SIZE;
+    ssize_t len;
+
+    if (ev->capture || buffer_size (ev->toclient) > 0)
+        return 0;
+    if (ev->pipefd[0] < 0 && pipe2 (ev->pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        ev->pipefd[0] = ev->pipefd[1] = -1;
+        return 0;
+    }
+
+    if (ev->body_togo >= 0 && (size_t) ev->body_togo < size)
+        size = ev->body_togo;
+    do {
+        len = splice (connptr->server_fd, NULL, ev->pipefd[1], NULL,
+                      size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 1;
+    if (len < 0)
+        return -1;
+    if (len == 0) {
+        ev_server_done (ev);
+        return 1;
+    }
+
+    ev->piped += len;
+    if (ev->body_togo > 0)
+        ev->body_togo -= len;
+    if (ev_send_client (ev) < 0)
+        return -1;
+    if (ev->body_togo == 0)
+        ev_server_done (ev);
+    return 1;
+}
+
+static int ev_read_server (struct evconn_s *ev)
+{
+    struct conn_s *connptr = ev->conn;
+    size_t body;
+    ssize_t len;
+    int ret;
+
+    if ((ret = ev_splice_server (ev)) != 0)
+        return ret < 0 ? -1 : 0;
+
+    do {
+        len = recv (connptr->server_fd, ev->reactor->scratch,
+                    MAXBUFFSIZE, 0);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (len < 0)
+        return -1;
+
+    if (len == 0) {
+        ev_server_done (ev);
+        return 0;
+    }
+
+    /* Anything past the end of a framed body is not ours to pass on. */
+    body = len;
+    if (!ev->rparsed)
+        body -= ev_response_head (ev, ev->reactor->scratch, len);
+    if (ev->body_togo >= 0 && body > (size_t) ev->body_togo) {
+        len -= body - ev->body_togo;
+        body = ev->body_togo;
+    }
+    if (ev->body_togo > 0)
+        ev->body_togo -= body;
+
+    if (add_to_buffer (ev->toclient, ev->reactor->scratch, len) < 0)
+        return -1;
+
+    /*
+     * Keep a copy for the cache until the object is known to be too big.
+     * Only what fits in memory is kept: anything bigger would go to the
+     * disk tier, and its write should not stall the reactor.
+     */
+    if (ev->capture) {
+        if (buffer_size (connptr->sbuffer) + len > MAX_OBJECT_SIZE) {
+            ev->capture = 0;
+            clear_buffer (connptr->sbuffer);
+        } else if (add_to_buffer (connptr->sbuffer, ev->reactor->scratch,
+                                  len) < 0) {
+            return -1;
+        }
+    }
+
+    if (ev_send_client (ev) < 0)
+        return -1;
+    if (ev->body_togo == 0)
+        ev_server_done (ev);
+    return 0;
+}
+
+static void on_client (struct evconn_s *ev, uint32_t events)
+{
+    struct conn_s *connptr = ev->conn;
+
+    switch (connptr->state) {
+    case CONN_READ_REQUEST:
+    case CONN_READ_HEADERS:
+    case CONN_READ_BODY:
+        if (ev_read_client (ev) < 0)
+            ev_close (ev);
+        break;
+    case CONN_RELAY:
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            ev_close (ev);
+            break;
+        }
+        if (ev_send_client (ev) < 0) {
+            ev_close (ev);
+            break;
+        }
+        ev_finish (ev);
+        break;
+    case CONN_TUNNEL:
+        ev_tunnel (ev, events);
+        break;
+    case CONN_RESOLVE:
+        /*
+         * Hangups are reported whatever the interest, so a client that
+         * goes while its name is looked up leaves the set at once.
+         */
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            epoll_ctl (ev->reactor->epfd, EPOLL_CTL_DEL, connptr->client_fd,
+                       NULL);
+            ev->client_registered = 0;
+            ev_close (ev);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void on_server (struct evconn_s *ev, uint32_t events)
+{
+    struct conn_s *connptr = ev->conn;
+    int error = 0;
+    socklen_t len = sizeof (error);
+
+    if (connptr->state == CONN_CONNECT_UPSTREAM) {
+        if (getsockopt (connptr->server_fd, SOL_SOCKET, SO_ERROR,
+                        &error, &len) < 0 || error != 0) {
+            MITLogWrite (MITLOG_LEVEL_ERROR,
+                         "connect to host \"%s\" failed: %s",
+                         ev->request->host, strerror (error ? error : errno));
+            if (connptr->connect_method)
+                ev_bad_gateway (ev);
+            ev_close (ev);
+            return;
+        }
+        if (connptr->connect_method) {
+            if (ev_connect_done (ev) < 0)
+                ev_close (ev);
+            else
+                ev_tunnel (ev, 0);
+            return;
+        }
+        connptr->state = CONN_RELAY;
+        events |= EPOLLOUT;
+    }
+
+    if (connptr->state == CONN_TUNNEL) {
+        ev_tunnel (ev, events);
+        return;
+    }
+
+    if (connptr->state != CONN_RELAY)
+        return;
+
+    if ((events & EPOLLOUT) && buffer_size (connptr->cbuffer) > 0
+        && send_buffer (connptr->cbuffer, connptr->server_fd) < 0) {
+        ev_close (ev);
+        return;
+    }
+
+    if ((events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !ev->server_eof
+        && ev_read_server (ev) < 0) {
+        MITLogWrite (MITLOG_LEVEL_ERROR, "relay from host \"%s\" failed",
+                     ev->request->host);
+        ev_close (ev);
+    }
+}
+
+/* One of the racing connects is writable: it either won or failed. */
+static void on_attempt (struct evconn_s *ev, unsigned int i)
+{
+    int fd;
+
+    /* The race ended earlier in this batch. */
+    if (!ev->race)
+        return;
+    if ((fd = connect_race_check (&ev->race->race, i)) >= 0) {
+        ev_race_end (ev, fd);
+        ev->conn->server_fd = fd;
+        return;
+    }
+    if (ev_race_advance (ev, monotonic_ms ()) < 0)
+        ev_close (ev);
+}
+
+/* How long epoll_wait() may sleep before some race needs a look. */
+static int reactor_timeout (struct reactor_s *reactor)
+{
+    long long now = monotonic_ms (), wait;
+    int timeout = reactor->conns ? EVENT_SWEEP_INTERVAL : -1;
+    struct evconn_s *ev;
+
+    for (ev = reactor->racing; ev; ev = ev->race_next) {
+        wait = connect_race_wait (&ev->race->race, now);
+        if (timeout < 0 || wait < timeout)
+            timeout = (int) wait;
+    }
+    return timeout;
+}
+
+/* Start staggered attempts that are due and end races past deadline. */
+static void reactor_races (struct reactor_s *reactor)
+{
+    long long now = monotonic_ms ();
+    struct evconn_s *ev, *next;
+
+    for (ev = reactor->racing; ev; ev = next) {
+        next = ev->race_next;
+        if (ev->conn->state == CONN_DONE
+            || connect_race_wait (&ev->race->race, now) > 0)
+            continue;
+        if (ev_race_advance (ev, now) < 0 || ev_update (ev) < 0)
+            ev_close (ev);
+    }
+}
+
+static void reactor_accept (struct reactor_s *reactor)
+{
+    struct sockaddr_storage sa;
+    socklen_t salen;
+    struct evconn_s *ev;
+    struct conn_s *connptr;
+    char sock_ipaddr[IP_LENGTH];
+    char peer_ipaddr[IP_LENGTH];
+    int fd, i;
+
+    /* Bounded so that one busy listener cannot starve live connections. */
+    for (i = 0; i != EVENT_MAXEVENTS; i++) {
+        salen = sizeof (sa);
+        fd = accept4 (reactor->listenfd, (struct sockaddr *) &sa, &salen,
+                      SOCK_NONBLOCK);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+                && errno != ECONNABORTED)
+                MITLogWrite (MITLOG_LEVEL_ERROR, "accept failed: %s",
+                             strerror (errno));
+            return;
+        }
+
+        /* No reverse lookup here: it would block the whole reactor. */
+        if (get_ip_string ((struct sockaddr *) &sa, peer_ipaddr,
+                           IP_LENGTH) == NULL)
+            strncpy (peer_ipaddr, "[unknown]", IP_LENGTH);
+        getsock_ip (fd, sock_ipaddr);
+
+        connptr = initialize_conn (fd, peer_ipaddr, peer_ipaddr,
+                                   sock_ipaddr);
+        ev = (struct evconn_s *) arena_calloc (connptr->arena,
+                                               sizeof (struct evconn_s));
+        ev->conn = connptr;
+        ev->reactor = reactor;
+        ev->client.ev = ev->server.ev = ev;
+        ev->server.server = 1;
+        ev->toclient = new_buffer ();
+        ev->pipefd[0] = ev->pipefd[1] = -1;
+        ev->body_togo = -1;
+        ev->last_active = time (NULL);
+        ev->next = reactor->conns;
+        if (ev->next)
+            ev->next->prev = ev;
+        reactor->conns = ev;
+
+        if (ev_watch (ev, 0, EPOLLIN) < 0)
+            ev_free (ev);
+    }
+}
+
+/* Resume the connections whose names have been looked up. */
+static void reactor_resolved (struct reactor_s *reactor)
+{
+    struct evconn_s *ev, *next;
+    struct dns_query_s *query;
+    uint64_t count;
+
+    if (read (reactor->wakefd, &count, sizeof (count)) < 0
+        && errno != EAGAIN)
+        MITLogWrite (MITLOG_LEVEL_ERROR, "eventfd read failed: %s",
+                     strerror (errno));
+
+    pthread_mutex_lock (&reactor->lock);
+    ev = reactor->resolved;
+    reactor->resolved = NULL;
+    pthread_mutex_unlock (&reactor->lock);
+
+    for (; ev; ev = next) {
+        next = ev->next_resolved;
+        query = ev->query;
+        ev->query = NULL;
+        ev->last_active = time (NULL);
+        if (ev->conn->state == CONN_DONE) {
+            ev_reap (ev);
+        } else if (ev_connect_server (ev, query->addrs, query->result) < 0
+                   || ev_update (ev) < 0) {
+            ev_close (ev);
+        }
+        Free (query);
+    }
+}
+
+static void *reactor_main (void *ptr_void)
+{
+    struct reactor_s *reactor = (struct reactor_s *) ptr_void;
+    struct epoll_event events[EVENT_MAXEVENTS];
+    struct evhandle_s *handle;
+    struct evconn_s *ev, *next;
+    time_t now;
+    int i, n;
+
+    while (1) {
+        if (QUIT)
+            return NULL;
+
+        /*
+         * Connections need the odd wakeup to notice they have stalled,
+         * and racing connects one for each stagger and deadline.
+         */
+        n = epoll_wait (reactor->epfd, events, EVENT_MAXEVENTS,
+                        reactor_timeout (reactor));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            MITLogWrite (MITLOG_LEVEL_ERROR, "epoll_wait failed: %s",
+                         strerror (errno));
+            return NULL;
+        }
+
+        now = time (NULL);
+        for (i = 0; i != n; i++) {
+            handle = (struct evhandle_s *) events[i].data.ptr;
+            if (handle == NULL) {
+                reactor_accept (reactor);
+                continue;
+            }
+            if (handle == &reactor->wakeup) {
+                reactor_resolved (reactor);
+                continue;
+            }
+
+            /* Closed earlier in this batch; freed below. */
+            ev = handle->ev;
+            if (ev->conn->state == CONN_DONE)
+                continue;
+
+            ev->last_active = now;
+            if (handle->attempt)
+                on_attempt (ev, handle->attempt - 1);
+            else if (handle->server)
+                on_server (ev, events[i].events);
+            else
+                on_client (ev, events[i].events);
+
+            if (ev->conn->state != CONN_DONE && ev_update (ev) < 0)
+                ev_close (ev);
+        }
+
+        if (reactor->racing)
+            reactor_races (reactor);
+        if (reactor->conns)
+            reactor_sweep (reactor);
+
+        ev = reactor->closed;
+        reactor->closed = NULL;
+        while (ev) {
+            next = ev->next_closed;
+            ev_free (ev);
+            ev = next;
+        }
+    }
+    return NULL;
+}
+
+void event_main_loop (int listenfd, unsigned int nreactors)
+{
+    struct reactor_s *reactors;
+    struct epoll_event event;
+    pthread_t thread;
+    unsigned int i;
+
+    assert (nreactors > 0);
+
+    if (socket_nonblocking (listenfd) < 0) {
+        MITLogWrite (MITLOG_LEVEL_ERROR, "could not make listener non-blocking");
+        return;
+    }
+
+    reactors = (struct reactor_s *) Calloc (nreactors,
+                                            sizeof (struct reactor_s));
+    for (i = 0; i != nreactors; i++) {
+        reactors[i].listenfd = listenfd;
+        reactors[i].scratch = (char *) Malloc (MAXBUFFSIZE);
+        reactors[i].epfd = epoll_create1 (0);
+        if (reactors[i].epfd < 0) {
+            MITLogWrite (MITLOG_LEVEL_ERROR, "epoll_create1 failed: %s",
+                         strerror (errno));
+            return;
+        }
+
+        pthread_mutex_init (&reactors[i].lock, NULL);
+        reactors[i].wakefd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+        event.events = EPOLLIN;
+        event.data.ptr = &reactors[i].wakeup;
+        if (reactors[i].wakefd < 0
+            || epoll_ctl (reactors[i].epfd, EPOLL_CTL_ADD, reactors[i].wakefd,
+                          &event) < 0) {
+            MITLogWrite (MITLOG_LEVEL_ERROR,
+                         "could not set up the resolver wakeup: %s",
+                         strerror (errno));
+            return;
+        }
+
+        /* Every reactor accepts for itself; wake only one of them. */
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = NULL;
+        if (epoll_ctl (reactors[i].epfd, EPOLL_CTL_ADD, listenfd,
+                       &event) < 0) {
+            event.events = EPOLLIN;
+            if (epoll_ctl (reactors[i].epfd, EPOLL_CTL_ADD, listenfd,
+                           &event) < 0) {
+                MITLogWrite (MITLOG_LEVEL_ERROR,
+                             "could not watch the listening socket: %s",
+                             strerror (errno));
+                return;
+            }
+        }
+    }
+
+    MITLogWrite (MITLOG_LEVEL_COMMON, "event engine running %u reactors",
+                 nreactors);
+    for (i = 1; i != nreactors; i++)
+        Pthread_create (&thread, NULL, reactor_main, &reactors[i]);
+    reactor_main (&reactors[0]);
+}
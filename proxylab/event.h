@@ -0,0 +1,15 @@
+#ifndef _PROXYLAB_EVENT_H_
+#define _PROXYLAB_EVENT_H_
+
+#include "proxy.h"
+
+#define EVENT_STARTREACTORS 4     /* default number of reactor threads */
+#define EVENT_MAXEVENTS 256       /* events taken per epoll_wait() */
+#define EVENT_MAXHEADERS (64 * 1024)
+#define EVENT_HIGHWATER (MAXBUFFSIZE * 2)
+#define EVENT_SWEEP_INTERVAL 1000 /* ms between checks for stalled conns */
+#define EVENT_UPSTREAM_TIMEOUT 30 /* seconds an origin may keep us waiting */
+
+extern void event_main_loop (int listenfd, unsigned int nreactors);
+
+#endif
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE /* memmem */
+#include "fresh.h"
+
+/* Statuses that may be cached without explicit freshness (RFC 9110). */
+static const int heuristic_statuses[] = {200, 203, 204, 300, 301, 308, 404,
+                                         405, 410, 414, 501};
+
+/*
+ * Request headers the proxy replaces with its own, so a response that
+ * varies on them still has one form per key.
+ */
+static const char *fixed_headers[] = {"Accept", "Accept-Encoding",
+                                      "User-Agent"};
+
+void fresh_request (struct http_headers_s *headers,
+                    struct fresh_request_s *request)
+{
+    long maxage;
+
+    request->nostore = http_header_directive (headers, "Cache-Control",
+                                              "no-store", NULL);
+    request->reload = http_header_directive (headers, "Cache-Control",
+                                             "no-cache", NULL)
+                      || http_header_has_token (headers, "Pragma", "no-cache")
+                      || (http_header_directive (headers, "Cache-Control",
+                                                 "max-age", &maxage)
+                          && maxage == 0);
+    request->authorized = http_header_get (headers, "Authorization") != NULL;
+}
+
+static int heuristic_status (int status)
+{
+    unsigned int i;
+
+    for (i = 0; i != sizeof (heuristic_statuses) / sizeof (int); i++)
+        if (heuristic_statuses[i] == status)
+            return 1;
+    return 0;
+}
+
+/* Whether every header named in Vary is one the proxy fixes. */
+static int vary_fixed (struct http_headers_s *headers)
+{
+    const char *data = http_header_get (headers, "Vary");
+    size_t len;
+    unsigned int i;
+
+    if (data == NULL)
+        return 1;
+    for (; *data; data += len) {
+        data += strspn (data, " \t,");
+        if ((len = strcspn (data, " \t,")) == 0)
+            continue;
+        for (i = 0; i != sizeof (fixed_headers) / sizeof (char *); i++)
+            if (strlen (fixed_headers[i]) == len
+                && !strncasecmp (data, fixed_headers[i], len))
+                break;
+        if (i == sizeof (fixed_headers) / sizeof (char *))
+            return 0;
+    }
+    return 1;
+}
+
+/* The date in header name, or -1. */
+static time_t header_date (struct http_headers_s *headers, const char *name)
+{
+    const char *value = headers ? http_header_get (headers, name) : NULL;
+
+    return value ? http_parse_date (value) : -1;
+}
+
+/*
+ * How long a response stays fresh from when it was generated: s-maxage
+ * (we are a shared cache), then max-age, then Expires, then a tenth of
+ * the time since Last-Modified, then FRESH_DEFAULT_TTL.
+ */
+static long freshness_lifetime (struct http_headers_s *cc,
+                                struct http_headers_s *headers,
+                                time_t date)
+{
+    const char *value;
+    time_t expires, modified;
+    long maxage;
+
+    if (http_header_directive (cc, "Cache-Control", "s-maxage", &maxage)
+        && maxage >= 0)
+        return maxage;
+    if (http_header_directive (cc, "Cache-Control", "max-age", &maxage)
+        && maxage >= 0)
+        return maxage;
+    if ((value = http_header_get (cc, "Expires")) != NULL) {
+        /* An Expires that does not parse, like "0", is in the past. */
+        expires = http_parse_date (value);
+        return expires > date ? (long) (expires - date) : 0;
+    }
+    if ((modified = header_date (headers, "Last-Modified")) >= 0
+        && modified < date) {
+        maxage = (long) (date - modified) / FRESH_HEURISTIC_FACTOR;
+        return maxage < FRESH_HEURISTIC_MAX ? maxage : FRESH_HEURISTIC_MAX;
+    }
+    return FRESH_DEFAULT_TTL;
+}
+
+/*
+ * Judge a response.  For a 304 that revalidated a stored response,
+ * stored holds that response's headers: whatever the 304 leaves out is
+ * taken from there.
+ */
+void fresh_response (int status, struct http_headers_s *headers,
+                     struct http_headers_s *stored,
+                     const struct fresh_request_s *request, time_t now,
+                     struct fresh_response_s *response)
+{
+    struct http_headers_s *cc = headers, *base = headers;
+    const char *value;
+    time_t date;
+    long age, lifetime, explicit;
+
+    response->storable = 0;
+    response->expires = 0;
+
+    if (stored) {
+        base = stored;
+        if (!http_header_get (headers, "Cache-Control")
+            && !http_header_get (headers, "Expires"))
+            cc = stored;
+    }
+
+    if (request->nostore || status == 206
+        || http_header_directive (cc, "Cache-Control", "no-store", NULL)
+        || http_header_directive (cc, "Cache-Control", "private", NULL)
+        || !vary_fixed (base))
+        return;
+    if (request->authorized
+        && !http_header_directive (cc, "Cache-Control", "public", NULL)
+        && !http_header_directive (cc, "Cache-Control", "s-maxage", NULL)
+        && !http_header_directive (cc, "Cache-Control", "must-revalidate",
+                                   NULL))
+        return;
+
+    explicit = http_header_directive (cc, "Cache-Control", "s-maxage", NULL)
+               || http_header_directive (cc, "Cache-Control", "max-age", NULL)
+               || http_header_get (cc, "Expires");
+    if (!stored && !explicit && !heuristic_status (status))
+        return;
+    response->storable = 1;
+
+    /* Stored, but to be revalidated every time it is used. */
+    if (http_header_directive (cc, "Cache-Control", "no-cache", NULL))
+        return;
+
+    if ((date = header_date (headers, "Date")) < 0 || date > now)
+        date = now;
+    lifetime = freshness_lifetime (cc, base, date);
+
+    age = now - date;
+    if ((value = http_header_get (headers, "Age")) != NULL && atol (value) > age)
+        age = atol (value);
+
+    if (lifetime > age)
+        response->expires = now + (lifetime - age);
+}
+
+/*
+ * Parse the headers of a stored response.  They are parsed in place,
+ * so from a copy, which the caller frees with Free() after it is done
+ * with headers.  Returns 0, or -EINVAL if the head is malformed.
+ */
+int fresh_stored_headers (const char *data, size_t len, char **copy,
+                          struct http_headers_s *headers)
+{
+    const char *nl, *end;
+    size_t headlen;
+
+    *copy = NULL;
+    nl = (const char *) memchr (data, '\n', len);
+    end = (const char *) memmem (data, len, "\r\n\r\n", 4);
+    if (nl == NULL || end == NULL || end < nl - 1)
+        return -EINVAL;
+
+    headlen = end + 4 - (nl + 1);
+    *copy = (char *) Malloc (headlen);
+    memcpy (*copy, nl + 1, headlen);
+    if (http_parse_headers (*copy, headlen, headers) < 0) {
+        Free (*copy);
+        *copy = NULL;
+        return -EINVAL;
+    }
+    return 0;
+}
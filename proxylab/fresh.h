@@ -0,0 +1,41 @@
+#ifndef _PROXYLAB_FRESH_H_
+#define _PROXYLAB_FRESH_H_
+
+#include "csapp.h"
+#include "http.h"
+
+#define FRESH_DEFAULT_TTL 300       /* seconds, with nothing to go on */
+#define FRESH_HEURISTIC_FACTOR 10   /* a tenth of the age of Last-Modified */
+#define FRESH_HEURISTIC_MAX 86400   /* but no more than a day */
+
+/*
+ * HTTP caching rules for a shared cache: whether a response may be
+ * stored and until when it can be served without asking the origin.
+ * A stored response past its time is stale: it is revalidated with
+ * its ETag or Last-Modified before it is used again, or fetched anew if
+ * it has neither.
+ */
+
+/* What the request says about the cache. */
+struct fresh_request_s {
+    unsigned int nostore;           /* no-store: keep no copy of this */
+    unsigned int reload;            /* no-cache and the like: ask the origin */
+    unsigned int authorized;        /* carries Authorization */
+};
+
+/* What the response allows. */
+struct fresh_response_s {
+    unsigned int storable;
+    time_t expires;                 /* stale from then on */
+};
+
+extern void fresh_request (struct http_headers_s *headers,
+                           struct fresh_request_s *request);
+extern void fresh_response (int status, struct http_headers_s *headers,
+                            struct http_headers_s *stored,
+                            const struct fresh_request_s *request,
+                            time_t now, struct fresh_response_s *response);
+extern int fresh_stored_headers (const char *data, size_t len, char **copy,
+                                 struct http_headers_s *headers);
+
+#endif
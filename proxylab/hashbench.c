@@ -0,0 +1,347 @@
+/*
+ * hashbench - insert, lookup, walk and remove throughput of hashmap_t
+ * against the chained table it replaced.
+ *
+ * usage: ./hashbench [rounds]
+ *
+ * The chained table is reproduced here as it was: a fixed number of
+ * buckets (CACHE_BUCKET for cache keys, 32 for header names), three
+ * Malloc()s per entry, strcasecmp() all along the chain and the old
+ * hash, whose carry bit went to bit 3 instead of bit 31.  Cache keys
+ * look like the ones buffer_to_key() makes; header names are looked up
+ * in whatever case the client sent, so that table ignores case.  Keys
+ * are made before the clock starts.  A walk visits every entry: the
+ * chained table by index, the way hashmap_return_entry() used to, from
+ * bucket 0 each time, and hashmap_t with a cursor.
+ */
+#include "csapp.h"
+#include "hashmap.h"
+#include "cache.h"
+
+#define KEY_LENGTH 64
+#define OLD_HEADER_BUCKETS 32
+
+static const unsigned int populations[] = {1000, 10000, 30000};
+
+static const char *header_names[] = {
+    "Host", "User-Agent", "Accept", "Accept-Language", "Accept-Encoding",
+    "Referer", "Cookie", "Connection", "Upgrade-Insecure-Requests",
+    "If-Modified-Since", "If-None-Match", "Cache-Control", "Content-Type",
+    "Content-Length", "Authorization", "Origin", "Pragma", "DNT",
+    "Sec-Fetch-Dest", "Sec-Fetch-Mode", "Sec-Fetch-Site", "Priority"};
+#define NHEADERS (sizeof (header_names) / sizeof (header_names[0]))
+
+struct old_entry_s {
+    char *key;
+    void *data;
+    size_t len;
+    struct old_entry_s *next;
+};
+
+struct old_map_s {
+    unsigned int size;
+    struct old_entry_s **buckets;
+};
+
+static int old_hashfunc (const char *key, unsigned int size)
+{
+    uint32_t hash;
+
+    for (hash = tolower (*key++); *key != '\0'; key++) {
+        uint32_t bit = (hash & 1) ? (1 << (sizeof (uint32_t) - 1)) : 0;
+
+        hash >>= 1;
+        hash += tolower (*key) + bit;
+    }
+    return hash % size;
+}
+
+static struct old_map_s *old_create (unsigned int nbuckets)
+{
+    struct old_map_s *map = (struct old_map_s *) Malloc (sizeof (*map));
+
+    map->size = nbuckets;
+    map->buckets = (struct old_entry_s **) Calloc (nbuckets,
+                                                   sizeof (*map->buckets));
+    return map;
+}
+
+/* Appended at the tail of the chain, as it was. */
+static void old_insert (struct old_map_s *map, const char *key,
+                        const void *data, size_t len)
+{
+    struct old_entry_s **pp = &map->buckets[old_hashfunc (key, map->size)];
+    struct old_entry_s *ptr = (struct old_entry_s *) Malloc (sizeof (*ptr));
+
+    ptr->key = strdup (key);
+    ptr->data = Malloc (len);
+    memcpy (ptr->data, data, len);
+    ptr->len = len;
+    ptr->next = NULL;
+    while (*pp)
+        pp = &(*pp)->next;
+    *pp = ptr;
+}
+
+static ssize_t old_lookup (struct old_map_s *map, const char *key,
+                           void **data)
+{
+    struct old_entry_s *ptr = map->buckets[old_hashfunc (key, map->size)];
+
+    for (; ptr; ptr = ptr->next) {
+        if (strcasecmp (ptr->key, key) == 0) {
+            *data = ptr->data;
+            return ptr->len;
+        }
+    }
+    return 0;
+}
+
+/* The iter-th entry, counting through the buckets from the first. */
+static ssize_t old_nth (struct old_map_s *map, unsigned int iter,
+                        void **data)
+{
+    struct old_entry_s *ptr;
+    unsigned int i;
+
+    for (i = 0; i != map->size; i++) {
+        for (ptr = map->buckets[i]; ptr; ptr = ptr->next) {
+            if (iter-- == 0) {
+                *data = ptr->data;
+                return ptr->len;
+            }
+        }
+    }
+    return 0;
+}
+
+static void old_remove (struct old_map_s *map, const char *key)
+{
+    struct old_entry_s **pp = &map->buckets[old_hashfunc (key, map->size)];
+    struct old_entry_s *ptr;
+
+    while ((ptr = *pp) != NULL) {
+        if (strcasecmp (ptr->key, key) == 0) {
+            *pp = ptr->next;
+            Free (ptr->key);
+            Free (ptr->data);
+            Free (ptr);
+        } else {
+            pp = &ptr->next;
+        }
+    }
+}
+
+static void old_delete (struct old_map_s *map)
+{
+    struct old_entry_s *ptr, *next;
+    unsigned int i;
+
+    for (i = 0; i != map->size; i++) {
+        for (ptr = map->buckets[i]; ptr; ptr = next) {
+            next = ptr->next;
+            Free (ptr->key);
+            Free (ptr->data);
+            Free (ptr);
+        }
+    }
+    Free (map->buckets);
+    Free (map);
+}
+
+static double now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* ns per operation for insert, lookup hit and miss, walk and remove. */
+struct result_s {
+    double insert, hit, miss, walk, remove;
+};
+
+static void print_result (const char *what, unsigned int n,
+                          const char *table, struct result_s *r)
+{
+    printf ("%-8s %8u %-8s %10.1f %10.1f %10.1f %10.1f %10.1f\n", what, n,
+            table, r->insert, r->hit, r->miss, r->walk, r->remove);
+}
+
+/*
+ * Insert keys[0, n), look up hits[0, n) and then misses[0, n) rounds
+ * times each, walk the entries once and remove the keys again.
+ */
+static void run_new (char **keys, char **hits, char **misses, unsigned int n,
+                     unsigned int rounds, unsigned int nbuckets, int nocase,
+                     struct result_s *r, unsigned long *check)
+{
+    hashmap_t map = nocase ? hashmap_create_nocase (nbuckets)
+                           : hashmap_create (nbuckets);
+    hashmap_cursor_t cursor;
+    unsigned int i, k;
+    double start;
+    char *key;
+    void *data;
+
+    start = now_ns ();
+    for (i = 0; i != n; i++)
+        hashmap_insert (map, keys[i], &i, sizeof (i));
+    r->insert = (now_ns () - start) / n;
+
+    start = now_ns ();
+    for (k = 0; k != rounds; k++)
+        for (i = 0; i != n; i++)
+            *check += hashmap_entry_by_key (map, hits[i], &data);
+    r->hit = (now_ns () - start) / ((double) n * rounds);
+
+    start = now_ns ();
+    for (k = 0; k != rounds; k++)
+        for (i = 0; i != n; i++)
+            *check += hashmap_entry_by_key (map, misses[i], &data);
+    r->miss = (now_ns () - start) / ((double) n * rounds);
+
+    start = now_ns ();
+    for (cursor = hashmap_cursor_first (map); cursor;
+         cursor = hashmap_cursor_next (cursor))
+        *check += hashmap_cursor_entry (cursor, &key, &data);
+    r->walk = (now_ns () - start) / n;
+
+    start = now_ns ();
+    for (i = 0; i != n; i++)
+        hashmap_remove (map, keys[i]);
+    r->remove = (now_ns () - start) / n;
+    hashmap_delete (map);
+}
+
+static void run_old (char **keys, char **hits, char **misses, unsigned int n,
+                     unsigned int rounds, unsigned int nbuckets,
+                     struct result_s *r, unsigned long *check)
+{
+    struct old_map_s *map = old_create (nbuckets);
+    unsigned int i, k;
+    double start;
+    void *data;
+
+    start = now_ns ();
+    for (i = 0; i != n; i++)
+        old_insert (map, keys[i], &i, sizeof (i));
+    r->insert = (now_ns () - start) / n;
+
+    start = now_ns ();
+    for (k = 0; k != rounds; k++)
+        for (i = 0; i != n; i++)
+            *check += old_lookup (map, hits[i], &data);
+    r->hit = (now_ns () - start) / ((double) n * rounds);
+
+    start = now_ns ();
+    for (k = 0; k != rounds; k++)
+        for (i = 0; i != n; i++)
+            *check += old_lookup (map, misses[i], &data);
+    r->miss = (now_ns () - start) / ((double) n * rounds);
+
+    start = now_ns ();
+    for (i = 0; i != n; i++)
+        *check += old_nth (map, i, &data);
+    r->walk = (now_ns () - start) / n;
+
+    start = now_ns ();
+    for (i = 0; i != n; i++)
+        old_remove (map, keys[i]);
+    r->remove = (now_ns () - start) / n;
+    old_delete (map);
+}
+
+static char **make_keys (unsigned int n, const char *host)
+{
+    char **keys = (char **) Malloc (n * sizeof (char *));
+    char key[KEY_LENGTH];
+    unsigned int i;
+
+    for (i = 0; i != n; i++) {
+        snprintf (key, sizeof (key), "GET /object/%u HTTP/1.0\r\nHost: %s\r\n",
+                  i, host);
+        keys[i] = strdup (key);
+    }
+    return keys;
+}
+
+static void free_keys (char **keys, unsigned int n)
+{
+    unsigned int i;
+
+    for (i = 0; i != n; i++)
+        Free (keys[i]);
+    Free (keys);
+}
+
+/* The same name in the case a client might send it. */
+static char *shout (const char *name)
+{
+    char *copy = strdup (name);
+    char *p;
+
+    for (p = copy; *p; p++)
+        *p = toupper (*p);
+    return copy;
+}
+
+static char *missing_name (unsigned int i)
+{
+    char name[KEY_LENGTH];
+
+    snprintf (name, sizeof (name), "X-Missing-%u", i);
+    return strdup (name);
+}
+
+int main (int argc, char *argv[])
+{
+    unsigned int rounds = (argc > 1) ? (unsigned int) atoi (argv[1]) : 3;
+    char **keys, **misses, *names[NHEADERS], *asked[NHEADERS];
+    char *absent[NHEADERS];
+    unsigned long check = 0;
+    struct result_s r;
+    unsigned int p, i;
+
+    if (rounds < 1) {
+        fprintf (stderr, "usage: %s [rounds]\n", argv[0]);
+        return 1;
+    }
+
+    printf ("%-8s %8s %-8s %10s %10s %10s %10s %10s\n", "keys", "count",
+            "table", "insert", "hit", "miss", "walk", "remove");
+    for (p = 0; p != sizeof (populations) / sizeof (populations[0]); p++) {
+        keys = make_keys (populations[p], "bench");
+        misses = make_keys (populations[p], "other");
+        run_old (keys, keys, misses, populations[p], rounds, CACHE_BUCKET, &r,
+                 &check);
+        print_result ("cache", populations[p], "chained", &r);
+        run_new (keys, keys, misses, populations[p], rounds, CACHE_BUCKET, 0,
+                 &r, &check);
+        print_result ("cache", populations[p], "open", &r);
+        free_keys (keys, populations[p]);
+        free_keys (misses, populations[p]);
+    }
+
+    /* Header names: a small table, hit in another case. */
+    for (i = 0; i != NHEADERS; i++) {
+        names[i] = strdup (header_names[i]);
+        asked[i] = shout (header_names[i]);
+        absent[i] = missing_name (i);
+    }
+    run_old (names, asked, absent, NHEADERS, rounds * 10000,
+             OLD_HEADER_BUCKETS, &r, &check);
+    print_result ("headers", NHEADERS, "chained", &r);
+    run_new (names, asked, absent, NHEADERS, rounds * 10000,
+             OLD_HEADER_BUCKETS, 1, &r, &check);
+    print_result ("headers", NHEADERS, "open", &r);
+    for (i = 0; i != NHEADERS; i++) {
+        Free (names[i]);
+        Free (asked[i]);
+        Free (absent[i]);
+    }
+
+    printf ("ns per operation\n");
+    return check == 0;          /* keeps the work from being optimized out */
+}
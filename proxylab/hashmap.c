@@ -1,49 +1,359 @@
 #include "hashmap.h"
 
+/*
+ * Open addressing with linear probing.  The slots hold only the full
+ * 64-bit hash of each key and a pointer to its entry, so a probe
+ * compares hashes along one run of cache lines and only touches an
+ * entry whose hash matches.  An entry is one allocation: the header
+ * below, the key and the data.
+ *
+ * Removing an entry leaves a tombstone, so runs that go past it stay
+ * intact.  When live entries and tombstones reach 3/4 of the slots the
+ * table is replaced by one twice as big (or as big, if it is mostly
+ * tombstones), and the old one is drained into it HASHMAP_MIGRATE slots
+ * at a time by later inserts and removals.  Until then lookups look in
+ * both.
+ *
+ * Entries are also on two lists: by recency, for hashmap_remove_lru(),
+ * and by insertion, for cursors and the index iterators, so a walk
+ * over the map never depends on where the slots put them.
+ */
+#define TOMBSTONE ((struct hashentry_s *) 1)
+#define HASHMAP_ALIGN 16
+
+#define HASH_SEED 0x9e3779b97f4a7c15ull
+#define HASH_K1 0xa0761d6478bd642full
+#define HASH_K2 0xe7037ed1a0b428dbull
+
 struct hashentry_s {
-    char *key;
-    void *data;
+    uint64_t hash;
+    size_t keylen;
     size_t len;
-    long timestamp;
-    int count;
+    void *data;                             /* in this allocation */
+
+    struct hashentry_s *lru_prev, *lru_next; /* recency list */
+    struct hashentry_s *order_prev, *order_next; /* insertion order */
+    char key[];
+};
 
-    struct hashentry_s *prev, *next;
+struct hashslot_s {
+    uint64_t hash;
+    struct hashentry_s *entry;      /* NULL if never used, or TOMBSTONE */
 };
 
-struct hashbucket_s {
-    struct hashentry_s *head, *tail;
+struct hashtable_s {
+    struct hashslot_s *slots;
+    size_t mask;                    /* slots - 1, a power of two less one */
+    size_t used;
+    size_t deleted;                 /* tombstones */
 };
 
 struct hashmap_s {
-    unsigned int size;
-    hashmap_iter end_iterator;
+    unsigned int nocase;
+    hashmap_iter end_iterator;      /* number of entries */
+
+    struct hashtable_s table;       /* where new entries go */
+    struct hashtable_s old;         /* being drained, if slots is set */
+    size_t migrated;                /* old slots below this are drained */
+
+    /* Every entry, most recently used first. */
+    struct hashentry_s *lru_head, *lru_tail;
+
+    /* Every entry, oldest first. */
+    struct hashentry_s *order_head, *order_tail;
 
-    struct hashbucket_s *buckets;
+    /* Where the last index lookup landed, so iter++ is one step. */
+    hashmap_iter last_iter;
+    struct hashentry_s *last_entry;
 };
 
-static int hashfunc (const char *key, unsigned int size)
+static uint64_t hash_mix (uint64_t a, uint64_t b)
 {
-    uint32_t hash;
+    __uint128_t r = (__uint128_t) a * b;
 
-    if (key == NULL)
-        return -EINVAL;
-    if (size == 0)
-        return -ERANGE;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
 
-    for (hash = tolower (*key++); *key != '\0'; key++) {
-        uint32_t bit = (hash & 1) ? (1 << (sizeof (uint32_t) - 1)) : 0;
+/* ASCII upper case to lower case in all eight bytes of w at once. */
+static uint64_t fold_word (uint64_t w)
+{
+    uint64_t low7 = w & 0x7f7f7f7f7f7f7f7full;
+    uint64_t from_a = low7 + 0x3f3f3f3f3f3f3f3full;    /* >= 'A' */
+    uint64_t past_z = low7 + 0x2525252525252525ull;    /* > 'Z' */
+    uint64_t upper = ~w & (from_a ^ past_z) & 0x8080808080808080ull;
 
-        hash >>= 1;
+    return w | (upper >> 2);
+}
 
-        hash += tolower (*key) + bit;
+/*
+ * Eight bytes at a time, each word folded in with a 64x64->128 bit
+ * multiply, as in wyhash.  The nocase hash folds case first, so keys
+ * that differ only in ASCII case hash the same.
+ */
+static uint64_t hashfunc (const char *key, size_t len, unsigned int nocase)
+{
+    uint64_t hash = HASH_SEED ^ len, word;
+    size_t i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy (&word, key + i, 8);
+        if (nocase)
+            word = fold_word (word);
+        hash = hash_mix (hash ^ word, HASH_K1);
     }
+    word = 0;
+    memcpy (&word, key + i, len - i);
+    if (nocase)
+        word = fold_word (word);
+    return hash_mix (hash ^ word, HASH_K2);
+}
 
-    return hash % size;
+static int key_equal (struct hashmap_s *map, struct hashentry_s *ptr,
+                      const char *key, size_t keylen)
+{
+    if (ptr->keylen != keylen)
+        return 0;
+    if (map->nocase)
+        return strncasecmp (ptr->key, key, keylen) == 0;
+    return memcmp (ptr->key, key, keylen) == 0;
 }
 
-hashmap_t hashmap_create (unsigned int nbuckets)
+static int table_init (struct hashtable_s *table, size_t nslots)
+{
+    table->slots = (struct hashslot_s *) Calloc (nslots,
+                                                 sizeof (struct hashslot_s));
+    if (!table->slots)
+        return -ENOMEM;
+    table->mask = nslots - 1;
+    table->used = table->deleted = 0;
+    return 0;
+}
+
+/* The slot holding key in table, or NULL. */
+static struct hashslot_s *table_lookup (struct hashmap_s *map,
+                                        struct hashtable_s *table,
+                                        const char *key, size_t keylen,
+                                        uint64_t hash)
+{
+    struct hashslot_s *slot;
+    size_t i;
+
+    if (!table->slots)
+        return NULL;
+    for (i = hash & table->mask;; i = (i + 1) & table->mask) {
+        slot = &table->slots[i];
+        if (slot->entry == NULL)
+            return NULL;
+        if (slot->hash == hash && slot->entry != TOMBSTONE
+            && key_equal (map, slot->entry, key, keylen))
+            return slot;
+    }
+}
+
+/* The slot that points at ptr, or NULL. */
+static struct hashslot_s *table_slot_of (struct hashtable_s *table,
+                                         struct hashentry_s *ptr)
+{
+    struct hashslot_s *slot;
+    size_t i;
+
+    if (!table->slots)
+        return NULL;
+    for (i = ptr->hash & table->mask;; i = (i + 1) & table->mask) {
+        slot = &table->slots[i];
+        if (slot->entry == NULL)
+            return NULL;
+        if (slot->entry == ptr)
+            return slot;
+    }
+}
+
+/* Put ptr in the first free slot of its run; there always is one. */
+static void table_place (struct hashtable_s *table, struct hashentry_s *ptr)
+{
+    struct hashslot_s *slot;
+    size_t i;
+
+    for (i = ptr->hash & table->mask;; i = (i + 1) & table->mask) {
+        slot = &table->slots[i];
+        if (slot->entry == NULL || slot->entry == TOMBSTONE)
+            break;
+    }
+    if (slot->entry == TOMBSTONE)
+        table->deleted--;
+    slot->hash = ptr->hash;
+    slot->entry = ptr;
+    table->used++;
+}
+
+static void table_clear (struct hashtable_s *table, struct hashslot_s *slot)
+{
+    slot->entry = TOMBSTONE;
+    table->used--;
+    table->deleted++;
+}
+
+/* Move up to n slots' worth of the old table into the new one. */
+static void migrate (struct hashmap_s *map, size_t n)
+{
+    struct hashslot_s *slot;
+
+    if (!map->old.slots)
+        return;
+    for (; n > 0 && map->migrated <= map->old.mask; n--, map->migrated++) {
+        slot = &map->old.slots[map->migrated];
+        if (slot->entry != NULL && slot->entry != TOMBSTONE) {
+            table_place (&map->table, slot->entry);
+            table_clear (&map->old, slot);
+        }
+    }
+    if (map->migrated > map->old.mask) {
+        Free (map->old.slots);
+        memset (&map->old, 0, sizeof (map->old));
+    }
+}
+
+/* Make sure there is room for one more entry. */
+static int make_room (struct hashmap_s *map)
+{
+    struct hashtable_s *table = &map->table;
+    size_t nslots = table->mask + 1;
+
+    if ((table->used + table->deleted + 1) * 4 <= nslots * 3)
+        return 0;
+
+    /* A resize still under way is finished first. */
+    migrate (map, (size_t) -1);
+
+    if ((table->used + 1) * 2 > nslots)
+        nslots *= 2;
+    map->old = *table;
+    map->migrated = 0;
+    if (table_init (table, nslots) < 0) {
+        *table = map->old;
+        memset (&map->old, 0, sizeof (map->old));
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void lru_unlink (struct hashmap_s *map, struct hashentry_s *ptr)
+{
+    if (ptr->lru_prev)
+        ptr->lru_prev->lru_next = ptr->lru_next;
+    else
+        map->lru_head = ptr->lru_next;
+    if (ptr->lru_next)
+        ptr->lru_next->lru_prev = ptr->lru_prev;
+    else
+        map->lru_tail = ptr->lru_prev;
+    ptr->lru_prev = ptr->lru_next = NULL;
+}
+
+static void lru_push_front (struct hashmap_s *map, struct hashentry_s *ptr)
+{
+    ptr->lru_prev = NULL;
+    ptr->lru_next = map->lru_head;
+    if (map->lru_head)
+        map->lru_head->lru_prev = ptr;
+    map->lru_head = ptr;
+    if (!map->lru_tail)
+        map->lru_tail = ptr;
+}
+
+static void order_append (struct hashmap_s *map, struct hashentry_s *ptr)
+{
+    ptr->order_next = NULL;
+    ptr->order_prev = map->order_tail;
+    if (map->order_tail)
+        map->order_tail->order_next = ptr;
+    else
+        map->order_head = ptr;
+    map->order_tail = ptr;
+}
+
+static void order_unlink (struct hashmap_s *map, struct hashentry_s *ptr)
+{
+    if (ptr->order_prev)
+        ptr->order_prev->order_next = ptr->order_next;
+    else
+        map->order_head = ptr->order_next;
+    if (ptr->order_next)
+        ptr->order_next->order_prev = ptr->order_prev;
+    else
+        map->order_tail = ptr->order_prev;
+
+    /* Indices after ptr have all moved down one. */
+    map->last_entry = NULL;
+}
+
+/* Record a use of ptr: move it to the front of the recency list. */
+static void touch_entry (struct hashmap_s *map, struct hashentry_s *ptr)
+{
+    if (map->lru_head == ptr)
+        return;
+    lru_unlink (map, ptr);
+    lru_push_front (map, ptr);
+}
+
+/* Find key in either table. */
+static struct hashentry_s *find_entry (struct hashmap_s *map,
+                                       const char *key)
+{
+    size_t keylen = strlen (key);
+    uint64_t hash = hashfunc (key, keylen, map->nocase);
+    struct hashslot_s *slot;
+
+    slot = table_lookup (map, &map->table, key, keylen, hash);
+    if (!slot)
+        slot = table_lookup (map, &map->old, key, keylen, hash);
+    return slot ? slot->entry : NULL;
+}
+
+/* Take ptr out of its slot and both lists, and free it. */
+static void unlink_entry (struct hashmap_s *map, struct hashentry_s *ptr)
+{
+    struct hashslot_s *slot;
+
+    if ((slot = table_slot_of (&map->table, ptr)) != NULL)
+        table_clear (&map->table, slot);
+    else if ((slot = table_slot_of (&map->old, ptr)) != NULL)
+        table_clear (&map->old, slot);
+
+    lru_unlink (map, ptr);
+    order_unlink (map, ptr);
+    Free (ptr);
+
+    --map->end_iterator;
+}
+
+/*
+ * The iter-th entry in insertion order.  Walks from the last one asked
+ * for when it can, so a loop over iter++ costs one step per entry.
+ */
+static struct hashentry_s *nth_entry (struct hashmap_s *map,
+                                      hashmap_iter iter)
+{
+    struct hashentry_s *ptr = map->order_head;
+    hashmap_iter i = 0;
+
+    if (map->last_entry && map->last_iter <= iter) {
+        ptr = map->last_entry;
+        i = map->last_iter;
+    }
+    for (; ptr && i != iter; i++)
+        ptr = ptr->order_next;
+    if (ptr) {
+        map->last_iter = iter;
+        map->last_entry = ptr;
+    }
+    return ptr;
+}
+
+static hashmap_t create_map (unsigned int nbuckets, unsigned int nocase)
 {
     struct hashmap_s *ptr;
+    size_t nslots = HASHMAP_MINSLOTS;
 
     if (nbuckets == 0)
         return NULL;
@@ -52,67 +362,66 @@ hashmap_t hashmap_create (unsigned int nbuckets)
     if (!ptr)
         return NULL;
 
-    ptr->size = nbuckets;
-    ptr->buckets = (struct hashbucket_s *) Calloc (nbuckets,
-                                                   sizeof (struct
-                                                           hashbucket_s));
-    if (!ptr->buckets) {
+    while (nslots < nbuckets)
+        nslots *= 2;
+    if (table_init (&ptr->table, nslots) < 0) {
         Free (ptr);
         return NULL;
     }
+    ptr->nocase = nocase;
     ptr->end_iterator = 0;
+    ptr->lru_head = ptr->lru_tail = NULL;
+    ptr->order_head = ptr->order_tail = NULL;
+    ptr->last_entry = NULL;
 
     return ptr;
 }
 
-static int delete_hashbucket (struct hashbucket_s *bucket)
+/*
+ * nbuckets is the number of slots to start with; the table grows as
+ * needed.  Keys compare byte for byte, or ignoring ASCII case in a map
+ * made with hashmap_create_nocase(), as for header or host names.
+ */
+hashmap_t hashmap_create (unsigned int nbuckets)
 {
-    struct hashentry_s *nextptr;
-    struct hashentry_s *ptr;
-
-    if (bucket == NULL || bucket->head == NULL)
-        return -EINVAL;
-
-    ptr = bucket->head;
-    while (ptr) {
-        nextptr = ptr->next;
-
-        Free (ptr->key);
-        Free (ptr->data);
-        Free (ptr);
-
-        ptr = nextptr;
-    }
+    return create_map (nbuckets, 0);
+}
 
-    return 0;
+hashmap_t hashmap_create_nocase (unsigned int nbuckets)
+{
+    return create_map (nbuckets, 1);
 }
 
 int hashmap_delete (hashmap_t map)
 {
-    unsigned int i;
+    struct hashentry_s *ptr, *next;
 
     if (map == NULL)
         return -EINVAL;
 
-    for (i = 0; i != map->size; i++) {
-        if (map->buckets[i].head != NULL) {
-            delete_hashbucket (&map->buckets[i]);
-        }
+    for (ptr = map->order_head; ptr; ptr = next) {
+        next = ptr->order_next;
+        Free (ptr);
     }
 
-    Free (map->buckets);
+    Free (map->table.slots);
+    if (map->old.slots)
+        Free (map->old.slots);
     Free (map);
 
     return 0;
 }
 
+/*
+ * Add a copy of key and data.  An existing entry for key is not
+ * replaced: callers remove it first.
+ */
 int
 hashmap_insert (hashmap_t map, const char *key, const void *data, size_t len)
 {
     struct hashentry_s *ptr;
-    int hash;
-    char *key_copy;
-    void *data_copy;
+    size_t keylen, offset;
+    int ret;
 
     assert (map != NULL);
     assert (key != NULL);
@@ -124,42 +433,27 @@ hashmap_insert (hashmap_t map, const char *key, const void *data, size_t len)
     if (!data || len < 1)
         return -ERANGE;
 
-    hash = hashfunc (key, map->size);
-    if (hash < 0)
-        return hash;
+    migrate (map, HASHMAP_MIGRATE);
+    if ((ret = make_room (map)) < 0)
+        return ret;
 
-    key_copy = strdup (key);
-    if (!key_copy)
-        return -ENOMEM;
-
-    data_copy = Malloc (len);
-    if (!data_copy) {
-        Free (key_copy);
-        return -ENOMEM;
-    }
-    memcpy (data_copy, data, len);
-
-    ptr = (struct hashentry_s *) Malloc (sizeof (struct hashentry_s));
-    if (!ptr) {
-        Free (key_copy);
-        Free (data_copy);
+    keylen = strlen (key);
+    offset = (sizeof (struct hashentry_s) + keylen + 1 + HASHMAP_ALIGN - 1)
+             & ~(size_t) (HASHMAP_ALIGN - 1);
+    ptr = (struct hashentry_s *) Malloc (offset + len);
+    if (!ptr)
         return -ENOMEM;
-    }
 
-    ptr->key = key_copy;
-    ptr->data = data_copy;
+    ptr->hash = hashfunc (key, keylen, map->nocase);
+    ptr->keylen = keylen;
     ptr->len = len;
-    ptr->timestamp = (long)time(NULL);
-    ptr->count = 1;
-    ptr->next = NULL;
-    ptr->prev = map->buckets[hash].tail;
-    if (map->buckets[hash].tail)
-        map->buckets[hash].tail->next = ptr;
-
-    map->buckets[hash].tail = ptr;
-    if (!map->buckets[hash].head)
-        map->buckets[hash].head = ptr;
+    memcpy (ptr->key, key, keylen + 1);
+    ptr->data = (char *) ptr + offset;
+    memcpy (ptr->data, data, len);
 
+    table_place (&map->table, ptr);
+    lru_push_front (map, ptr);
+    order_append (map, ptr);
     map->end_iterator++;
     return 0;
 }
@@ -193,39 +487,29 @@ int hashmap_is_end (hashmap_t map, hashmap_iter iter)
 
 hashmap_iter hashmap_find (hashmap_t map, const char *key)
 {
-    unsigned int i;
-    hashmap_iter iter = 0;
-    struct hashentry_s *ptr;
+    struct hashentry_s *ptr, *found;
+    hashmap_iter iter;
 
     assert (map != NULL);
     assert (key != NULL);
 
     if (!map || !key)
         return -EINVAL;
-    for (i = 0; i != map->size; i++) {
-        ptr = map->buckets[i].head;
-
-        while (ptr) {
-            if (strcasecmp (ptr->key, key) == 0) {
-                ptr -> timestamp = (long)time(NULL);
-                ptr -> count = ptr -> count + 1;
-                return iter;
-            }
-
-            iter++;
-            ptr = ptr->next;
-        }
-    }
 
+    if ((found = find_entry (map, key)) == NULL)
+        return map->end_iterator;
+    touch_entry (map, found);
+    for (iter = 0, ptr = map->order_head; ptr != found; iter++)
+        ptr = ptr->order_next;
+    map->last_iter = iter;
+    map->last_entry = found;
     return iter;
 }
 
 ssize_t
 hashmap_return_entry (hashmap_t map, hashmap_iter iter, char **key, void **data)
 {
-    unsigned int i;
     struct hashentry_s *ptr;
-    hashmap_iter count = 0;
 
     assert (map != NULL);
     assert (iter >= 0);
@@ -236,175 +520,151 @@ hashmap_return_entry (hashmap_t map, hashmap_iter iter, char **key, void **data)
     if (!map || iter < 0 || !key || !data)
         return -EINVAL;
 
-    for (i = 0; i != map->size; i++) {
-        ptr = map->buckets[i].head;
-        while (ptr) {
-            if (count == iter) {
-                *key = ptr->key;
-                *data = ptr->data;
-                ptr -> timestamp = (long)time(NULL);
-                ptr -> count = ptr -> count + 1;
-                return ptr->len;
-            }
-
-            ptr = ptr->next;
-            count++;
-        }
-    }
-
-    return -EFAULT;
+    if ((ptr = nth_entry (map, iter)) == NULL)
+        return -EFAULT;
+    *key = ptr->key;
+    *data = ptr->data;
+    touch_entry (map, ptr);
+    return ptr->len;
 }
 
 ssize_t hashmap_search (hashmap_t map, const char *key)
 {
-    int hash;
     struct hashentry_s *ptr;
-    ssize_t count = 0;
 
     if (map == NULL || key == NULL)
         return -EINVAL;
 
-    hash = hashfunc (key, map->size);
-    if (hash < 0)
-        return hash;
-
-    ptr = map->buckets[hash].head;
-
-    while (ptr) {
-        if (strcasecmp (ptr->key, key) == 0){
-            ptr -> timestamp = (long)time(NULL);
-            ptr -> count = ptr -> count + 1;
-            ++count;
-        }
-        ptr = ptr->next;
-    }
-
-    return count;
+    if ((ptr = find_entry (map, key)) == NULL)
+        return 0;
+    touch_entry (map, ptr);
+    return 1;
 }
 
 ssize_t hashmap_entry_by_key (hashmap_t map, const char *key, void **data)
 {
-    int hash;
     struct hashentry_s *ptr;
 
     if (!map || !key || !data)
         return -EINVAL;
 
-    hash = hashfunc (key, map->size);
-    if (hash < 0)
-        return hash;
+    if ((ptr = find_entry (map, key)) == NULL)
+        return 0;
+    touch_entry (map, ptr);
+    *data = ptr->data;
+    return ptr->len;
+}
 
-    ptr = map->buckets[hash].head;
+ssize_t hashmap_remove (hashmap_t map, const char *key)
+{
+    struct hashentry_s *ptr;
+    short int deleted = 0;
 
-    while (ptr) {
-        if (strcasecmp (ptr->key, key) == 0) {
-            ptr -> timestamp = (long)time(NULL);
-            ptr -> count = ptr -> count + 1;
-            *data = ptr->data;
-            return ptr->len;
-        }
+    if (map == NULL || key == NULL)
+        return -EINVAL;
 
-        ptr = ptr->next;
+    migrate (map, HASHMAP_MIGRATE);
+    while ((ptr = find_entry (map, key)) != NULL) {
+        unlink_entry (map, ptr);
+        ++deleted;
     }
 
-    return 0;
+    return deleted;
 }
 
-ssize_t hashmap_remove (hashmap_t map, const char *key)
+/*
+ * Peek at the least recently used entry without freeing it or
+ * refreshing it.  Returns its length, or 0 if the map is empty.
+ */
+ssize_t hashmap_lru_entry (hashmap_t map, char **key, void **data)
 {
-    int hash;
-    struct hashentry_s *ptr, *next;
-    short int deleted = 0;
+    assert (map != NULL);
+    assert (key != NULL);
+    assert (data != NULL);
 
-    if (map == NULL || key == NULL)
+    if (!map || !key || !data)
         return -EINVAL;
 
-    hash = hashfunc (key, map->size);
-    if (hash < 0)
-        return hash;
+    if (!map->lru_tail)
+        return 0;
 
-    ptr = map->buckets[hash].head;
-    while (ptr) {
-        if (strcasecmp (ptr->key, key) == 0) {
-            next = ptr->next;
+    *key = map->lru_tail->key;
+    *data = map->lru_tail->data;
+    return map->lru_tail->len;
+}
 
-            if (ptr->prev)
-                ptr->prev->next = ptr->next;
-            if (ptr->next)
-                ptr->next->prev = ptr->prev;
+/*
+ * Evict the least recently used entry: the tail of the recency list.
+ * Returns the number of data bytes freed, or 0 if the map is empty.
+ */
+ssize_t hashmap_remove_lru(struct hashmap_s *map)
+{
+    ssize_t ret;
+    struct hashentry_s *ptr;
 
-            if (map->buckets[hash].head == ptr)
-                map->buckets[hash].head = ptr->next;
-            if (map->buckets[hash].tail == ptr)
-                map->buckets[hash].tail = ptr->prev;
+    if (!map)
+        return -EINVAL;
 
-            Free (ptr->key);
-            Free (ptr->data);
-            Free (ptr);
+    ptr = map->lru_tail;
+    if (!ptr)
+        return 0;
 
-            ++deleted;
-            --map->end_iterator;
+    migrate (map, HASHMAP_MIGRATE);
+    ret = ptr->len;
+    unlink_entry (map, ptr);
+    return ret;
+}
 
-            ptr = next;
-            continue;
-        }
+/*
+ * Cursors walk the entries in insertion order, one step at a time.
+ * Looking at an entry through a cursor does not count as a use of it.
+ */
+hashmap_cursor_t hashmap_cursor_first (hashmap_t map)
+{
+    assert (map != NULL);
 
-        ptr = ptr->next;
-    }
+    return map ? map->order_head : NULL;
+}
 
-    return deleted;
+hashmap_cursor_t hashmap_cursor_next (hashmap_cursor_t cursor)
+{
+    return cursor ? cursor->order_next : NULL;
 }
 
-ssize_t hashmap_remove_lru(struct hashmap_s *map)
+/* A cursor at key, to walk on from there, or NULL. */
+hashmap_cursor_t hashmap_cursor_find (hashmap_t map, const char *key)
 {
-    ssize_t ret;
-    unsigned int i;
-    struct hashentry_s *ptr, *min_ptr, *next;
-    long min_time = -1;
-    long min_count = -1;
-    unsigned int min_hash;
+    if (!map || !key)
+        return NULL;
+    return find_entry (map, key);
+}
 
-    if (!map)
+ssize_t hashmap_cursor_entry (hashmap_cursor_t cursor, char **key,
+                              void **data)
+{
+    assert (cursor != NULL);
+    assert (key != NULL);
+    assert (data != NULL);
+
+    if (!cursor || !key || !data)
         return -EINVAL;
-    
-    for (i = 0; i != map->size; i++) {
-        ptr = map->buckets[i].head;
-
-        while (ptr) {
-            if(min_time < 0 || ptr -> timestamp < min_time){
-                min_time = ptr -> timestamp;
-                min_count = ptr -> count;
-                min_hash = i;
-                min_ptr = ptr;
-            } else if (ptr -> timestamp == min_time){
-                if(ptr -> count < min_count){
-                    min_count = ptr -> count;
-                    min_hash = i;
-                    min_ptr = ptr;
-                }
-            }
-            ptr = ptr->next;
-        }
-    }
 
-    if(min_time < 0) return 0;
+    *key = cursor->key;
+    *data = cursor->data;
+    return cursor->len;
+}
 
-    ret = min_ptr -> len;
-    next = min_ptr -> next;
-    if (min_ptr->prev)
-        min_ptr->prev->next = min_ptr->next;
-    if (min_ptr->next)
-        min_ptr->next->prev = min_ptr->prev;
+/* Remove the cursor's entry; returns a cursor at the one after it. */
+hashmap_cursor_t hashmap_cursor_remove (hashmap_t map,
+                                        hashmap_cursor_t cursor)
+{
+    struct hashentry_s *next;
 
-    if (map->buckets[min_hash].head == min_ptr)
-        map->buckets[min_hash].head = min_ptr->next;
-    if (map->buckets[min_hash].tail == min_ptr)
-        map->buckets[min_hash].tail = min_ptr->prev;
+    if (!map || !cursor)
+        return NULL;
 
-    Free (min_ptr->key);
-    Free (min_ptr->data);
-    Free (min_ptr);
-    
-    --map->end_iterator;
-    return ret;
+    migrate (map, HASHMAP_MIGRATE);
+    next = cursor->order_next;
+    unlink_entry (map, cursor);
+    return next;
 }
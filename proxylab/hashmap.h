@@ -3,10 +3,21 @@
 
 #include "csapp.h"
 
+#define HASHMAP_MINSLOTS 8
+#define HASHMAP_MIGRATE 16      /* old slots drained per insert or removal */
+
 typedef struct hashmap_s *hashmap_t;
 typedef int hashmap_iter;
 
+/*
+ * A position in a map's insertion order.  It stays valid while other
+ * entries are inserted or removed; its own entry may only go through
+ * hashmap_cursor_remove().  NULL is the end.
+ */
+typedef struct hashentry_s *hashmap_cursor_t;
+
 extern hashmap_t hashmap_create (unsigned int nbuckets);
+extern hashmap_t hashmap_create_nocase (unsigned int nbuckets);
 extern int hashmap_delete (hashmap_t map);
 extern int hashmap_insert (hashmap_t map, const char *key,
                            const void *data, size_t len);
@@ -19,5 +30,14 @@ extern ssize_t hashmap_entry_by_key (hashmap_t map, const char *key,
                                      void **data);
 extern ssize_t hashmap_search (hashmap_t map, const char *key);
 extern ssize_t hashmap_remove (hashmap_t map, const char *key);
+extern ssize_t hashmap_lru_entry (hashmap_t map, char **key, void **data);
 extern ssize_t hashmap_remove_lru(struct hashmap_s *map);
+
+extern hashmap_cursor_t hashmap_cursor_first (hashmap_t map);
+extern hashmap_cursor_t hashmap_cursor_next (hashmap_cursor_t cursor);
+extern hashmap_cursor_t hashmap_cursor_find (hashmap_t map, const char *key);
+extern ssize_t hashmap_cursor_entry (hashmap_cursor_t cursor, char **key,
+                                     void **data);
+extern hashmap_cursor_t hashmap_cursor_remove (hashmap_t map,
+                                               hashmap_cursor_t cursor);
 #endif
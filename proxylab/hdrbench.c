@@ -0,0 +1,179 @@
+/*
+ * hdrbench - headers parsed per second by the in-place parser in
+ * http.c, against the hashmap path it replaced.
+ *
+ * usage: ./hdrbench [iterations]
+ *
+ * Both paths start from the same header block in memory, look up
+ * Content-Length, drop the headers the proxy rewrites and format the
+ * rest back out, as process_client_headers() does.  The old path is
+ * reproduced here: one Realloc'd accumulator per line, a fresh hashmap
+ * per request and a Malloc'd snprintf() per header on the way out.
+ * Socket reads are left out of both.
+ */
+#include "csapp.h"
+#include "hashmap.h"
+#include "http.h"
+#include "text.h"
+
+#define OLD_BUCKETS 32
+
+static const char request[] =
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; lang=en\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "If-Modified-Since: Tue, 14 Oct 2025 08:00:00 GMT\r\n"
+    "If-None-Match: \"5f2b-63e1b2c4\"\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "\r\n";
+
+static const char *skipheaders[] = {"Host", "Connection", "Proxy-Connection",
+                                    "Accept", "Accept-Encoding",
+                                    "User-Agent"};
+#define NSKIP (sizeof (skipheaders) / sizeof (skipheaders[0]))
+
+static double now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* add_header_to_connection() as it was. */
+static int old_add_header (hashmap_t map, char *header, size_t len)
+{
+    char *sep;
+
+    len -= chomp (header, len);
+    sep = strchr (header, ':');
+    if (!sep)
+        return -1;
+    while (*sep == ':' || *sep == ' ' || *sep == '\t')
+        *sep++ = '\0';
+    len -= sep - header - 1;
+    return hashmap_insert (map, header, sep, len);
+}
+
+/* get_all_headers(), process_client_headers() and friends, from memory. */
+static long old_path (char *block, size_t length)
+{
+    char *line = block, *end = block + length, *nl, *header = NULL;
+    char *key, *data, *out;
+    ssize_t linelen, len = 0;
+    long content_length = -1, sent = 0;
+    hashmap_t map = hashmap_create_nocase (OLD_BUCKETS);
+    hashmap_iter iter;
+    size_t size;
+    unsigned int i;
+
+    while (line < end) {
+        nl = (char *) memchr (line, '\n', end - line);
+        linelen = nl - line + 1;
+        if ((linelen <= 2) || !(line[0] == ' ' || line[0] == '\t')) {
+            if (len > 0)
+                old_add_header (map, header, len);
+            len = 0;
+        }
+        if (linelen <= 2)
+            break;
+        header = (char *) Realloc (len ? header : NULL, len + linelen);
+        memcpy (header + len, line, linelen);
+        len += linelen;
+        line = nl + 1;
+    }
+    Free (header);
+
+    if (hashmap_entry_by_key (map, "Content-Length", (void **) &data) > 0)
+        content_length = atol (data);
+    for (i = 0; i != NSKIP; i++)
+        hashmap_remove (map, skipheaders[i]);
+    iter = hashmap_first (map);
+    if (iter >= 0) {
+        for (; !hashmap_is_end (map, iter); ++iter) {
+            hashmap_return_entry (map, iter, &key, (void **) &data);
+            size = strlen (key) + strlen (data) + 5;
+            out = (char *) Malloc (size);
+            snprintf (out, size, "%s: %s\r\n", key, data);
+            sent += size;
+            Free (out);
+        }
+    }
+    hashmap_delete (map);
+    return sent + content_length;
+}
+
+static long new_path (char *block, size_t length)
+{
+    struct http_headers_s headers;
+    char out[4096], *p = out, *data;
+    long content_length = -1;
+    unsigned int i;
+
+    if (http_parse_headers (block, length, &headers) < 0)
+        return -1;
+    if ((data = http_header_get (&headers, "Content-Length")) != NULL)
+        content_length = atol (data);
+    for (i = 0; i != NSKIP; i++)
+        http_header_remove (&headers, skipheaders[i]);
+    for (i = 0; i != headers.count; i++) {
+        memcpy (p, headers.fields[i].name, headers.fields[i].namelen);
+        p += headers.fields[i].namelen;
+        *p++ = ':';
+        *p++ = ' ';
+        memcpy (p, headers.fields[i].value, headers.fields[i].valuelen);
+        p += headers.fields[i].valuelen;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    return (p - out) + content_length;
+}
+
+static double run (long (*path) (char *, size_t), unsigned long iterations,
+                   long *check)
+{
+    char block[sizeof (request)];
+    unsigned long i;
+    double start = now_ns ();
+
+    for (i = 0; i != iterations; i++) {
+        memcpy (block, request, sizeof (request));
+        *check += path (block, sizeof (request) - 1);
+    }
+    return now_ns () - start;
+}
+
+int main (int argc, char *argv[])
+{
+    unsigned long iterations = (argc > 1) ? strtoul (argv[1], NULL, 10)
+                                          : 200000;
+    unsigned int nheaders = 0;
+    const char *p;
+    long check = 0;
+    double old_ns, new_ns;
+
+    if (iterations < 1) {
+        fprintf (stderr, "usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+    for (p = request; (p = strstr (p, "\r\n")) != NULL; p += 2)
+        nheaders++;
+    nheaders--;                 /* the blank line */
+
+    old_ns = run (old_path, iterations, &check);
+    new_ns = run (new_path, iterations, &check);
+
+    printf ("%d headers per request, %lu requests\n", nheaders, iterations);
+    printf ("%10s %14s %16s\n", "path", "ns/request", "headers/sec");
+    printf ("%10s %14.1f %16.0f\n", "hashmap", old_ns / iterations,
+            nheaders * iterations / (old_ns / 1e9));
+    printf ("%10s %14.1f %16.0f\n", "in-place", new_ns / iterations,
+            nheaders * iterations / (new_ns / 1e9));
+    return check == 0;          /* keeps the work from being optimized out */
+}
@@ -0,0 +1,238 @@
+#define _GNU_SOURCE             /* strptime, timegm */
+#include "http.h"
+
+#define IS_LWS(c) ((c) == ' ' || (c) == '\t')
+
+int http_parse_request_line (char *line, char **method, char **url,
+                             char **protocol)
+{
+    char **tokens[3] = {method, url, protocol};
+    int n = 0;
+
+    *method = *url = *protocol = NULL;
+    while (*line && n != 3) {
+        while (*line == ' ')
+            line++;
+        if (!*line)
+            break;
+        *tokens[n++] = line;
+        while (*line && *line != ' ')
+            line++;
+        if (*line)
+            *line++ = '\0';
+    }
+    /* Anything after the protocol is a malformed request line. */
+    while (*line == ' ')
+        line++;
+    if (n < 2 || *line)
+        return -EINVAL;
+    return n;
+}
+
+/* Close off the header being built: trim the value and terminate it. */
+static void finish_header (struct http_header_s *header, char *end)
+{
+    while (end > header->value && IS_LWS (end[-1]))
+        end--;
+    *end = '\0';
+    header->valuelen = end - header->value;
+}
+
+int http_parse_headers (char *block, size_t length,
+                        struct http_headers_s *headers)
+{
+    char *line = block;
+    char *end = block + length;
+    char *nl, *colon, *name_end, *content_end = NULL;
+    struct http_header_s *current = NULL;
+    unsigned int double_cgi = 0;
+
+    assert (block != NULL);
+    assert (headers != NULL);
+
+    headers->count = 0;
+    while (line < end) {
+        nl = (char *) memchr (line, '\n', end - line);
+        if (!nl)
+            return -EINVAL;
+        /* Where the line's text stops, before any CR LF. */
+        content_end = (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+
+        if (content_end == line) {
+            if (current)
+                finish_header (current, current->value + current->valuelen);
+            return 0;
+        }
+
+        if (IS_LWS (*line)) {
+            /* Fold a continuation line into the value before it. */
+            if (current) {
+                char *p = current->value + current->valuelen;
+                while (p < content_end && (p < line || IS_LWS (*p)))
+                    *p++ = ' ';
+                current->valuelen = content_end - current->value;
+            }
+            line = nl + 1;
+            continue;
+        }
+
+        if (current) {
+            finish_header (current, current->value + current->valuelen);
+            current = NULL;
+        }
+
+        /* A second status line: what follows is a CGI's own headers. */
+        if (content_end - line >= 5 && !strncasecmp (line, "HTTP/", 5))
+            double_cgi = 1;
+        if (double_cgi) {
+            line = nl + 1;
+            continue;
+        }
+
+        colon = (char *) memchr (line, ':', content_end - line);
+        if (!colon || colon == line)
+            return -EINVAL;
+        if (headers->count == HTTP_MAXHEADERS)
+            return -E2BIG;
+
+        name_end = colon;
+        while (name_end > line && IS_LWS (name_end[-1]))
+            name_end--;
+        *name_end = '\0';
+
+        current = &headers->fields[headers->count++];
+        current->name = line;
+        current->namelen = name_end - line;
+        current->value = colon + 1;
+        while (current->value < content_end && IS_LWS (*current->value))
+            current->value++;
+        current->valuelen = content_end - current->value;
+
+        line = nl + 1;
+    }
+
+    return -EINVAL;
+}
+
+static struct http_header_s *find_header (struct http_headers_s *headers,
+                                          const char *name, size_t namelen,
+                                          unsigned int from)
+{
+    unsigned int i;
+
+    for (i = from; i < headers->count; i++) {
+        if (headers->fields[i].namelen == namelen
+            && !strcasecmp (headers->fields[i].name, name))
+            return &headers->fields[i];
+    }
+    return NULL;
+}
+
+char *http_header_get (struct http_headers_s *headers, const char *name)
+{
+    struct http_header_s *header =
+        find_header (headers, name, strlen (name), 0);
+
+    return header ? header->value : NULL;
+}
+
+/* Remove every header called name; returns how many there were. */
+int http_header_remove (struct http_headers_s *headers, const char *name)
+{
+    size_t namelen = strlen (name);
+    unsigned int i, kept = 0;
+
+    for (i = 0; i != headers->count; i++) {
+        if (headers->fields[i].namelen == namelen
+            && !strcasecmp (headers->fields[i].name, name))
+            continue;
+        headers->fields[kept++] = headers->fields[i];
+    }
+    i = headers->count - kept;
+    headers->count = kept;
+    return i;
+}
+
+/* Whether any comma-separated header called name lists token. */
+int http_header_has_token (struct http_headers_s *headers, const char *name,
+                           const char *token)
+{
+    struct http_header_s *header;
+    size_t namelen = strlen (name), toklen = strlen (token), len;
+    unsigned int from = 0;
+    const char *data;
+
+    while ((header = find_header (headers, name, namelen, from)) != NULL) {
+        for (data = header->value; *data; data += len) {
+            data += strspn (data, " \t,");
+            len = strcspn (data, " \t,");
+            if (len == toklen && !strncasecmp (data, token, len))
+                return 1;
+        }
+        from = header - headers->fields + 1;
+    }
+    return 0;
+}
+
+/*
+ * Whether a Cache-Control style header lists directive.  If it does and
+ * value is not NULL, *value is set to the directive's number (quoted
+ * or not), or to -1 if it has none.
+ */
+int http_header_directive (struct http_headers_s *headers, const char *name,
+                           const char *directive, long *value)
+{
+    struct http_header_s *header;
+    size_t namelen = strlen (name), dirlen = strlen (directive), len;
+    unsigned int from = 0;
+    const char *data, *arg;
+    char *end;
+
+    while ((header = find_header (headers, name, namelen, from)) != NULL) {
+        for (data = header->value; *data; data += len) {
+            data += strspn (data, " \t,");
+            len = strcspn (data, ",");
+            if (strncasecmp (data, directive, dirlen) != 0
+                || (data[dirlen] != '=' && data[dirlen] != ','
+                    && data[dirlen] != ' ' && data[dirlen] != '\t'
+                    && data[dirlen] != '\0'))
+                continue;
+            if (value) {
+                *value = -1;
+                arg = data + dirlen + strspn (data + dirlen, " \t");
+                if (*arg == '=') {
+                    arg += 1 + strspn (arg + 1, " \t\"");
+                    *value = strtol (arg, &end, 10);
+                    if (end == arg || *value < 0)
+                        *value = -1;
+                }
+            }
+            return 1;
+        }
+        from = header - headers->fields + 1;
+    }
+    return 0;
+}
+
+/*
+ * Parse an HTTP date in any of the three formats HTTP/1.1 allows:
+ * IMF-fixdate, RFC 850 and asctime().  Returns -1 if it is none of
+ * them.
+ */
+time_t http_parse_date (const char *value)
+{
+    static const char *formats[] = {"%a, %d %b %Y %H:%M:%S GMT",
+                                    "%A, %d-%b-%y %H:%M:%S GMT",
+                                    "%a %b %e %H:%M:%S %Y"};
+    struct tm tm;
+    const char *end;
+    unsigned int i;
+
+    for (i = 0; i != sizeof (formats) / sizeof (formats[0]); i++) {
+        memset (&tm, 0, sizeof (tm));
+        end = strptime (value, formats[i], &tm);
+        if (end && end[strspn (end, " \t")] == '\0')
+            return timegm (&tm);
+    }
+    return -1;
+}
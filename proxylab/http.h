@@ -0,0 +1,54 @@
+#ifndef _PROXYLAB_HTTP_H_
+#define _PROXYLAB_HTTP_H_
+
+#include "csapp.h"
+
+#define HTTP_MAXHEADERS 100
+
+/*
+ * One header, pointing into the block it was parsed from.  name and
+ * value are NUL-terminated in place, and the lengths are kept so they
+ * never need a strlen().
+ */
+struct http_header_s {
+    char *name;
+    char *value;
+    size_t namelen;
+    size_t valuelen;
+};
+
+struct http_headers_s {
+    unsigned int count;
+    struct http_header_s fields[HTTP_MAXHEADERS];
+};
+
+/*
+ * In-place tokenizers: nothing is copied and nothing is allocated.
+ * The line or block is modified (separators become NULs, continuation
+ * lines are folded into their header with spaces), and the results
+ * stay valid for as long as it does.
+ *
+ * http_parse_request_line() returns how many of method, url and
+ * protocol it found (2 for an HTTP/0.9 request, else 3), or -EINVAL.
+ * http_parse_headers() takes everything after the start line up to
+ * and including the blank line, and returns 0, -EINVAL if a line is
+ * malformed, or -E2BIG past HTTP_MAXHEADERS headers.
+ */
+extern int http_parse_request_line (char *line, char **method, char **url,
+                                    char **protocol);
+extern int http_parse_headers (char *block, size_t length,
+                               struct http_headers_s *headers);
+
+/* Lookups are case-insensitive; the first header of that name wins. */
+extern char *http_header_get (struct http_headers_s *headers,
+                              const char *name);
+extern int http_header_remove (struct http_headers_s *headers,
+                               const char *name);
+extern int http_header_has_token (struct http_headers_s *headers,
+                                  const char *name, const char *token);
+extern int http_header_directive (struct http_headers_s *headers,
+                                  const char *name, const char *directive,
+                                  long *value);
+extern time_t http_parse_date (const char *value);
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * lrubench - measure hashmap insert and LRU eviction cost as the
+ * number of cached objects grows.
+ *
+ * usage: ./lrubench [objsize]
+ *
+ * For each population size the map is filled, then churned (evict the
+ * least recently used object, insert a new one) the way cache_update()
+ * does when the cache is full, and finally drained by eviction.
+ */
+#include "csapp.h"
+#include "hashmap.h"
+#include "cache.h"
+
+#define CHURN_ROUNDS 100000
+#define KEY_LENGTH 64
+
+static const unsigned int populations[] = {10000, 25000, 50000, 100000};
+
+static double now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void make_key (char *key, unsigned int i)
+{
+    snprintf (key, KEY_LENGTH, "GET /object/%u HTTP/1.0\r\nHost: bench\r\n",
+              i);
+}
+
+int main (int argc, char *argv[])
+{
+    size_t objsize = (argc > 1) ? (size_t) atol (argv[1]) : 1024;
+    char key[KEY_LENGTH];
+    char *object;
+    unsigned int i, p, next;
+    hashmap_t map;
+    double start, insert_ns, churn_ns, evict_ns;
+
+    if (objsize < 1) {
+        fprintf (stderr, "usage: %s [objsize]\n", argv[0]);
+        return 1;
+    }
+    object = (char *) Malloc (objsize);
+    memset (object, 'x', objsize);
+
+    printf ("%10s %14s %14s %14s\n", "objects", "insert ns/op",
+            "churn ns/op", "evict ns/op");
+    for (p = 0; p != sizeof (populations) / sizeof (populations[0]); p++) {
+        map = hashmap_create (CACHE_BUCKET);
+
+        start = now_ns ();
+        for (i = 0; i != populations[p]; i++) {
+            make_key (key, i);
+            hashmap_insert (map, key, object, objsize);
+        }
+        insert_ns = (now_ns () - start) / populations[p];
+
+        next = populations[p];
+        start = now_ns ();
+        for (i = 0; i != CHURN_ROUNDS; i++) {
+            hashmap_remove_lru (map);
+            make_key (key, next++);
+            hashmap_insert (map, key, object, objsize);
+        }
+        churn_ns = (now_ns () - start) / CHURN_ROUNDS;
+
+        start = now_ns ();
+        while (hashmap_remove_lru (map) > 0)
+            ;
+        evict_ns = (now_ns () - start) / populations[p];
+
+        printf ("%10u %14.1f %14.1f %14.1f\n", populations[p], insert_ns,
+                churn_ns, evict_ns);
+        hashmap_delete (map);
+    }
+
+    Free (object);
+    return 0;
+}
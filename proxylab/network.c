@@ -1,8 +1,24 @@
+#define _GNU_SOURCE             /* splice */
 #include "network.h"
+#include "dns.h"
+#include <poll.h>
 #include "MITLogModule.h"
 
-#define SEGMENT_LEN (512)
-#define MAXIMUM_BUFFER_LENGTH (128 * 1024)
+int socket_nonblocking (int sock)
+{
+    int flags;
+    assert (sock >= 0);
+    flags = fcntl (sock, F_GETFL, 0);
+    return fcntl (sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+int socket_blocking (int sock)
+{
+    int flags;
+    assert (sock >= 0);
+    flags = fcntl (sock, F_GETFL, 0);
+    return fcntl (sock, F_SETFL, flags & ~O_NONBLOCK);
+}
 
 ssize_t safe_write (int fd, const char *buffer, size_t count)
 {
@@ -34,6 +50,119 @@ ssize_t safe_write (int fd, const char *buffer, size_t count)
     return count;
 }
 
+/*
+ * Like safe_write, for data in several pieces.  iov is advanced past
+ * whatever has been sent, so the caller's array is not preserved.
+ */
+ssize_t safe_writev (int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t len;
+    size_t count = 0;
+
+    assert (fd >= 0);
+
+    while (iovcnt > 0 && iov->iov_len == 0) {
+        iov++;
+        iovcnt--;
+    }
+    while (iovcnt > 0) {
+        len = writev (fd, iov, iovcnt);
+        if (len < 0) {
+            MITLogWrite(MITLOG_LEVEL_ERROR, "safe_writev failed %d: %s", fd, strerror(errno));
+            if (errno == EINTR)
+                continue;
+            else
+                return -errno;
+        }
+
+        count += len;
+        while (iovcnt > 0 && (size_t) len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+    return count;
+}
+
+/*
+ * Each thread keeps one pipe for splice_relay(), opened on first use.
+ * It is only ever left holding data when a relay fails, and then it is
+ * closed rather than reused.
+ */
+static __thread int relay_pipe[2] = {-1, -1};
+
+static void relay_pipe_close (void)
+{
+    close (relay_pipe[0]);
+    close (relay_pipe[1]);
+    relay_pipe[0] = relay_pipe[1] = -1;
+}
+
+/*
+ * Move count bytes (or everything up to EOF if count is negative) from
+ * the socket from to the socket to through a pipe, so the data never
+ * comes up into user space.  Returns the number of bytes moved, which
+ * is short of count only if from hit EOF, or -errno.  -EINVAL means
+ * splice() cannot be used on these descriptors and nothing was read,
+ * so the caller can fall back to copying.
+ */
+ssize_t splice_relay (int from, int to, long count)
+{
+    ssize_t len, out;
+    size_t total = 0, chunk;
+    int err;
+
+    assert (from >= 0);
+    assert (to >= 0);
+
+    if (relay_pipe[0] < 0 && pipe2 (relay_pipe, O_CLOEXEC) < 0)
+        return -errno;
+
+    while (count != 0) {
+        chunk = NETWORK_SPLICE_SIZE;
+        if (count > 0 && (size_t) count < chunk)
+            chunk = count;
+        do {
+            len = splice (from, NULL, relay_pipe[1], NULL, chunk,
+                          SPLICE_F_MOVE | SPLICE_F_MORE);
+        } while (len < 0 && errno == EINTR);
+        if (len < 0) {
+            err = errno;
+            if (err == EINVAL && total == 0)
+                return -EINVAL;
+            MITLogWrite (MITLOG_LEVEL_ERROR, "splice_relay from %d failed: %s",
+                         from, strerror (err));
+            return err == EINVAL ? -EIO : -err;
+        }
+        if (len == 0)
+            break;
+
+        while (len > 0) {
+            out = splice (relay_pipe[0], NULL, to, NULL, len,
+                          SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0) {
+                err = errno;
+                if (err == EINTR)
+                    continue;
+                MITLogWrite (MITLOG_LEVEL_ERROR, "splice_relay to %d failed: %s",
+                             to, strerror (err));
+                relay_pipe_close ();
+                return err == EINVAL ? -EIO : -err;
+            }
+            len -= out;
+            total += out;
+            if (count > 0)
+                count -= out;
+        }
+    }
+    return total;
+}
+
 ssize_t safe_read (int fd, char *buffer, size_t count)
 {
     ssize_t len;
@@ -83,104 +212,6 @@ int write_message (int fd, const char *fmt, ...)
 }
 
 
-ssize_t readline (int fd, char **whole_buffer)
-{
-    ssize_t whole_buffer_len;
-    char buffer[SEGMENT_LEN];
-    char *ptr;
-
-    ssize_t ret;
-    ssize_t diff;
-
-    struct read_lines_s {
-        char *data;
-        size_t len;
-        struct read_lines_s *next;
-    };
-    struct read_lines_s *first_line, *line_ptr;
-
-    first_line =
-        (struct read_lines_s *) Calloc (sizeof (struct read_lines_s),
-                                        1);
-    if (!first_line)
-        return -ENOMEM;
-
-    line_ptr = first_line;
-
-    whole_buffer_len = 0;
-    for (;;) {
-        ret = recv (fd, buffer, SEGMENT_LEN, MSG_PEEK);
-        if (ret <= 0)
-            goto CLEANUP;
-
-        ptr = (char *) memchr (buffer, '\n', ret);
-        if (ptr)
-            diff = ptr - buffer + 1;
-        else
-            diff = ret;
-
-        whole_buffer_len += diff;
-
-        if (whole_buffer_len > MAXIMUM_BUFFER_LENGTH) {
-            ret = -ERANGE;
-            goto CLEANUP;
-        }
-
-        line_ptr->data = (char *)Malloc (diff);
-        if (!line_ptr->data) {
-                ret = -ENOMEM;
-                goto CLEANUP;
-        }
-
-        recv (fd, line_ptr->data, diff, 0);
-        line_ptr->len = diff;
-
-        if (ptr) {
-                line_ptr->next = NULL;
-                break;
-        }
-
-        line_ptr->next =
-            (struct read_lines_s *)
-            Calloc (sizeof (struct read_lines_s), 1);
-        if (!line_ptr->next) {
-            ret = -ENOMEM;
-            goto CLEANUP;
-        }
-        line_ptr = line_ptr->next;
-    }
-
-    *whole_buffer = (char *) Malloc (whole_buffer_len + 1);
-    if (!*whole_buffer) {
-        ret = -ENOMEM;
-        goto CLEANUP;
-    }
-
-    *(*whole_buffer + whole_buffer_len) = '\0';
-
-    whole_buffer_len = 0;
-    line_ptr = first_line;
-    while (line_ptr) {
-        memcpy (*whole_buffer + whole_buffer_len, line_ptr->data,
-                line_ptr->len);
-        whole_buffer_len += line_ptr->len;
-        line_ptr = line_ptr->next;
-    }
-    ret = whole_buffer_len;
-
-CLEANUP:
-    do {
-            line_ptr = first_line->next;
-            if (first_line->data)
-                    Free (first_line->data);
-            Free (first_line);
-            first_line = line_ptr;
-    } while (first_line);
-
-    return ret;
-}
-
-
 char *get_ip_string (struct sockaddr *sa, char *buf, size_t buflen)
 {
     assert (sa != NULL);
@@ -209,48 +240,210 @@ char *get_ip_string (struct sockaddr *sa, char *buf, size_t buflen)
 
     return buf;
 }
+static unsigned int connect_timeout = NETWORK_CONNECT_TIMEOUT;
+
+void opensock_set_timeout (unsigned int ms)
+{
+    connect_timeout = ms;
+}
+
+long long monotonic_ms (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Order addresses for racing: alternate between address families,
+ * starting with whichever the resolver put first.
+ */
+static void interleave_families (struct dns_addr_s *addrs, int n)
+{
+    struct dns_addr_s sorted[DNS_MAXADDRS];
+    int first = addrs[0].family;
+    int i, j, k = 0, taken[DNS_MAXADDRS] = {0};
+
+    for (i = 0; k != n; i++) {
+        int want = (i % 2 == 0) ? first : -1;
+        for (j = 0; j != n; j++) {
+            if (taken[j])
+                continue;
+            if (want == first ? addrs[j].family == first
+                              : addrs[j].family != first)
+                break;
+        }
+        if (j == n)             /* this family ran out; take anything */
+            for (j = 0; taken[j]; j++)
+                ;
+        taken[j] = 1;
+        sorted[k++] = addrs[j];
+    }
+    memcpy (addrs, sorted, n * sizeof (struct dns_addr_s));
+}
+
+/* Start a non-blocking connect; the fd, or -1 if it failed outright. */
+static int start_connect (struct dns_addr_s *addr, int *connected)
+{
+    int sockfd = socket (addr->family, addr->socktype, addr->protocol);
+
+    if (sockfd < 0)
+        return -1;
+    if (socket_nonblocking (sockfd) == 0) {
+        if (connect (sockfd, (struct sockaddr *) &addr->addr,
+                     addr->addrlen) == 0) {
+            *connected = 1;
+            return sockfd;
+        }
+        if (errno == EINPROGRESS)
+            return sockfd;
+    }
+    close (sockfd);
+    return -1;
+}
+
+void connect_race_start (struct connect_race_s *race,
+                         const struct dns_addr_s *addrs, int n)
+{
+    int i;
+
+    assert (n > 0 && n <= DNS_MAXADDRS);
+
+    memcpy (race->addrs, addrs, n * sizeof (struct dns_addr_s));
+    interleave_families (race->addrs, n);
+    for (i = 0; i != DNS_MAXADDRS; i++)
+        race->fds[i] = -1;
+    race->naddrs = n;
+    race->started = race->live = 0;
+    race->next_start = monotonic_ms ();
+    race->deadline = race->next_start + connect_timeout;
+}
+
+int connect_race_advance (struct connect_race_s *race, long long now)
+{
+    int connected = 0, fd;
+
+    while (race->started != race->naddrs && now >= race->next_start) {
+        fd = start_connect (&race->addrs[race->started], &connected);
+        race->fds[race->started++] = fd;
+        if (connected)
+            return fd;
+        /* One that failed outright lets the next go at once. */
+        if (fd < 0)
+            continue;
+        race->live++;
+        race->next_start = now + NETWORK_CONNECT_STAGGER;
+    }
+    return -1;
+}
+
+int connect_race_check (struct connect_race_s *race, int i)
+{
+    int err;
+    socklen_t errlen = sizeof (err);
+
+    if (race->fds[i] < 0)
+        return -1;
+    if (getsockopt (race->fds[i], SOL_SOCKET, SO_ERROR, &err, &errlen) == 0
+        && err == 0)
+        return race->fds[i];
+
+    /* A refused attempt lets the next address go right away. */
+    close (race->fds[i]);
+    race->fds[i] = -1;
+    race->live--;
+    race->next_start = 0;
+    return -1;
+}
+
+int connect_race_over (struct connect_race_s *race, long long now)
+{
+    return (race->live == 0 && race->started == race->naddrs)
+           || now >= race->deadline;
+}
+
+long long connect_race_wait (struct connect_race_s *race, long long now)
+{
+    long long wait = race->deadline - now;
+
+    if (race->started != race->naddrs && race->next_start - now < wait)
+        wait = race->next_start - now;
+    return wait > 0 ? wait : 0;
+}
+
+void connect_race_end (struct connect_race_s *race, int keep)
+{
+    int i;
+
+    for (i = 0; i != race->started; i++) {
+        if (race->fds[i] >= 0 && race->fds[i] != keep)
+            close (race->fds[i]);
+        race->fds[i] = -1;
+    }
+}
+
+/*
+ * Connect to host the Happy Eyeballs way (RFC 8305): a new address is
+ * tried every NETWORK_CONNECT_STAGGER ms, or as soon as an attempt
+ * fails, without giving up on the ones already under way.  The first
+ * connection to complete wins and the rest are closed.  Everything
+ * gives up after the connect timeout.  The socket returned is blocking.
+ */
 int opensock (const char *host, int port)
 {
-    int sockfd, n;
-    struct addrinfo hints, *res, *ressave;
-    char portstr[6];
+    int sockfd = -1, n, i;
+    struct dns_addr_s addrs[DNS_MAXADDRS];
+    struct connect_race_s race;
+    struct pollfd pfds[DNS_MAXADDRS];
+    long long now;
 
     assert (host != NULL);
     assert (port > 0);
 
-    memset (&hints, 0, sizeof (struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    snprintf (portstr, sizeof (portstr), "%d", port);
-
-    n = getaddrinfo (host, portstr, &hints, &res);
-    if (n != 0) {
+    n = dns_resolve (host, port, addrs, DNS_MAXADDRS);
+    if (n < 0) {
         MITLogWrite (MITLOG_LEVEL_ERROR,
                      "opensock: Could not retrieve info for %s", host);
         return -1;
     }
 
-    ressave = res;
-    do {
-        sockfd =
-            socket (res->ai_family, res->ai_socktype, res->ai_protocol);
-        if (sockfd < 0)
-            continue;
-        
-        if (connect (sockfd, res->ai_addr, res->ai_addrlen) == 0)
+    connect_race_start (&race, addrs, n);
+    now = monotonic_ms ();
+    while ((sockfd = connect_race_advance (&race, now)) < 0) {
+        if (connect_race_over (&race, now)) {
+            if (now >= race.deadline)
+                MITLogWrite (MITLOG_LEVEL_ERROR,
+                             "opensock: Connecting to %s timed out", host);
             break;
+        }
 
-        close (sockfd);
-    } while ((res = res->ai_next) != NULL);
-    freeaddrinfo (ressave);
-    if (res == NULL) {
+        for (i = 0; i != race.started; i++) {
+            pfds[i].fd = race.fds[i];
+            pfds[i].events = POLLOUT;
+            pfds[i].revents = 0;
+        }
+        if (poll (pfds, race.started, connect_race_wait (&race, now)) < 0
+            && errno != EINTR)
+            break;
+
+        for (i = 0; i != race.started && sockfd < 0; i++)
+            if (pfds[i].fd >= 0 && pfds[i].revents)
+                sockfd = connect_race_check (&race, i);
+        if (sockfd >= 0)
+            break;
+        now = monotonic_ms ();
+    }
+    connect_race_end (&race, sockfd);
+
+    if (sockfd < 0) {
         MITLogWrite(MITLOG_LEVEL_ERROR,
                     "opensock: Could not establish a connection to %s",
                     host);
+        /* Maybe the name has moved; look it up again next time. */
+        dns_forget (host, port);
         return -1;
     }
-
+    socket_blocking (sockfd);
     return sockfd;
 }
-
@@ -2,12 +2,53 @@
 #define _PROXYLAB_NETWORK_H_
 
 #include "csapp.h"
+#include "dns.h"
+#include <sys/uio.h>
 
-extern ssize_t readline (int fd, char **whole_buffer);
+#define NETWORK_CONNECT_TIMEOUT 10000   /* ms before opensock() gives up */
+#define NETWORK_CONNECT_STAGGER 250     /* ms between racing attempts */
+#define NETWORK_SPLICE_SIZE ((size_t)(64 * 1024))  /* one pipe's worth */
+
+extern int socket_nonblocking (int sock);
+extern int socket_blocking (int sock);
 extern char *get_ip_string (struct sockaddr *sa, char *buf, size_t buflen);
 extern ssize_t safe_write (int fd, const char *buffer, size_t count);
+extern ssize_t safe_writev (int fd, struct iovec *iov, int iovcnt);
+extern ssize_t splice_relay (int from, int to, long count);
 extern ssize_t safe_read (int fd, char *buffer, size_t count);
 extern int write_message (int fd, const char *fmt, ...);
+extern void opensock_set_timeout (unsigned int ms);
 extern int opensock (const char *host, int port);
 
+/*
+ * The Happy Eyeballs race behind opensock(), for callers that do their
+ * own waiting.  connect_race_start() orders what dns_resolve() gave
+ * and sets the deadline.  connect_race_advance() starts the attempts
+ * that are due and returns a socket that connected at once, or -1.
+ * Once a started fds[i] polls writable, connect_race_check() returns it
+ * if it connected, or drops it and returns -1.  connect_race_wait() is
+ * the ms until the next attempt or the deadline, connect_race_over()
+ * whether there is nothing left to wait for, and connect_race_end()
+ * closes every attempt but keep.  Times are monotonic_ms().
+ */
+struct connect_race_s {
+    struct dns_addr_s addrs[DNS_MAXADDRS];
+    int fds[DNS_MAXADDRS];          /* -1 until started, and once dropped */
+    int naddrs;
+    int started;
+    int live;                       /* attempts still under way */
+    long long next_start;
+    long long deadline;
+};
+
+extern long long monotonic_ms (void);
+extern void connect_race_start (struct connect_race_s *race,
+                                const struct dns_addr_s *addrs, int n);
+extern int connect_race_advance (struct connect_race_s *race, long long now);
+extern int connect_race_check (struct connect_race_s *race, int i);
+extern int connect_race_over (struct connect_race_s *race, long long now);
+extern long long connect_race_wait (struct connect_race_s *race,
+                                    long long now);
+extern void connect_race_end (struct connect_race_s *race, int keep);
+
 #endif
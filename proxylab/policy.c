@@ -0,0 +1,729 @@
+#include "policy.h"
+
+/*
+ * One tracked key.  Which fields mean anything depends on the policy:
+ * the list ones for LRU, ARC and S3-FIFO, the heap ones for LFU and
+ * GDSF.
+ */
+struct pnode_s {
+    char *key;
+    size_t len;
+    unsigned int queue;             /* which list it is on */
+    unsigned int freq;
+
+    struct pnode_s *prev, *next;    /* toward head, toward tail */
+
+    double priority;
+    unsigned long seq;              /* breaks priority ties, oldest first */
+    unsigned int slot;              /* position in the heap */
+};
+
+/* A queue, newest at the head. */
+struct plist_s {
+    struct pnode_s *head, *tail;
+    size_t bytes;
+    unsigned int count;
+};
+
+static struct pnode_s *node_get (struct policy_s *policy, const char *key)
+{
+    void *data;
+
+    if (hashmap_entry_by_key (policy->index, key, &data) > 0)
+        return *(struct pnode_s **) data;
+    return NULL;
+}
+
+static struct pnode_s *node_new (struct policy_s *policy, const char *key,
+                                 size_t len)
+{
+    struct pnode_s *node;
+
+    node = (struct pnode_s *) Calloc (1, sizeof (struct pnode_s));
+    node->key = strdup (key);
+    node->len = len;
+    if (hashmap_insert (policy->index, key, &node, sizeof (node)) < 0) {
+        Free (node->key);
+        Free (node);
+        return NULL;
+    }
+    return node;
+}
+
+static void node_free (struct policy_s *policy, struct pnode_s *node)
+{
+    hashmap_remove (policy->index, node->key);
+    Free (node->key);
+    Free (node);
+}
+
+static void plist_push (struct plist_s *list, struct pnode_s *node,
+                        unsigned int queue)
+{
+    node->queue = queue;
+    node->prev = NULL;
+    node->next = list->head;
+    if (list->head)
+        list->head->prev = node;
+    list->head = node;
+    if (!list->tail)
+        list->tail = node;
+    list->bytes += node->len;
+    list->count++;
+}
+
+static void plist_unlink (struct plist_s *list, struct pnode_s *node)
+{
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        list->head = node->next;
+    if (node->next)
+        node->next->prev = node->prev;
+    else
+        list->tail = node->prev;
+    node->prev = node->next = NULL;
+    list->bytes -= node->len;
+    list->count--;
+}
+
+static void plist_clear (struct policy_s *policy, struct plist_s *list)
+{
+    struct pnode_s *node;
+
+    while ((node = list->tail) != NULL) {
+        plist_unlink (list, node);
+        node_free (policy, node);
+    }
+}
+
+static int policy_base_init (struct policy_s *policy,
+                             const struct policy_ops_s *ops, size_t capacity)
+{
+    policy->ops = ops;
+    policy->capacity = capacity;
+    policy->index = hashmap_create (POLICY_BUCKETS);
+    return policy->index ? 0 : -ENOMEM;
+}
+
+/* LRU: one queue, hits go back to the head, the tail goes first. */
+
+struct lru_s {
+    struct policy_s base;
+    struct plist_s list;
+};
+
+static const struct policy_ops_s lru_ops;
+
+static struct policy_s *lru_create (size_t capacity)
+{
+    struct lru_s *lru = (struct lru_s *) Calloc (1, sizeof (struct lru_s));
+
+    if (policy_base_init (&lru->base, &lru_ops, capacity) < 0) {
+        Free (lru);
+        return NULL;
+    }
+    return &lru->base;
+}
+
+static void lru_destroy (struct policy_s *policy)
+{
+    struct lru_s *lru = (struct lru_s *) policy;
+
+    plist_clear (policy, &lru->list);
+    hashmap_delete (policy->index);
+    Free (lru);
+}
+
+static void lru_insert (struct policy_s *policy, const char *key, size_t len)
+{
+    struct lru_s *lru = (struct lru_s *) policy;
+    struct pnode_s *node;
+
+    if ((node = node_new (policy, key, len)) != NULL)
+        plist_push (&lru->list, node, 0);
+}
+
+static void lru_hit (struct policy_s *policy, const char *key)
+{
+    struct lru_s *lru = (struct lru_s *) policy;
+    struct pnode_s *node;
+
+    if ((node = node_get (policy, key)) != NULL && node != lru->list.head) {
+        plist_unlink (&lru->list, node);
+        plist_push (&lru->list, node, 0);
+    }
+}
+
+static void lru_remove (struct policy_s *policy, const char *key)
+{
+    struct lru_s *lru = (struct lru_s *) policy;
+    struct pnode_s *node;
+
+    if ((node = node_get (policy, key)) != NULL) {
+        plist_unlink (&lru->list, node);
+        node_free (policy, node);
+    }
+}
+
+static const char *lru_victim (struct policy_s *policy)
+{
+    struct lru_s *lru = (struct lru_s *) policy;
+
+    return lru->list.tail ? lru->list.tail->key : NULL;
+}
+
+static void lru_evict (struct policy_s *policy)
+{
+    struct lru_s *lru = (struct lru_s *) policy;
+    struct pnode_s *node;
+
+    if ((node = lru->list.tail) != NULL) {
+        plist_unlink (&lru->list, node);
+        node_free (policy, node);
+    }
+}
+
+static const struct policy_ops_s lru_ops = {
+    "lru", lru_create, lru_destroy, lru_insert, lru_hit, lru_remove,
+    lru_victim, lru_evict
+};
+
+/*
+ * LFU and GDSF: a binary min-heap on priority.  For LFU the priority
+ * is the hit count.  For GDSF (Greedy-Dual-Size-Frequency, with unit
+ * cost) it is L + count / size, where L is the priority of the last
+ * victim, so small popular objects are kept over big ones and objects
+ * that stop being asked for age out as L rises.
+ */
+
+struct heap_s {
+    struct policy_s base;
+    struct pnode_s **nodes;
+    unsigned int count, size;
+    unsigned long seq;
+    int sized;                      /* GDSF rather than LFU */
+    double clock;                   /* GDSF's L */
+};
+
+static const struct policy_ops_s lfu_ops, gdsf_ops;
+
+static int heap_before (struct pnode_s *a, struct pnode_s *b)
+{
+    return a->priority < b->priority
+        || (a->priority == b->priority && a->seq < b->seq);
+}
+
+static void heap_set (struct heap_s *heap, unsigned int slot,
+                      struct pnode_s *node)
+{
+    heap->nodes[slot] = node;
+    node->slot = slot;
+}
+
+/* Restore the heap order around slot after its priority changed. */
+static void heap_fix (struct heap_s *heap, unsigned int slot)
+{
+    struct pnode_s *node = heap->nodes[slot];
+    unsigned int child;
+
+    while (slot > 0 && heap_before (node, heap->nodes[(slot - 1) / 2])) {
+        heap_set (heap, slot, heap->nodes[(slot - 1) / 2]);
+        slot = (slot - 1) / 2;
+    }
+    while ((child = 2 * slot + 1) < heap->count) {
+        if (child + 1 < heap->count
+            && heap_before (heap->nodes[child + 1], heap->nodes[child]))
+            child++;
+        if (!heap_before (heap->nodes[child], node))
+            break;
+        heap_set (heap, slot, heap->nodes[child]);
+        slot = child;
+    }
+    heap_set (heap, slot, node);
+}
+
+static void heap_take (struct heap_s *heap, struct pnode_s *node)
+{
+    unsigned int slot = node->slot;
+
+    if (slot != --heap->count) {
+        heap_set (heap, slot, heap->nodes[heap->count]);
+        heap_fix (heap, slot);
+    }
+}
+
+static void heap_prioritise (struct heap_s *heap, struct pnode_s *node)
+{
+    if (heap->sized)
+        node->priority = heap->clock
+                         + (double) node->freq / (node->len ? node->len : 1);
+    else
+        node->priority = node->freq;
+    node->seq = heap->seq++;
+}
+
+static struct policy_s *heap_create (size_t capacity, int sized)
+{
+    struct heap_s *heap = (struct heap_s *) Calloc (1, sizeof (struct heap_s));
+
+    if (policy_base_init (&heap->base, sized ? &gdsf_ops : &lfu_ops,
+                          capacity) < 0) {
+        Free (heap);
+        return NULL;
+    }
+    heap->sized = sized;
+    return &heap->base;
+}
+
+static struct policy_s *lfu_create (size_t capacity)
+{
+    return heap_create (capacity, 0);
+}
+
+static struct policy_s *gdsf_create (size_t capacity)
+{
+    return heap_create (capacity, 1);
+}
+
+static void heap_destroy (struct policy_s *policy)
+{
+    struct heap_s *heap = (struct heap_s *) policy;
+
+    while (heap->count)
+        node_free (policy, heap->nodes[--heap->count]);
+    if (heap->nodes)
+        Free (heap->nodes);
+    hashmap_delete (policy->index);
+    Free (heap);
+}
+
+static void heap_insert (struct policy_s *policy, const char *key, size_t len)
+{
+    struct heap_s *heap = (struct heap_s *) policy;
+    struct pnode_s *node;
+
+    if (heap->count == heap->size) {
+        heap->size = heap->size ? heap->size * 2 : 64;
+        heap->nodes = (struct pnode_s **) Realloc (heap->nodes, heap->size
+                                                   * sizeof (*heap->nodes));
+    }
+    if ((node = node_new (policy, key, len)) == NULL)
+        return;
+    node->freq = 1;
+    heap_prioritise (heap, node);
+    heap_set (heap, heap->count++, node);
+    heap_fix (heap, node->slot);
+}
+
+static void heap_hit (struct policy_s *policy, const char *key)
+{
+    struct heap_s *heap = (struct heap_s *) policy;
+    struct pnode_s *node;
+
+    if ((node = node_get (policy, key)) != NULL) {
+        node->freq++;
+        heap_prioritise (heap, node);
+        heap_fix (heap, node->slot);
+    }
+}
+
+static void heap_remove (struct policy_s *policy, const char *key)
+{
+    struct heap_s *heap = (struct heap_s *) policy;
+    struct pnode_s *node;
+
+    if ((node = node_get (policy, key)) != NULL) {
+        heap_take (heap, node);
+        node_free (policy, node);
+    }
+}
+
+static const char *heap_victim (struct policy_s *policy)
+{
+    struct heap_s *heap = (struct heap_s *) policy;
+
+    return heap->count ? heap->nodes[0]->key : NULL;
+}
+
+static void heap_evict (struct policy_s *policy)
+{
+    struct heap_s *heap = (struct heap_s *) policy;
+    struct pnode_s *node;
+
+    if (heap->count == 0)
+        return;
+    node = heap->nodes[0];
+    if (heap->sized)
+        heap->clock = node->priority;
+    heap_take (heap, node);
+    node_free (policy, node);
+}
+
+static const struct policy_ops_s lfu_ops = {
+    "lfu", lfu_create, heap_destroy, heap_insert, heap_hit, heap_remove,
+    heap_victim, heap_evict
+};
+
+static const struct policy_ops_s gdsf_ops = {
+    "gdsf", gdsf_create, heap_destroy, heap_insert, heap_hit, heap_remove,
+    heap_victim, heap_evict
+};
+
+/*
+ * ARC, counted in bytes rather than entries.  T1 holds objects seen
+ * once, T2 objects seen again; B1 and B2 remember the keys lately
+ * evicted from each.  A miss that finds its key in B1 means T1 was
+ * given too little room, so the target size p of T1 grows; one found
+ * in B2 shrinks it.  The victim comes from T1 while T1 is over p.
+ */
+
+enum { ARC_T1, ARC_T2, ARC_B1, ARC_B2 };
+
+struct arc_s {
+    struct policy_s base;
+    struct plist_s lists[4];
+    size_t target;                  /* p, the bytes T1 should have */
+};
+
+static const struct policy_ops_s arc_ops;
+
+static struct policy_s *arc_create (size_t capacity)
+{
+    struct arc_s *arc = (struct arc_s *) Calloc (1, sizeof (struct arc_s));
+
+    if (policy_base_init (&arc->base, &arc_ops, capacity) < 0) {
+        Free (arc);
+        return NULL;
+    }
+    return &arc->base;
+}
+
+static void arc_destroy (struct policy_s *policy)
+{
+    struct arc_s *arc = (struct arc_s *) policy;
+    unsigned int i;
+
+    for (i = 0; i != 4; i++)
+        plist_clear (policy, &arc->lists[i]);
+    hashmap_delete (policy->index);
+    Free (arc);
+}
+
+/* Keep the ghosts to about one cache's worth, as ARC does. */
+static void arc_trim_ghosts (struct arc_s *arc)
+{
+    struct plist_s *l = arc->lists;
+    size_t capacity = arc->base.capacity;
+    struct pnode_s *node;
+
+    while (l[ARC_T1].bytes + l[ARC_B1].bytes > capacity
+           && (node = l[ARC_B1].tail) != NULL) {
+        plist_unlink (&l[ARC_B1], node);
+        node_free (&arc->base, node);
+    }
+    while (l[ARC_T1].bytes + l[ARC_T2].bytes + l[ARC_B1].bytes
+           + l[ARC_B2].bytes > 2 * capacity
+           && (node = l[ARC_B2].tail) != NULL) {
+        plist_unlink (&l[ARC_B2], node);
+        node_free (&arc->base, node);
+    }
+}
+
+/*
+ * How far a ghost hit on the list holding hit_bytes moves the target.
+ * An empty list counts as the larger, so the ratio never divides by 0.
+ */
+static size_t arc_delta (size_t len, size_t hit_bytes, size_t other_bytes)
+{
+    if (hit_bytes == 0 || hit_bytes >= other_bytes)
+        return len;
+    return len * (other_bytes / hit_bytes);
+}
+
+/*
+ * Objects are charged at least a byte, so that empty ones still count
+ * against the ghost lists and get trimmed from them.
+ */
+static void arc_insert (struct policy_s *policy, const char *key, size_t len)
+{
+    struct arc_s *arc = (struct arc_s *) policy;
+    struct plist_s *l = arc->lists;
+    struct pnode_s *node;
+    size_t delta;
+
+    if (len == 0)
+        len = 1;
+    if ((node = node_get (policy, key)) != NULL) {
+        if (node->queue == ARC_B1) {
+            delta = arc_delta (len, l[ARC_B1].bytes, l[ARC_B2].bytes);
+            arc->target = arc->target + delta < policy->capacity
+                          ? arc->target + delta : policy->capacity;
+        } else if (node->queue == ARC_B2) {
+            delta = arc_delta (len, l[ARC_B2].bytes, l[ARC_B1].bytes);
+            arc->target = arc->target > delta ? arc->target - delta : 0;
+        }
+        plist_unlink (&l[node->queue], node);
+        node->len = len;
+        plist_push (&l[ARC_T2], node, ARC_T2);
+    } else if ((node = node_new (policy, key, len)) != NULL) {
+        plist_push (&l[ARC_T1], node, ARC_T1);
+    }
+    arc_trim_ghosts (arc);
+}
+
+static void arc_hit (struct policy_s *policy, const char *key)
+{
+    struct arc_s *arc = (struct arc_s *) policy;
+    struct pnode_s *node;
+
+    if ((node = node_get (policy, key)) != NULL && node->queue <= ARC_T2) {
+        plist_unlink (&arc->lists[node->queue], node);
+        plist_push (&arc->lists[ARC_T2], node, ARC_T2);
+    }
+}
+
+static void arc_remove (struct policy_s *policy, const char *key)
+{
+    struct arc_s *arc = (struct arc_s *) policy;
+    struct pnode_s *node;
+
+    if ((node = node_get (policy, key)) != NULL) {
+        plist_unlink (&arc->lists[node->queue], node);
+        node_free (policy, node);
+    }
+}
+
+/* ARC's REPLACE: which resident list gives up its tail. */
+static struct plist_s *arc_choose (struct arc_s *arc)
+{
+    struct plist_s *l = arc->lists;
+
+    if (l[ARC_T1].tail && (l[ARC_T1].bytes > arc->target || !l[ARC_T2].tail))
+        return &l[ARC_T1];
+    return l[ARC_T2].tail ? &l[ARC_T2] : NULL;
+}
+
+static const char *arc_victim (struct policy_s *policy)
+{
+    struct plist_s *list = arc_choose ((struct arc_s *) policy);
+
+    return list ? list->tail->key : NULL;
+}
+
+static void arc_evict (struct policy_s *policy)
+{
+    struct arc_s *arc = (struct arc_s *) policy;
+    struct plist_s *list = arc_choose (arc);
+    struct pnode_s *node;
+    unsigned int ghost;
+
+    if (list == NULL)
+        return;
+    node = list->tail;
+    ghost = node->queue == ARC_T1 ? ARC_B1 : ARC_B2;
+    plist_unlink (list, node);
+    plist_push (&arc->lists[ghost], node, ghost);
+    arc_trim_ghosts (arc);
+}
+
+static const struct policy_ops_s arc_ops = {
+    "arc", arc_create, arc_destroy, arc_insert, arc_hit, arc_remove,
+    arc_victim, arc_evict
+};
+
+/*
+ * S3-FIFO: new objects go through a small FIFO holding a tenth of the
+ * space.  Those hit while there move on to the main FIFO when they
+ * reach its tail; the rest are evicted and their keys kept in a ghost
+ * FIFO, so that one coming back goes straight to main.  Main is a FIFO
+ * with a little reinsertion: a tail object that was hit goes round
+ * again with one hit fewer.  Hits only bump a counter, so nothing
+ * moves on the hit path.
+ */
+
+enum { S3_SMALL, S3_MAIN, S3_GHOST };
+
+#define S3_SMALL_SHARE 10           /* small gets capacity / this */
+#define S3_MAXFREQ 3
+
+struct s3fifo_s {
+    struct policy_s base;
+    struct plist_s lists[3];
+};
+
+static const struct policy_ops_s s3fifo_ops;
+
+static struct policy_s *s3fifo_create (size_t capacity)
+{
+    struct s3fifo_s *s3 = (struct s3fifo_s *) Calloc (1,
+                                                      sizeof (struct s3fifo_s));
+
+    if (policy_base_init (&s3->base, &s3fifo_ops, capacity) < 0) {
+        Free (s3);
+        return NULL;
+    }
+    return &s3->base;
+}
+
+static void s3fifo_destroy (struct policy_s *policy)
+{
+    struct s3fifo_s *s3 = (struct s3fifo_s *) policy;
+    unsigned int i;
+
+    for (i = 0; i != 3; i++)
+        plist_clear (policy, &s3->lists[i]);
+    hashmap_delete (policy->index);
+    Free (s3);
+}
+
+static void s3fifo_insert (struct policy_s *policy, const char *key,
+                           size_t len)
+{
+    struct s3fifo_s *s3 = (struct s3fifo_s *) policy;
+    struct pnode_s *node;
+
+    if ((node = node_get (policy, key)) != NULL) {
+        plist_unlink (&s3->lists[node->queue], node);
+        node->len = len;
+        node->freq = 0;
+        plist_push (&s3->lists[S3_MAIN], node, S3_MAIN);
+    } else if ((node = node_new (policy, key, len)) != NULL) {
+        plist_push (&s3->lists[S3_SMALL], node, S3_SMALL);
+    }
+}
+
+static void s3fifo_hit (struct policy_s *policy, const char *key)
+{
+    struct pnode_s *node;
+
+    if ((node = node_get (policy, key)) != NULL && node->freq < S3_MAXFREQ)
+        node->freq++;
+}
+
+static void s3fifo_remove (struct policy_s *policy, const char *key)
+{
+    struct s3fifo_s *s3 = (struct s3fifo_s *) policy;
+    struct pnode_s *node;
+
+    if ((node = node_get (policy, key)) != NULL) {
+        plist_unlink (&s3->lists[node->queue], node);
+        node_free (policy, node);
+    }
+}
+
+/*
+ * Promote and reinsert until the tail of the queue being evicted from
+ * is an object that has not been hit.
+ */
+static struct pnode_s *s3fifo_settle (struct s3fifo_s *s3)
+{
+    struct plist_s *smallq = &s3->lists[S3_SMALL];
+    struct plist_s *mainq = &s3->lists[S3_MAIN];
+    struct pnode_s *node;
+
+    for (;;) {
+        if (smallq->tail
+            && (smallq->bytes > s3->base.capacity / S3_SMALL_SHARE
+                || !mainq->tail)) {
+            node = smallq->tail;
+            if (node->freq == 0)
+                return node;
+            plist_unlink (smallq, node);
+            node->freq = 0;
+            plist_push (mainq, node, S3_MAIN);
+        } else if ((node = mainq->tail) != NULL) {
+            if (node->freq == 0)
+                return node;
+            plist_unlink (mainq, node);
+            node->freq--;
+            plist_push (mainq, node, S3_MAIN);
+        } else {
+            return NULL;
+        }
+    }
+}
+
+static const char *s3fifo_victim (struct policy_s *policy)
+{
+    struct pnode_s *node = s3fifo_settle ((struct s3fifo_s *) policy);
+
+    return node ? node->key : NULL;
+}
+
+static void s3fifo_evict (struct policy_s *policy)
+{
+    struct s3fifo_s *s3 = (struct s3fifo_s *) policy;
+    struct plist_s *ghost = &s3->lists[S3_GHOST];
+    struct pnode_s *node;
+
+    if ((node = s3fifo_settle (s3)) == NULL)
+        return;
+    plist_unlink (&s3->lists[node->queue], node);
+    if (node->queue == S3_MAIN) {
+        node_free (policy, node);
+        return;
+    }
+
+    /* The ghosts cover about as much as main does. */
+    plist_push (ghost, node, S3_GHOST);
+    while (ghost->bytes > policy->capacity - policy->capacity / S3_SMALL_SHARE
+           && (node = ghost->tail) != NULL) {
+        plist_unlink (ghost, node);
+        node_free (policy, node);
+    }
+}
+
+static const struct policy_ops_s s3fifo_ops = {
+    "s3fifo", s3fifo_create, s3fifo_destroy, s3fifo_insert, s3fifo_hit,
+    s3fifo_remove, s3fifo_victim, s3fifo_evict
+};
+
+const struct policy_ops_s *const policy_list[] = {
+    &lru_ops, &lfu_ops, &arc_ops, &s3fifo_ops, &gdsf_ops, NULL
+};
+
+const struct policy_ops_s *policy_find (const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; policy_list[i]; i++)
+        if (!strcasecmp (policy_list[i]->name, name))
+            return policy_list[i];
+    return NULL;
+}
+
+struct policy_s *policy_new (const struct policy_ops_s *ops, size_t capacity)
+{
+    return ops->create (capacity);
+}
+
+void policy_free (struct policy_s *policy)
+{
+    policy->ops->destroy (policy);
+}
+
+void policy_insert (struct policy_s *policy, const char *key, size_t len)
+{
+    policy->ops->insert (policy, key, len);
+}
+
+void policy_hit (struct policy_s *policy, const char *key)
+{
+    policy->ops->hit (policy, key);
+}
+
+void policy_remove (struct policy_s *policy, const char *key)
+{
+    policy->ops->remove (policy, key);
+}
+
+const char *policy_victim (struct policy_s *policy)
+{
+    return policy->ops->victim (policy);
+}
+
+void policy_evict (struct policy_s *policy)
+{
+    policy->ops->evict (policy);
+}
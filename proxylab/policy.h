@@ -0,0 +1,56 @@
+#ifndef _PROXYLAB_POLICY_H_
+#define _PROXYLAB_POLICY_H_
+
+#include "csapp.h"
+#include "hashmap.h"
+
+#define POLICY_BUCKETS 1024
+#define POLICY_DEFAULT "lru"
+
+/*
+ * Eviction policies.  A policy only orders keys: the cache tells it
+ * what became resident (insert), what was asked for again (hit) and
+ * what left for some other reason (remove), and asks it which key to
+ * give up next (victim, then evict).  Byte accounting and the decision
+ * of when to evict stay with the cache; capacity is only a hint for
+ * policies that split their space, like ARC and S3-FIFO.
+ *
+ * victim() may reorder the policy's queues while it looks, but never
+ * changes what is resident.  The key it returns stays valid until the
+ * next call into the policy, and evict() drops exactly that key.
+ * Nothing is locked: each shard has its own instance under its lock.
+ */
+struct policy_s;
+
+struct policy_ops_s {
+    const char *name;
+    struct policy_s *(*create) (size_t capacity);
+    void (*destroy) (struct policy_s *policy);
+    void (*insert) (struct policy_s *policy, const char *key, size_t len);
+    void (*hit) (struct policy_s *policy, const char *key);
+    void (*remove) (struct policy_s *policy, const char *key);
+    const char *(*victim) (struct policy_s *policy);
+    void (*evict) (struct policy_s *policy);
+};
+
+/* What every policy starts with. */
+struct policy_s {
+    const struct policy_ops_s *ops;
+    size_t capacity;
+    hashmap_t index;                /* key to node, ghosts included */
+};
+
+extern const struct policy_ops_s *const policy_list[];
+
+extern const struct policy_ops_s *policy_find (const char *name);
+extern struct policy_s *policy_new (const struct policy_ops_s *ops,
+                                    size_t capacity);
+extern void policy_free (struct policy_s *policy);
+extern void policy_insert (struct policy_s *policy, const char *key,
+                           size_t len);
+extern void policy_hit (struct policy_s *policy, const char *key);
+extern void policy_remove (struct policy_s *policy, const char *key);
+extern const char *policy_victim (struct policy_s *policy);
+extern void policy_evict (struct policy_s *policy);
+
+#endif
@@ -0,0 +1,254 @@
+/*
+ * policysim - replay a request trace through every eviction policy at
+ * a range of cache sizes and report hit ratio and byte-hit ratio.
+ *
+ * usage: ./policysim [-a] [-p policy,...] [-c bytes,...] trace
+ *
+ * The trace has one request per line: the size of the response in
+ * bytes, white space, then the cache key, which runs to the end of the
+ * line and so may hold spaces of its own.  Blank lines and lines
+ * starting with '#' are skipped.  A request is a hit if its key
+ * is resident; a miss makes it resident, evicting by the policy until
+ * it fits.  Responses bigger than the whole cache are never admitted.
+ * Without -c the sizes are fractions of the trace's footprint (the
+ * bytes of all distinct keys).  -a puts the proxy's TinyLFU admission
+ * in front of every policy.
+ *
+ * The simulated cache is one shard, not CACHE_SHARDS of them, so its
+ * numbers are for comparing policies rather than predicting the proxy.
+ */
+#include "csapp.h"
+#include "hashmap.h"
+#include "policy.h"
+#include "sketch.h"
+
+#define SIM_LINE_LENGTH 8192
+#define SIM_MAXLIST 32          /* policies or sizes given */
+#define SIM_MINSKETCH 1024
+
+static const double fractions[] = {0.001, 0.01, 0.05, 0.1, 0.25, 0.5};
+
+struct request_s {
+    const char *key;                /* interned: one copy per distinct key */
+    size_t len;
+};
+
+struct trace_s {
+    struct request_s *requests;
+    size_t count, size;
+    size_t keys;                    /* distinct */
+    size_t footprint;               /* bytes over distinct keys */
+    hashmap_t names;                /* key to its interned copy */
+};
+
+static void usage (const char *prog)
+{
+    fprintf (stderr, "usage: %s [-a] [-p policy,...] [-c bytes,...] trace\n",
+             prog);
+    exit (1);
+}
+
+/* Keep one copy of each key, so requests can share it. */
+static const char *intern (struct trace_s *trace, const char *key,
+                           size_t len)
+{
+    void *data;
+    char *copy;
+
+    if (hashmap_entry_by_key (trace->names, key, &data) > 0)
+        return *(char **) data;
+    copy = strdup (key);
+    hashmap_insert (trace->names, key, &copy, sizeof (copy));
+    trace->keys++;
+    trace->footprint += len;
+    return copy;
+}
+
+static int trace_load (struct trace_s *trace, const char *path)
+{
+    char line[SIM_LINE_LENGTH], *key, *end;
+    FILE *fp;
+    unsigned long lineno = 0;
+    long long len;
+
+    if ((fp = fopen (path, "r")) == NULL)
+        return -errno;
+
+    memset (trace, 0, sizeof (*trace));
+    trace->names = hashmap_create (65536);
+    while (fgets (line, sizeof (line), fp)) {
+        lineno++;
+        line[strcspn (line, "\r\n")] = '\0';
+        if (line[strspn (line, " \t")] == '\0' || line[0] == '#')
+            continue;
+        len = strtoll (line, &end, 10);
+        key = end + strspn (end, " \t");
+        if (len < 0 || end == line || key == end || *key == '\0') {
+            fprintf (stderr, "%s:%lu: expected a size and a key\n", path,
+                     lineno);
+            fclose (fp);
+            return -EINVAL;
+        }
+        if (trace->count == trace->size) {
+            trace->size = trace->size ? trace->size * 2 : 4096;
+            trace->requests = (struct request_s *)
+                Realloc (trace->requests,
+                         trace->size * sizeof (struct request_s));
+        }
+        trace->requests[trace->count].key = intern (trace, key, len);
+        trace->requests[trace->count].len = (size_t) len;
+        trace->count++;
+    }
+    fclose (fp);
+    return 0;
+}
+
+static void trace_free (struct trace_s *trace)
+{
+    hashmap_cursor_t cursor;
+    char *key;
+    void *data;
+
+    for (cursor = hashmap_cursor_first (trace->names); cursor;
+         cursor = hashmap_cursor_next (cursor)) {
+        hashmap_cursor_entry (cursor, &key, &data);
+        Free (*(char **) data);
+    }
+    hashmap_delete (trace->names);
+    if (trace->requests)
+        Free (trace->requests);
+}
+
+static unsigned int sketch_width (size_t keys)
+{
+    unsigned int width = SIM_MINSKETCH;
+
+    while (width < keys)
+        width *= 2;
+    return width;
+}
+
+/* Replay the trace through one policy at one size. */
+static void simulate (struct trace_s *trace, const struct policy_ops_s *ops,
+                      size_t capacity, int admission)
+{
+    struct policy_s *policy = policy_new (ops, capacity);
+    hashmap_t resident = hashmap_create (65536);
+    struct sketch_s sketch;
+    struct request_s *req;
+    unsigned long long hits = 0, hit_bytes = 0, bytes = 0;
+    size_t used = 0, i, len;
+    const char *victim;
+    void *data;
+
+    if (admission)
+        sketch_init (&sketch, sketch_width (trace->keys));
+
+    for (i = 0; i != trace->count; i++) {
+        req = &trace->requests[i];
+        bytes += req->len;
+        if (admission)
+            sketch_increment (&sketch, req->key);
+
+        if (hashmap_entry_by_key (resident, req->key, &data) > 0) {
+            hits++;
+            hit_bytes += req->len;
+            policy_hit (policy, req->key);
+            continue;
+        }
+        if (req->len > capacity)
+            continue;
+
+        if (admission && used + req->len > capacity
+            && (victim = policy_victim (policy)) != NULL
+            && sketch_estimate (&sketch, req->key)
+               <= sketch_estimate (&sketch, victim))
+            continue;
+
+        while (used + req->len > capacity
+               && (victim = policy_victim (policy)) != NULL) {
+            if (hashmap_entry_by_key (resident, victim, &data) > 0) {
+                used -= *(size_t *) data;
+                hashmap_remove (resident, victim);
+            }
+            policy_evict (policy);
+        }
+        len = req->len;
+        hashmap_insert (resident, req->key, &len, sizeof (len));
+        policy_insert (policy, req->key, len);
+        used += len;
+    }
+
+    printf ("%-8s %14lu %10.4f %10.4f\n", ops->name, (unsigned long) capacity,
+            trace->count ? (double) hits / trace->count : 0.0,
+            bytes ? (double) hit_bytes / bytes : 0.0);
+
+    if (admission)
+        sketch_free (&sketch);
+    hashmap_delete (resident);
+    policy_free (policy);
+}
+
+int main (int argc, char *argv[])
+{
+    const struct policy_ops_s *policies[SIM_MAXLIST];
+    size_t sizes[SIM_MAXLIST];
+    unsigned int npolicies = 0, nsizes = 0, p, s;
+    struct trace_s trace;
+    char *arg, *item;
+    int opt, admission = 0, err;
+
+    while ((opt = getopt (argc, argv, "ap:c:")) != -1) {
+        switch (opt) {
+        case 'a':
+            admission = 1;
+            break;
+        case 'p':
+            for (arg = optarg; (item = strtok (arg, ",")); arg = NULL) {
+                if (npolicies == SIM_MAXLIST)
+                    usage (argv[0]);
+                if ((policies[npolicies++] = policy_find (item)) == NULL) {
+                    fprintf (stderr, "unknown policy %s\n", item);
+                    return 1;
+                }
+            }
+            break;
+        case 'c':
+            for (arg = optarg; (item = strtok (arg, ",")); arg = NULL) {
+                if (nsizes == SIM_MAXLIST || atoll (item) < 1)
+                    usage (argv[0]);
+                sizes[nsizes++] = (size_t) atoll (item);
+            }
+            break;
+        default:
+            usage (argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage (argv[0]);
+
+    if ((err = trace_load (&trace, argv[optind])) < 0) {
+        fprintf (stderr, "%s: %s\n", argv[optind], strerror (-err));
+        return 1;
+    }
+
+    if (npolicies == 0)
+        for (p = 0; policy_list[p]; p++)
+            policies[npolicies++] = policy_list[p];
+    if (nsizes == 0)
+        for (s = 0; s != sizeof (fractions) / sizeof (fractions[0]); s++)
+            if ((sizes[nsizes] = trace.footprint * fractions[s]) > 0)
+                nsizes++;
+
+    printf ("# %lu requests, %lu keys, %lu bytes footprint%s\n",
+            (unsigned long) trace.count, (unsigned long) trace.keys,
+            (unsigned long) trace.footprint,
+            admission ? ", TinyLFU admission" : "");
+    printf ("%-8s %14s %10s %10s\n", "policy", "cache bytes", "hit ratio",
+            "byte hits");
+    for (s = 0; s != nsizes; s++)
+        for (p = 0; p != npolicies; p++)
+            simulate (&trace, policies[p], sizes[s], admission);
+    trace_free (&trace);
+    return 0;
+}
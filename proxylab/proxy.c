@@ -2,7 +2,12 @@
 
 #include "proxy.h"
 #include "child.h"
+#include "event.h"
 #include "cache.h"
+#include "upstream.h"
+#include "dns.h"
+#include "tunnel.h"
+#include "network.h"
 #include "MITLogModule.h"
 
 unsigned int QUIT = 0;
@@ -13,19 +18,123 @@ const char* ACCEPT_ENCODING = "gzip, deflate";
 const char* CONNECTION = "close";
 const char* PROXY_CONNECTION = "close";
 
-int process_cmdline(int argc, char* argv[])
+enum engine_t { ENGINE_THREADS, ENGINE_EPOLL };
+
+static void usage(void)
+{
+    app_error("Usage: ./proxy [-e threads|epoll] [-w workers] [-d ttl] [-D negative-ttl] [-c connect-ms] [-p policy] [-s store-dir] [-S store-mb] [-T connect-ports] PORT");
+}
+
+static unsigned int parse_ttl(const char *arg)
 {
-    if(argc != 2){
-        app_error("Usage: ./proxy PORT");
+    long ttl = atol(arg);
+
+    if(ttl < 0 || ttl > 86400){
+        MITLogWrite(MITLOG_LEVEL_ERROR, "DNS TTLs must be in the range [0,86400]");
         exit(0);
+    }
+    return (unsigned int)ttl;
+}
+
+int process_cmdline(int argc, char* argv[], enum engine_t *engine,
+                    unsigned int *nworkers, unsigned int *dns_ttl,
+                    unsigned int *dns_negative_ttl,
+                    const char **store_dir, unsigned int *store_segments,
+                    const struct policy_ops_s **policy)
+{
+    int opt;
+    long n = 0, ms, mb;
+
+    *engine = ENGINE_THREADS;
+    *dns_ttl = DNS_POSITIVE_TTL;
+    *dns_negative_ttl = DNS_NEGATIVE_TTL;
+    *store_dir = NULL;
+    *store_segments = STORE_MAXSEGMENTS;
+    *policy = policy_find(POLICY_DEFAULT);
+    while((opt = getopt(argc, argv, "e:w:d:D:c:p:s:S:T:")) != -1){
+        switch(opt){
+        case 'e':
+            if(!strcmp(optarg, "threads"))
+                *engine = ENGINE_THREADS;
+            else if(!strcmp(optarg, "epoll"))
+                *engine = ENGINE_EPOLL;
+            else
+                usage();
+            break;
+        case 'w':
+            n = atol(optarg);
+            if(n < 1 || n > CHILD_MAXSERVERS){
+                MITLogWrite(MITLOG_LEVEL_ERROR,
+                            "workers must be in the range [1,%d]",
+                            CHILD_MAXSERVERS);
+                exit(0);
+            }
+            break;
+        case 'd':
+            *dns_ttl = parse_ttl(optarg);
+            break;
+        case 'D':
+            *dns_negative_ttl = parse_ttl(optarg);
+            break;
+        case 'c':
+            ms = atol(optarg);
+            if(ms < 1){
+                MITLogWrite(MITLOG_LEVEL_ERROR, "connect timeout must be positive");
+                exit(0);
+            }
+            opensock_set_timeout((unsigned int)ms);
+            break;
+        case 'p':
+            if((*policy = policy_find(optarg)) == NULL){
+                MITLogWrite(MITLOG_LEVEL_ERROR,
+                            "unknown eviction policy %s", optarg);
+                exit(0);
+            }
+            break;
+        case 's':
+            *store_dir = optarg;
+            break;
+        case 'S':
+            /* Whole segments, and at least two so one can be dropped. */
+            mb = atol(optarg);
+            if(mb < 1){
+                MITLogWrite(MITLOG_LEVEL_ERROR, "store size must be positive");
+                exit(0);
+            }
+            *store_segments = (unsigned int)max(2, ((size_t)mb << 20)
+                                                    / STORE_SEGMENT_SIZE);
+            break;
+        case 'T':
+            if(tunnel_set_ports(optarg) < 0){
+                MITLogWrite(MITLOG_LEVEL_ERROR,
+                            "CONNECT ports must be a list like 443,8443 "
+                            "of at most %d ports", TUNNEL_MAXPORTS);
+                exit(0);
+            }
+            break;
+        default:
+            usage();
+        }
+    }
+
+    /* Under epoll, -w is the number of reactor threads. */
+    if(n > 0)
+        *nworkers = (unsigned int)n;
+    else
+        *nworkers = (*engine == ENGINE_EPOLL) ? EVENT_STARTREACTORS
+                                              : CHILD_STARTSERVERS;
+
+    if(optind != argc - 1){
+        usage();
     } else {
-        int port = atoi(argv[1]);
+        int port = atoi(argv[optind]);
         if(port <= 1000 || port >= 64000){
             //MITLogWrite(MITLOG_LEVEL_ERROR, "port exceeds the range (1000,64000)");
             exit(0);
         }
         return port;
     }
+    return -1;
 }
 
 signal_func *set_signal_handler (int signo, signal_func * func)
@@ -50,11 +159,67 @@ signal_func *set_signal_handler (int signo, signal_func * func)
     return oact.sa_handler;
 }
 
+/* Write the running counters to the log. */
+static void log_stats(void)
+{
+    struct dns_stats_s dns;
+    struct tunnel_stats_s tunnel;
+    struct store_stats_s store;
+
+    MITLogWrite(MITLOG_LEVEL_COMMON,
+                "queue: %u connections waiting for a worker, peak %u",
+                child_queue_depth(), child_queue_peak());
+    dns_stats(&dns);
+    MITLogWrite(MITLOG_LEVEL_COMMON,
+                "dns: %lu hits, %lu negative hits, %lu misses, %lu refreshes",
+                dns.hits, dns.negative_hits, dns.misses, dns.refreshes);
+    tunnel_stats(&tunnel);
+    MITLogWrite(MITLOG_LEVEL_COMMON,
+                "tunnels: %lu opened, %lu closed, %lu idle timeouts, "
+                "%llu bytes up, %llu bytes down",
+                tunnel.opened, tunnel.closed, tunnel.idle_timeouts,
+                tunnel.bytes_up, tunnel.bytes_down);
+    if(store_enabled()){
+        store_stats(&store);
+        MITLogWrite(MITLOG_LEVEL_COMMON,
+                    "store: %lu hits, %lu misses, %lu writes, %lu objects, "
+                    "%lu segments dropped", store.hits, store.misses,
+                    store.writes, store.objects, store.dropped);
+    }
+}
+
+/*
+ * SIGUSR1 is blocked in every thread and taken here with sigwait(),
+ * so the counters are read outside of signal context.
+ */
+static void *stats_thread(void *vargp)
+{
+    sigset_t *set = (sigset_t *)vargp;
+    int signo;
+
+    Pthread_detach(pthread_self());
+    for(;;){
+        if(sigwait(set, &signo) == 0 && signo == SIGUSR1)
+            log_stats();
+    }
+    return NULL;
+}
 
 int main(int argc, char* argv[])
 {
     MITLogOpen("TestApp", "./logs");
-    int port = process_cmdline(argc, argv);
+    enum engine_t engine;
+    unsigned int nworkers;
+    unsigned int dns_ttl, dns_negative_ttl;
+    const char *store_dir;
+    unsigned int store_segments;
+    const struct policy_ops_s *policy;
+    int listenfd;
+    sigset_t stats_signals;
+    pthread_t stats_tid;
+    int port = process_cmdline(argc, argv, &engine, &nworkers,
+                               &dns_ttl, &dns_negative_ttl,
+                               &store_dir, &store_segments, &policy);
    
     if (set_signal_handler (SIGPIPE, SIG_IGN) == SIG_ERR) {
         MITLogWrite(MITLOG_LEVEL_ERROR, "%s: Could not set the \"SIGPIPE\" signal.",
@@ -62,23 +227,49 @@ int main(int argc, char* argv[])
         exit(-1);
     }
 
-    if(child_listening_sock(port) < 0){
+    /* Before any thread is made, so that they all inherit the mask. */
+    sigemptyset(&stats_signals);
+    sigaddset(&stats_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &stats_signals, NULL);
+    Pthread_create(&stats_tid, NULL, stats_thread, &stats_signals);
+
+    if((listenfd = child_listening_sock(port)) < 0){
         MITLogWrite(MITLOG_LEVEL_ERROR, "%s: Could not create listening socket.", argv[0]);
         exit(-1);
     }
-    
-    if(child_pool_create() < 0){
-        MITLogWrite(MITLOG_LEVEL_ERROR, "%s: Could not create the pool of children.", argv[0]);
+
+    cache_init(&CACHE, policy);
+
+    if(store_dir && store_init(store_dir, store_segments) < 0){
+        MITLogWrite(MITLOG_LEVEL_ERROR, "%s: Could not open the store in %s.",
+                    argv[0], store_dir);
         exit(-1);
     }
 
-    MITLogWrite(MITLOG_LEVEL_COMMON, "Starting main loop. Accepting connections.");
+    if(dns_init(dns_ttl, dns_negative_ttl) < 0){
+        MITLogWrite(MITLOG_LEVEL_ERROR, "%s: Could not create the DNS cache.", argv[0]);
+        exit(-1);
+    }
 
-    cache_init(&CACHE);
+    if(engine == ENGINE_EPOLL){
+        MITLogWrite(MITLOG_LEVEL_COMMON, "Starting event loop. Accepting connections.");
+        event_main_loop(listenfd, nworkers);
+    } else {
+        if(upstream_init() < 0){
+            MITLogWrite(MITLOG_LEVEL_ERROR, "%s: Could not create the upstream connection pool.", argv[0]);
+            exit(-1);
+        }
+        if(child_pool_create(nworkers) < 0){
+            MITLogWrite(MITLOG_LEVEL_ERROR, "%s: Could not create the pool of children.", argv[0]);
+            exit(-1);
+        }
 
-    child_main_loop ();
+        MITLogWrite(MITLOG_LEVEL_COMMON, "Starting main loop. Accepting connections.");
+        child_main_loop ();
+    }
 
     MITLogWrite(MITLOG_LEVEL_COMMON, "Shutting down.");
+    log_stats();
 
     child_close_sock ();
 
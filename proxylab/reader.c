@@ -0,0 +1,203 @@
+#include "reader.h"
+#include "proxy.h"
+
+struct reader_s {
+    int fd;
+    char *buf;          /* allocated on first fill */
+    size_t cap;
+    struct arena_s *arena;      /* owns the reader and its first buffer */
+    size_t start;       /* first byte not yet handed out */
+    size_t end;         /* one past the last byte read */
+    size_t scanned;     /* bytes after start known to hold no '\n' */
+};
+
+/*
+ * With an arena, the reader and its first buffer are taken from it up
+ * front (so a later rewind cannot pull them away); only a buffer grown
+ * for an overlong line comes from the heap.
+ */
+struct reader_s *reader_new (int fd, struct arena_s *arena)
+{
+    struct reader_s *reader;
+
+    if (arena) {
+        reader = (struct reader_s *)
+            arena_calloc (arena, sizeof (struct reader_s));
+        reader->cap = READER_SIZE;
+        reader->buf = (char *) arena_alloc (arena, reader->cap);
+    } else {
+        reader = (struct reader_s *) Calloc (1, sizeof (struct reader_s));
+    }
+    reader->fd = fd;
+    reader->arena = arena;
+    return reader;
+}
+
+static int reader_owns_buf (struct reader_s *reader)
+{
+    return reader->buf && (!reader->arena || reader->cap != READER_SIZE);
+}
+
+/* Attach to another socket, dropping anything still buffered. */
+void reader_reset (struct reader_s *reader, int fd)
+{
+    assert (reader != NULL);
+    reader->fd = fd;
+    reader->start = reader->end = reader->scanned = 0;
+}
+
+void reader_delete (struct reader_s *reader)
+{
+    assert (reader != NULL);
+    if (reader_owns_buf (reader))
+        Free (reader->buf);
+    if (!reader->arena)
+        Free (reader);
+}
+
+size_t reader_pending (struct reader_s *reader)
+{
+    return reader->end - reader->start;
+}
+
+static ssize_t recv_retry (int fd, char *buffer, size_t count)
+{
+    ssize_t len;
+
+    do {
+        len = recv (fd, buffer, count, 0);
+    } while (len < 0 && errno == EINTR);
+    return len < 0 ? -errno : len;
+}
+
+/*
+ * Read more from the socket, first making room: slide the unread bytes
+ * down to the front, and only grow the buffer if a single line fills
+ * it.  Returns what recv() got, 0 at EOF, or -errno.
+ */
+static ssize_t reader_fill (struct reader_s *reader)
+{
+    ssize_t len;
+
+    if (!reader->buf) {
+        reader->cap = READER_SIZE;
+        reader->buf = (char *) Malloc (reader->cap);
+    }
+    if (reader->start == reader->end) {
+        reader->start = reader->end = 0;
+    } else if (reader->end == reader->cap && reader->start > 0) {
+        memmove (reader->buf, reader->buf + reader->start,
+                 reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end == reader->cap) {
+        if (reader->cap >= READER_MAXLINE)
+            return -ERANGE;
+        if (reader_owns_buf (reader)) {
+            reader->buf = (char *) Realloc (reader->buf, reader->cap * 2);
+        } else {
+            char *grown = (char *) Malloc (reader->cap * 2);
+            memcpy (grown, reader->buf, reader->end);
+            reader->buf = grown;
+        }
+        reader->cap *= 2;
+    }
+
+    len = recv_retry (reader->fd, reader->buf + reader->end,
+                      reader->cap - reader->end);
+    if (len > 0)
+        reader->end += len;
+    return len;
+}
+
+/*
+ * The next line and its length, 0 at EOF (a final line with no '\n'
+ * is dropped) or -errno.
+ */
+ssize_t reader_line (struct reader_s *reader, char **line)
+{
+    char *from, *nl;
+    ssize_t len;
+
+    assert (reader != NULL);
+    assert (line != NULL);
+
+    while (1) {
+        if (reader->buf) {
+            from = reader->buf + reader->start + reader->scanned;
+            nl = (char *) memchr (from, '\n', reader->end - reader->start
+                                              - reader->scanned);
+            if (nl) {
+                *line = reader->buf + reader->start;
+                len = nl - *line + 1;
+                reader->start += len;
+                reader->scanned = 0;
+                return len;
+            }
+            reader->scanned = reader->end - reader->start;
+        }
+
+        len = reader_fill (reader);
+        if (len <= 0)
+            return len;
+    }
+}
+
+/*
+ * Everything up to and including the next empty line, for headers.
+ * scanned is where the next unexamined line starts.  0 at EOF, or
+ * -errno (-ERANGE if the block outgrows READER_MAXLINE).
+ */
+ssize_t reader_head (struct reader_s *reader, char **block)
+{
+    char *line, *nl;
+    ssize_t len;
+
+    assert (reader != NULL);
+    assert (block != NULL);
+
+    while (1) {
+        while (reader->buf) {
+            line = reader->buf + reader->start + reader->scanned;
+            nl = (char *) memchr (line, '\n', reader->end - reader->start
+                                               - reader->scanned);
+            if (!nl)
+                break;
+            reader->scanned += nl - line + 1;
+            if (nl == line || (nl == line + 1 && *line == '\r')) {
+                *block = reader->buf + reader->start;
+                len = reader->scanned;
+                reader->start += len;
+                reader->scanned = 0;
+                return len;
+            }
+        }
+
+        len = reader_fill (reader);
+        if (len <= 0)
+            return len;
+    }
+}
+
+/*
+ * Up to count bytes: whatever is buffered first, otherwise straight
+ * from the socket into the caller's buffer.  0 at EOF, or -errno.
+ */
+ssize_t reader_read (struct reader_s *reader, char *buffer, size_t count)
+{
+    size_t len = reader_pending (reader);
+
+    assert (reader != NULL);
+    if (len == 0)
+        return recv_retry (reader->fd, buffer, count);
+
+    len = min (len, count);
+    memcpy (buffer, reader->buf + reader->start, len);
+    reader->start += len;
+    if (reader->scanned > len)
+        reader->scanned -= len;
+    else
+        reader->scanned = 0;
+    return len;
+}
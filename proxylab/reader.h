@@ -0,0 +1,34 @@
+#ifndef _PROXYLAB_READER_H_
+#define _PROXYLAB_READER_H_
+
+#include "csapp.h"
+#include "arena.h"
+
+#define READER_SIZE (1024 * 8)          /* initial input buffer */
+#define READER_MAXLINE (128 * 1024)     /* longest line we will buffer */
+
+/*
+ * Buffered input for one socket, in the spirit of csapp's rio but
+ * resumable: on a non-blocking socket -EAGAIN leaves everything read so
+ * far in place, and the next call carries on from there.
+ *
+ * reader_line() hands back a pointer into the buffer, '\n' included.
+ * reader_head() does the same for a whole header block, up to and
+ * including the blank line that ends it.  The caller may modify either
+ * in place (chomp() it, parse it), but it is only valid until the next
+ * reader_line() or reader_head() on the same reader.  reader_read()
+ * drains what is buffered before reading the socket, so a body that
+ * follows the headers is never lost.
+ */
+struct reader_s;
+extern struct reader_s *reader_new (int fd, struct arena_s *arena);
+extern void reader_reset (struct reader_s *reader, int fd);
+extern void reader_delete (struct reader_s *reader);
+extern size_t reader_pending (struct reader_s *reader);
+
+extern ssize_t reader_line (struct reader_s *reader, char **line);
+extern ssize_t reader_head (struct reader_s *reader, char **block);
+extern ssize_t reader_read (struct reader_s *reader, char *buffer,
+                            size_t count);
+
+#endif
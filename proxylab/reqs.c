@@ -3,33 +3,14 @@
 #include "conns.h"
 #include "proxy.h"
 #include "network.h"
-#include "hashmap.h"
+#include "http.h"
 #include "text.h"
 #include "cache.h"
+#include "upstream.h"
+#include "tunnel.h"
+#include "child.h"
 #include "MITLogModule.h"
 
-#define CHECK_CRLF(header, len)                                 \
-  (((len) == 1 && header[0] == '\n') ||                         \
-   ((len) == 2 && header[0] == '\r' && header[1] == '\n'))
-#define CHECK_LWS(header, len)                                  \
-  ((len) > 0 && (header[0] == ' ' || header[0] == '\t'))
-
-int socket_nonblocking (int sock)
-{
-    int flags;
-    assert (sock >= 0);
-    flags = fcntl (sock, F_GETFL, 0);
-    return fcntl (sock, F_SETFL, flags | O_NONBLOCK);
-}
-
-int socket_blocking (int sock)
-{
-    int flags;
-    assert (sock >= 0);
-    flags = fcntl (sock, F_GETFL, 0);
-    return fcntl (sock, F_SETFL, flags & ~O_NONBLOCK);
-}
-
 int getpeer_information (int fd, char *ipaddr, char *string_addr)
 {
     struct sockaddr_storage sa;
@@ -55,9 +36,13 @@ int getpeer_information (int fd, char *ipaddr, char *string_addr)
 static int read_request_line (struct conn_s *connptr)
 {
     ssize_t len;
+    char *line;
     while(1){
-        len = readline(connptr->client_fd, &connptr->request_line);
+        len = reader_line(connptr->creader, &line);
         if(len < 0){
+            /* A persistent client that went quiet is not an error. */
+            if(len == -EAGAIN || len == -EWOULDBLOCK)
+                return 0;
             MITLogWrite(MITLOG_LEVEL_ERROR, 
                         "read_request_line: Client (file descriptor: %d) "
                         "closed socket before read.", connptr->client_fd);
@@ -66,32 +51,16 @@ static int read_request_line (struct conn_s *connptr)
 
         if(len == 0) return 0;
 
-        if(chomp(connptr->request_line, len) != len){
+        if(chomp(line, len) != len){
+            connptr -> request_line = arena_strdup(connptr -> arena, line);
             break;
         }
-        Free(connptr -> request_line);
     }
     //MITLogWrite(MITLOG_LEVEL_COMMON, "Request (file descriptor %d): %s",
     //            connptr->client_fd, connptr->request_line);
     return 0;
 }
 
-static void free_request_struct (struct request_s *request)
-{
-    if (!request)
-        return;
-
-    Free(request->method);
-    Free(request->protocol);
-
-    if (request->host)
-        Free(request->host);
-    if (request->path)
-        Free(request->path);
-
-    Free(request);
-}
-
 static void strip_username_password (char *host)
 {
     char *p;
@@ -128,30 +97,19 @@ static int strip_return_port (char *host)
     return port;
 }
 
-static int extract_http_url (const char *url, struct request_s *request)
+static int extract_http_url (struct arena_s *arena, const char *url,
+                             struct request_s *request)
 {
     char *p;
-    int len;
     int port;
 
     p = strchr (url, '/');
     if (p != NULL) {
-        len = p - url;
-        request->host = (char *) Malloc (len + 1);
-        memcpy (request->host, url, len);
-        request->host[len] = '\0';
-        request->path = strdup (p);
+        request->host = arena_strndup (arena, url, p - url);
+        request->path = arena_strdup (arena, p);
     } else {
-        request->host = strdup (url);
-        request->path = strdup ("/");
-    }
-
-    if (!request->host || !request->path){
-        if (request->host)
-            Free (request->host);
-        if (request->path)
-            Free (request->path);
-        return -1;
+        request->host = arena_strdup (arena, url);
+        request->path = "/";
     }
 
     strip_username_password (request->host);
@@ -168,43 +126,49 @@ static int extract_http_url (const char *url, struct request_s *request)
     return 0;
 }
 
-static int extract_ssl_url (const char *url, struct request_s *request)
+/* host:port, where host may be a bracketed IPv6 literal. */
+static int extract_ssl_url (struct arena_s *arena, const char *url,
+                            struct request_s *request)
 {
-    request->host = (char *) Malloc(strlen (url) + 1);
-    if (!request->host)
-            return -1;
+    char *colon;
+
+    request->host = arena_strdup (arena, url);
+    strip_username_password (request->host);
 
-    if (sscanf (url, "%[^:]:%d", request->host, &request->port) == 2) ;
-    else if (sscanf(url, "%s", request->host) == 1)
+    colon = strrchr (request->host, ':');
+    if (colon && !strchr (colon, ']')) {
+        *colon = '\0';
+        request->port = atoi (colon + 1);
+    } else {
         request->port = HTTP_PORT_SSL;
-    else {
+    }
+    if (request->host[0] == '[') {
+        request->host++;
+        if ((colon = strchr (request->host, ']')) != NULL)
+            *colon = '\0';
+    }
+
+    if (request->host[0] == '\0' || request->port <= 0
+        || request->port > 65535) {
         MITLogWrite(MITLOG_LEVEL_ERROR, "extract_ssl_url: Can't parse URL.");
-        Free (request->host);
         return -1;
     }
-
-    strip_username_password (request->host);
-
     return 0;
 }
 
-static struct request_s *process_request (struct conn_s *connptr)
+struct request_s *process_request (struct conn_s *connptr)
 {
     char *url;
     struct request_s *request;
     int ret;
-    size_t request_len;
-    request = (struct request_s *)Calloc(1, sizeof(struct request_s));
-    if (!request) return NULL;
-    request_len = strlen (connptr->request_line) + 1;
-    request->method = (char*)Malloc(sizeof(char) * request_len);
-    url = (char*)Malloc(sizeof(char) * request_len);
-    request -> protocol = (char*)Malloc(sizeof(char) * request_len);
-
-    ret = sscanf(connptr->request_line, "%[^ ] %[^ ] %[^ ]",
-                 request->method, url, request->protocol);
+    /* The request and its strings live until the connection is reset. */
+    request = (struct request_s *)arena_calloc(connptr->arena,
+                                               sizeof(struct request_s));
+
+    ret = http_parse_request_line(connptr->request_line, &request->method,
+                                  &url, &request->protocol);
     if (ret == 2 && !strcasecmp(request->method, "GET")){
-        request -> protocol[0] = 0;
+        request -> protocol = "";
         connptr -> protocol.major = 0;
         connptr -> protocol.minor = 9;
     } else if (ret == 3 && !strncasecmp(request->protocol, "HTTP/", 5)){
@@ -222,22 +186,16 @@ static struct request_s *process_request (struct conn_s *connptr)
         goto fail;
     }
 
-    if (!url) {
-        MITLogWrite(MITLOG_LEVEL_ERROR, "process_request: Null URL on file descriptor %d",
-                connptr->client_fd);
-        goto fail;
-    }
-
     if (strncasecmp (url, "http://", 7) == 0){
         char *skipped_type = strstr (url, "//") + 2;
-        if (extract_http_url (skipped_type, request) < 0) {
+        if (extract_http_url (connptr->arena, skipped_type, request) < 0) {
             MITLogWrite(MITLOG_LEVEL_ERROR, "process_request: Could not parse url %s on file descriptor %d",
                     url, connptr->client_fd);
             goto fail;
         }
         connptr -> connect_method = 0;
     } else if (strcmp (request->method, "CONNECT") == 0) {
-        if (extract_ssl_url (url, request) < 0) {
+        if (extract_ssl_url (connptr->arena, url, request) < 0) {
             MITLogWrite(MITLOG_LEVEL_ERROR,  "process_request: Could not parse url %s on file descriptor %d",
                     url, connptr->client_fd);
             goto fail;            
@@ -245,104 +203,68 @@ static struct request_s *process_request (struct conn_s *connptr)
         connptr -> connect_method = 1;
     }
 
-    Free(url);
     return request;
 fail:
-    Free(url);
-    free_request_struct(request);
     return NULL;
 }
 
-static int
-add_header_to_connection (hashmap_t hashofheaders, char *header, size_t len)
+static long get_content_length (struct http_headers_s *headers)
 {
-    char *sep;
-    len -= chomp (header, len);
-    sep = strchr (header, ':');
-    if (!sep)
-        return -1;
-    while (*sep == ':' || *sep == ' ' || *sep == '\t')
-        *sep++ = '\0';
-    len -= sep - header - 1; 
-    return hashmap_insert (hashofheaders, header, sep, len);
-}
-
-static int get_all_headers (int fd, hashmap_t hashofheaders)
-{
-    char *line = NULL;
-    char *header = NULL;
-    char *tmp;
-    ssize_t linelen;
-    ssize_t len = 0;
-    unsigned int double_cgi = 0;
-
-    assert (fd >= 0);
-    assert (hashofheaders != NULL);
-
-    for (;;) {
-        if ((linelen = readline (fd, &line)) <= 0) {
-            Free (header);
-            Free (line);
-            return -1;
-        }
-
-        if (CHECK_CRLF (line, linelen) || !CHECK_LWS (line, linelen)) {
-            if (!double_cgi
-                && len > 0
-                && add_header_to_connection (hashofheaders, header,
-                                             len) < 0) {
-                Free (header);
-                Free (line);
-                return -1;
-            }
-            len = 0;
-        }
-
-        if (CHECK_CRLF (line, linelen)) {
-            Free (header);
-            Free (line);
-            return 0;
-        }
+    char *data;
+    long content_length = -1;
 
-        if (linelen >= 5 && strncasecmp (line, "HTTP/", 5) == 0) {
-            double_cgi = 1;
-        }
+    data = http_header_get (headers, "Content-Length");
+    if (data)
+        content_length = atol (data);
 
-        tmp = (char *) Realloc (header, len + linelen);
-        if (tmp == NULL) {
-                Free (header);
-                Free (line);
-                return -1;
-        }
-        header = tmp;
-        memcpy (header + len, line, linelen);
-        len += linelen;
-        Free (line);
-    }
+    return content_length;
 }
 
-static long get_content_length (hashmap_t hashofheaders)
+/*
+ * Append a "name: value" line for every header to buffer, formatted in
+ * one piece (on the stack unless the headers are unusually large).
+ */
+static int emit_headers (struct buffer_s *buffer,
+                         struct http_headers_s *headers)
 {
-    ssize_t len;
-    char *data;
-    long content_length = -1;
-    len = hashmap_entry_by_key (hashofheaders, "Content-Length",
-                                (void **) &data);
-    if (len > 0)
-        content_length = atol (data);
+    char stack[4096];
+    char *out = stack, *p;
+    size_t size = 0;
+    unsigned int i;
+    int ret;
 
-    return content_length;
+    for (i = 0; i != headers->count; i++)
+        size += headers->fields[i].namelen + headers->fields[i].valuelen + 4;
+    if (size == 0)
+        return 0;
+    if (size > sizeof (stack))
+        out = (char *) Malloc (size);
+
+    for (p = out, i = 0; i != headers->count; i++) {
+        memcpy (p, headers->fields[i].name, headers->fields[i].namelen);
+        p += headers->fields[i].namelen;
+        *p++ = ':';
+        *p++ = ' ';
+        memcpy (p, headers->fields[i].value, headers->fields[i].valuelen);
+        p += headers->fields[i].valuelen;
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    ret = add_to_buffer (buffer, out, size);
+    if (out != stack)
+        Free (out);
+    return ret;
 }
 
-static int pull_client_data (struct conn_s *connptr, long int length)
+int pull_client_data (struct conn_s *connptr, long int length)
 {
     char *buffer;
     ssize_t len;
     buffer = (char *)Malloc(min(MAXBUFFSIZE, (unsigned long int)length));
     if(!buffer) return -1;
     do{
-        len = safe_read(connptr->client_fd, buffer,
-                        min(MAXBUFFSIZE, (unsigned long int)length));
+        len = reader_read(connptr->creader, buffer,
+                          min(MAXBUFFSIZE, (unsigned long int)length));
         if(len <= 0){
             Free(buffer);
             return -1;
@@ -351,38 +273,31 @@ static int pull_client_data (struct conn_s *connptr, long int length)
         length -= len;
     }while(length > 0);
 
-    socket_nonblocking (connptr->client_fd);
-    len = recv(connptr->client_fd, buffer, 2, MSG_PEEK);
-    socket_blocking (connptr->client_fd);
-
-    if (len < 0 && errno != EAGAIN){
-        Free(buffer);
-        return -1;
-    }
-
-    if ((len == 2) && CHECK_CRLF (buffer, len)) {
-        ssize_t ret;
-        ret = read (connptr->client_fd, buffer, 2);
-        if (ret == -1) {
-            MITLogWrite(MITLOG_LEVEL_ERROR, "Could not read two bytes from POST message");
-        }
-    }
-
+    /*
+     * A stray CRLF some clients send after a body is skipped along with
+     * other blank lines before the next request line.
+     */
     Free(buffer);
     return 0;
 }
 
-static int
-process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders,
+int
+process_client_headers (struct conn_s *connptr,
+                        struct http_headers_s *headers,
                         struct request_s* request)
 {
+    /*
+     * Expect goes too: the whole body is read from the client before
+     * the request is sent on, so there is nothing for a 100 Continue
+     * to hold back.
+     */
     static const char* skipheaders[] = {"Host", "Connection", "Proxy-Connection",
+                                        "Keep-Alive", "TE", "Upgrade", "Expect",
                                         "Accept", "Accept-Encoding", "User-Agent"};
     int i;
-    hashmap_iter iter;
-    char *data, *header;
     size_t size;
     char* buffer_line = NULL;
+    char *data;
     char portbuff[7];
 
     if (request->port != HTTP_PORT && request->port != HTTP_PORT_SSL)
@@ -391,9 +306,14 @@ process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders,
         portbuff[0] = '\0';
     
 
+    /*
+     * HTTP/1.1 only when we will read the response to its end ourselves,
+     * since the origin may then answer with chunked encoding.
+     */
     size = strlen(request -> method) + strlen(request -> path) + 13;
     buffer_line = (char*)Malloc(size);
-    snprintf(buffer_line, size, "%s %s HTTP/1.0\r\n", request -> method, request -> path);
+    snprintf(buffer_line, size, "%s %s HTTP/1.%d\r\n", request -> method,
+             request -> path, connptr->keepalive.server ? 1 : 0);
     add_to_buffer_primary(connptr -> cbuffer, buffer_line, size - 1, 1);
     Free(buffer_line);
 
@@ -403,37 +323,69 @@ process_client_headers (struct conn_s *connptr, hashmap_t hashofheaders,
     add_to_buffer_primary(connptr -> cbuffer, buffer_line, size - 1, 1);
     Free(buffer_line);
 
-    add_to_buffer(connptr -> cbuffer, "Connection: close\r\n", 19);
-    add_to_buffer(connptr -> cbuffer, "Proxy-Connection: close\r\n", 25);
+    if (connptr->keepalive.server) {
+        add_to_buffer(connptr -> cbuffer, "Connection: keep-alive\r\n", 24);
+    } else {
+        add_to_buffer(connptr -> cbuffer, "Connection: close\r\n", 19);
+        add_to_buffer(connptr -> cbuffer, "Proxy-Connection: close\r\n", 25);
+    }
     add_to_buffer(connptr -> cbuffer, "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n", 86);
     add_to_buffer(connptr -> cbuffer, "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n", 73);
     add_to_buffer(connptr -> cbuffer, "Accept-Encoding: gzip, deflate\r\n", 32);
 
 
-    connptr->content_length.client = get_content_length (hashofheaders);
+    connptr->content_length.client = get_content_length (headers);
+    fresh_request (headers, &connptr->freshreq);
+
+    /*
+     * The client's validators are held back: if we have a stale copy we
+     * send our own instead.  headers only lasts until the body is read.
+     */
+    if ((data = http_header_get (headers, "If-None-Match")) != NULL)
+        connptr->cond.etag = arena_strdup (connptr->arena, data);
+    if ((data = http_header_get (headers, "If-Modified-Since")) != NULL)
+        connptr->cond.since = arena_strdup (connptr->arena, data);
+    http_header_remove (headers, "If-None-Match");
+    http_header_remove (headers, "If-Modified-Since");
+
     for (i = 0; i != (sizeof (skipheaders) / sizeof (char *)); i++) {
-        hashmap_remove(hashofheaders, skipheaders[i]);
-    }
-
-    iter = hashmap_first (hashofheaders);
-    if (iter >= 0) {
-        for (; !hashmap_is_end (hashofheaders, iter); ++iter) {
-            hashmap_return_entry (hashofheaders,
-                                  iter, &data, (void **) &header);
-            size = strlen(data) + strlen(header) + 5;
-            buffer_line = (char*)Malloc(sizeof(char) * size);
-            snprintf(buffer_line, size, "%s: %s\r\n", data, header);
-            add_to_buffer(connptr -> cbuffer, buffer_line, size - 1);
-            Free(buffer_line);
-        }
+        http_header_remove(headers, skipheaders[i]);
     }
+    emit_headers (connptr -> cbuffer, headers);
+    return 0;
+}
 
-    add_to_buffer(connptr -> cbuffer, "\r\n", 2);
-    if (connptr->content_length.client > 0) {
-        return pull_client_data (connptr,connptr->content_length.client);
-    }
+/*
+ * Finish the request head in cbuffer: validators, ours for revalidating
+ * a stale copy or else whatever the client sent, then the blank line.
+ */
+int end_client_headers (struct conn_s *connptr, const char *etag,
+                        const char *since)
+{
+    static const char* names[] = {"If-None-Match", "If-Modified-Since"};
+    const char *values[2];
+    char *buffer_line;
+    size_t size;
+    int i, ret = 0;
 
-    return 0;
+    if (etag == NULL && since == NULL) {
+        etag = connptr->cond.etag;
+        since = connptr->cond.since;
+    }
+    values[0] = etag;
+    values[1] = since;
+    for (i = 0; i != 2 && ret == 0; i++) {
+        if (values[i] == NULL)
+            continue;
+        size = strlen (names[i]) + strlen (values[i]) + 5;
+        buffer_line = (char *) Malloc (size);
+        snprintf (buffer_line, size, "%s: %s\r\n", names[i], values[i]);
+        ret = add_to_buffer (connptr->cbuffer, buffer_line, size - 1);
+        Free (buffer_line);
+    }
+    if (ret < 0)
+        return -1;
+    return add_to_buffer (connptr->cbuffer, "\r\n", 2) < 0 ? -1 : 0;
 }
 
 int getsock_ip (int fd, char *ipaddr)
@@ -456,239 +408,824 @@ int getsock_ip (int fd, char *ipaddr)
     return 0;
 }
 
-static int process_server_headers (struct conn_s *connptr)
+/*
+ * Whether the origin agreed to keep the connection open: an HTTP/1.1
+ * origin does unless it says close, an HTTP/1.0 one only if it says
+ * keep-alive.
+ */
+static unsigned int server_keepalive (struct http_headers_s *headers,
+                                      unsigned int major, unsigned int minor)
 {
-    char *response_line;
-    hashmap_t hashofheaders;
-    hashmap_iter iter;
-    char *line, *data, *header;
-    ssize_t len, size;
-    int ret = 0;
+    if (http_header_has_token (headers, "Connection", "close"))
+        return 0;
+    if (major > 1 || (major == 1 && minor >= 1))
+        return 1;
+    return http_header_has_token (headers, "Connection", "keep-alive");
+}
 
-    while(1){
-        len = readline (connptr->server_fd, &response_line);
-        if(len < 0) return -1;
-        if(len == 0){
-            add_to_buffer(connptr -> sbuffer, "\r\n", 2);
+static unsigned int client_http11 (struct conn_s *connptr)
+{
+    return connptr->protocol.major > 1
+           || (connptr->protocol.major == 1 && connptr->protocol.minor >= 1);
+}
+
+/*
+ * Whether the client wants its connection kept open: HTTP/1.1 unless
+ * it says close, HTTP/1.0 only if it asks for keep-alive.  A request
+ * body we cannot frame rules it out, since the rest of the stream
+ * could not be told apart from the next request.
+ */
+static unsigned int client_keepalive (struct conn_s *connptr,
+                                      struct http_headers_s *headers)
+{
+    static const char* names[] = {"Connection", "Proxy-Connection"};
+    unsigned int keep;
+    int i;
+
+    if (http_header_get (headers, "Transfer-Encoding"))
+        return 0;
+    keep = client_http11 (connptr);
+    for (i = 0; i != (sizeof (names) / sizeof (char *)); i++) {
+        if (http_header_has_token (headers, names[i], "close"))
             return 0;
+        if (http_header_has_token (headers, names[i], "keep-alive"))
+            keep = 1;
+    }
+    return keep;
+}
+
+/* Hop-by-hop response headers, never passed on or cached. */
+static const char* hop_headers[] = {"Connection", "Keep-Alive",
+                                    "Proxy-Connection"};
+
+/*
+ * Read the status line and headers of the origin's response into
+ * sbuffer, and judge whether it may be cached.  stored holds the
+ * headers of the stale copy being revalidated, if any.  Returns -1 if
+ * the origin closed or failed before sending a status line, which on a
+ * pooled connection just means it went stale and the request may be
+ * retried; other errors are below -1.  Interim 1xx responses other
+ * than 101 are read past; the one that follows is the real response.
+ */
+static int process_server_headers (struct conn_s *connptr,
+                                   struct http_headers_s *stored)
+{
+    char *response_line, *block;
+    struct http_headers_s headers;
+    ssize_t len;
+    unsigned int major, minor;
+    int i, interim = 0;
+
+    for (;;) {
+        do {
+            len = reader_line (connptr->sreader, &response_line);
+            if(len <= 0) return interim ? -3 : -1;
+        } while (chomp (response_line, len) == len);
+
+        if (connptr->protocol.major < 1)
+            return -4;
+        if (sscanf (response_line, "HTTP/%u.%u %d", &major, &minor,
+                    &connptr->status) != 3) {
+            MITLogWrite(MITLOG_LEVEL_ERROR, "Bad status line from the remote server.");
+            return -5;
         }
-        
-        if (chomp (response_line, len) != len) {
-            hashofheaders = hashmap_create (HEADER_BUCKETS);
-            if (!hashofheaders) {
-                Free(response_line);
-                return -2;
-            }
-            if (get_all_headers (connptr->server_fd, hashofheaders) < 0) {
-                MITLogWrite(MITLOG_LEVEL_ERROR, "Could not retrieve all the headers from the remote server.");
-                hashmap_delete (hashofheaders);
-                Free(response_line);
-                return -3;
-            }
-            if (connptr->protocol.major < 1) {
-                hashmap_delete (hashofheaders);
-                Free(response_line);
-                return -4;
-            }
+        if (connptr->status / 100 != 1 || connptr->status == 101)
+            break;
 
-            line = (char*)Malloc(strlen(response_line) + 3);
-            snprintf(line, strlen(response_line) + 3, "%s\r\n", response_line);
-            add_to_buffer(connptr -> sbuffer, line, strlen(response_line) + 2);
-            Free(line);
+        len = reader_head (connptr->sreader, &block);
+        if (len <= 0)
+            return -3;
+        interim = 1;
+    }
 
-            if(ret < 0){
-                hashmap_delete(hashofheaders);
-                Free(response_line);
-                return -5;
-            }
+    /* Taken before the headers are read, which may move the line. */
+    add_to_buffer(connptr -> sbuffer, response_line, strlen(response_line));
+    add_to_buffer(connptr -> sbuffer, "\r\n", 2);
 
-            connptr->content_length.server = get_content_length (hashofheaders);
-       
-            iter = hashmap_first (hashofheaders);
-
-            if (iter >= 0) {
-                for (; !hashmap_is_end (hashofheaders, iter); ++iter) {
-                    hashmap_return_entry (hashofheaders,
-                                          iter, &data, (void **) &header);
-                    size = strlen(data) + strlen(header) + 5;
-                    line = (char*)Malloc(sizeof(char) * size);
-                    snprintf(line, size, "%s: %s\r\n", data, header);
-                    add_to_buffer(connptr -> sbuffer, line, size - 1);
-                    Free(line);
-
-                    if(ret < 0){
-                        hashmap_delete(hashofheaders);
-                        Free(response_line);
-                        return -6;
-                    }
-                }
-            }
-            hashmap_delete (hashofheaders);
-            Free(response_line);
+    len = reader_head (connptr->sreader, &block);
+    if (len <= 0 || http_parse_headers (block, len, &headers) < 0) {
+        MITLogWrite(MITLOG_LEVEL_ERROR, "Could not retrieve all the headers from the remote server.");
+        return -3;
+    }
 
-            add_to_buffer(connptr -> sbuffer, "\r\n", 2);
-            return 0;
+    connptr->content_length.server = get_content_length (&headers);
+    connptr->keepalive.server = connptr->keepalive.server
+                                && server_keepalive (&headers, major, minor);
+    fresh_response (connptr->status, &headers,
+                    connptr->status == 304 ? stored : NULL,
+                    &connptr->freshreq, time (NULL), &connptr->freshresp);
+
+    /*
+     * Transfer-Encoding is hop-by-hop like Connection: a chunked body is
+     * decoded here and framed again for the client, and it overrides
+     * any Content-Length.  Any other coding runs to EOF untouched.
+     */
+    if (http_header_get (&headers, "Transfer-Encoding")) {
+        connptr->content_length.server = -1;
+        http_header_remove (&headers, "Content-Length");
+        if (http_header_has_token (&headers, "Transfer-Encoding", "chunked")) {
+            connptr->chunked.server = 1;
+            http_header_remove (&headers, "Transfer-Encoding");
+        } else {
+            connptr->keepalive.server = 0;
         }
+    }
+    for (i = 0; i != (sizeof (hop_headers) / sizeof (char *)); i++) {
+        http_header_remove(&headers, hop_headers[i]);
+    }
+    emit_headers (connptr -> sbuffer, &headers);
+
+    /*
+     * Connection is hop-by-hop, so it is left out here (and of what
+     * gets cached) and added by send_response().
+     */
+    add_to_buffer(connptr -> sbuffer, "\r\n", 2);
+    return 0;
+}
+
+/* Responses that never carry a body, whatever their headers say. */
+static int response_has_body (struct conn_s *connptr,
+                              struct request_s *request)
+{
+    if (!strcasecmp (request->method, "HEAD"))
+        return 0;
+    return !((connptr->status >= 100 && connptr->status < 200)
+             || connptr->status == 204 || connptr->status == 304);
+}
 
-        Free(response_line);
+/*
+ * Send a response head, or a whole cached response, to the client with
+ * our own Connection header, and Transfer-Encoding if we are chunking
+ * the body, put right after the status line.
+ */
+static int send_response(struct conn_s *connptr, const char *data, size_t len)
+{
+    static const char keep[] = "Connection: keep-alive\r\n";
+    static const char close[] = "Connection: close\r\n";
+    static const char chunked[] = "Transfer-Encoding: chunked\r\n";
+    const char *nl = (const char *)memchr(data, '\n', len);
+    size_t first = nl ? nl - data + 1 : len;
+    struct iovec iov[4];
+
+    iov[0].iov_base = (void *)data;
+    iov[0].iov_len = first;
+    iov[1].iov_base = (void *)(connptr -> keepalive.client ? keep : close);
+    iov[1].iov_len = connptr -> keepalive.client ? sizeof(keep) - 1
+                                                 : sizeof(close) - 1;
+    iov[2].iov_base = (void *)chunked;
+    iov[2].iov_len = connptr -> chunked.client ? sizeof(chunked) - 1 : 0;
+    iov[3].iov_base = (void *)(data + first);
+    iov[3].iov_len = len - first;
+    return safe_writev(connptr -> client_fd, iov, 4) < 0 ? -1 : 0;
+}
+
+/*
+ * A response captured in buffer, head first, as it goes into the
+ * cache.  A body that was not framed by a Content-Length (the origin
+ * closed, or chunked it) gets one, so a cached copy can always be sent
+ * on a persistent connection.
+ */
+static char *frame_response(struct buffer_s *buffer, size_t headlen,
+                            int framed_already, size_t *len)
+{
+    char *value, *framed, *nl;
+    char header[48];
+    size_t first, hlen;
+
+    buffer_to_str(buffer, &value);
+    *len = buffer_size(buffer);
+    if(framed_already)
+        return value;
+
+    nl = (char *)memchr(value, '\n', *len);
+    first = nl - value + 1;
+    hlen = snprintf(header, sizeof(header), "Content-Length: %lu\r\n",
+                    (unsigned long)(*len - headlen));
+    framed = (char *)Malloc(*len + hlen + 1);
+    memcpy(framed, value, first);
+    memcpy(framed + first, header, hlen);
+    memcpy(framed + first + hlen, value + first, *len - first + 1);
+    Free(value);
+    *len += hlen;
+    return framed;
+}
+
+/* The response captured in sbuffer by process_server_headers() on. */
+static char *cacheable_response(struct conn_s *connptr, size_t headlen,
+                                int has_body, size_t *len)
+{
+    return frame_response(connptr -> sbuffer, headlen,
+                          connptr -> content_length.server >= 0 || !has_body,
+                          len);
+}
+
+/*
+ * The same for a response captured in sbuffer just as the origin sent
+ * it, as the event engine does: the head loses the same hop-by-hop
+ * headers process_server_headers() drops, so either engine can serve
+ * what the other cached.  NULL if the head does not parse, or if the
+ * body carries a transfer coding we did not undo.
+ */
+char *cacheable_raw_response(struct conn_s *connptr,
+                             struct request_s *request, size_t *len)
+{
+    struct http_headers_s headers;
+    struct buffer_s *response;
+    char *raw, *block, *end, *value = NULL;
+    size_t rawlen = buffer_size(connptr -> sbuffer), headlen;
+    int i, framed;
+
+    buffer_to_str(connptr -> sbuffer, &raw);
+    block = (char *)memchr(raw, '\n', rawlen);
+    end = strstr(raw, "\r\n\r\n");
+    if(!block || !end || block > end + 3
+       || http_parse_headers(block + 1, end + 4 - (block + 1), &headers) < 0
+       || http_header_get(&headers, "Transfer-Encoding")){
+        Free(raw);
+        return NULL;
     }
-    return -8;
+
+    response = new_buffer();
+    add_to_buffer(response, raw, block + 1 - raw);
+    for(i = 0; i != (sizeof(hop_headers) / sizeof(char *)); i++)
+        http_header_remove(&headers, hop_headers[i]);
+    emit_headers(response, &headers);
+    add_to_buffer(response, "\r\n", 2);
+    headlen = buffer_size(response);
+    framed = http_header_get(&headers, "Content-Length") != NULL
+             || !response_has_body(connptr, request);
+    if(add_to_buffer(response, end + 4, raw + rawlen - (end + 4)) == 0)
+        value = frame_response(response, headlen, framed, len);
+    delete_buffer(response);
+    Free(raw);
+    return value;
 }
 
-static int pull_server_data(struct conn_s *connptr)
+/*
+ * Pass a piece of the body on to the client, as a chunk of its own if
+ * the client is getting chunked encoding.
+ */
+static int send_body(struct conn_s *connptr, char *data, size_t len)
 {
-    char *buffer;
+    static char crlf[] = "\r\n";
+    char size[24];
+    struct iovec iov[3];
+
+    if(!connptr -> chunked.client)
+        return safe_write(connptr -> client_fd, data, len) < 0 ? -1 : 0;
+
+    iov[0].iov_base = size;
+    iov[0].iov_len = snprintf(size, sizeof(size), "%lx\r\n",
+                              (unsigned long)len);
+    iov[1].iov_base = data;
+    iov[1].iov_len = len;
+    iov[2].iov_base = crlf;
+    iov[2].iov_len = 2;
+    return safe_writev(connptr -> client_fd, iov, 3) < 0 ? -1 : 0;
+}
+
+/*
+ * Keep a copy of the body in sbuffer for the cache until it would grow
+ * past cache_object_limit(); after that the copy is dropped.
+ */
+static void capture_body(struct conn_s *connptr, int *capture, char *data,
+                         size_t len)
+{
+    if(!*capture)
+        return;
+    if(buffer_size(connptr -> sbuffer) + len > cache_object_limit()){
+        clear_buffer(connptr -> sbuffer);
+        *capture = 0;
+    } else {
+        add_to_buffer(connptr -> sbuffer, data, len);
+    }
+}
+
+/*
+ * A body framed by Content-Length (left bytes) or by the origin
+ * closing (left is -1).  Once nothing is being captured and the reader
+ * has nothing buffered, the rest is spliced from socket to socket
+ * without being copied through here at all, unless it has to be cut
+ * into chunks for the client.
+ */
+static int relay_plain(struct conn_s *connptr, char *buffer, size_t length,
+                       long int left, int *capture)
+{
+    ssize_t len;
+    int nosplice = connptr -> chunked.client;
+
+    while(left != 0){
+        if(!*capture && !nosplice && reader_pending(connptr -> sreader) == 0){
+            len = splice_relay(connptr -> server_fd, connptr -> client_fd,
+                               left);
+            if(len != -EINVAL)
+                return len < 0 || (left > 0 && len < left) ? -1 : 0;
+            nosplice = 1;
+        }
+
+        len = reader_read(connptr->sreader, buffer,
+                          left > 0 ? min(length, left) : length);
+        if(len < 0)
+            return -1;
+        /* Short of Content-Length means a truncated response. */
+        if(len == 0)
+            return left > 0 ? -1 : 0;
+        if(left > 0)
+            left -= len;
+
+        if(send_body(connptr, buffer, len) < 0)
+            return -1;
+        capture_body(connptr, capture, buffer, len);
+    }
+    return 0;
+}
+
+/*
+ * A chunked body, decoded as it arrives: each chunk's data is passed on
+ * and captured, and the chunk framing, extensions and trailers are
+ * ours to drop.  Returns 0 once the last chunk has been read.
+ */
+static int relay_chunked(struct conn_s *connptr, char *buffer, size_t length,
+                         int *capture)
+{
+    char *line, *end;
+    unsigned long size;
     ssize_t len;
-    ssize_t length = MAXBUFFSIZE;
+
+    while(1){
+        len = reader_line(connptr -> sreader, &line);
+        if(len <= 0)
+            return -1;
+        size = strtoul(line, &end, 16);
+        if(end == line || (*end != ';' && *end != '\r' && *end != '\n'
+                           && *end != ' ' && *end != '\t')){
+            MITLogWrite(MITLOG_LEVEL_ERROR, "Bad chunk size from the remote server.");
+            return -1;
+        }
+        if(size == 0)
+            break;
+
+        while(size > 0){
+            len = reader_read(connptr -> sreader, buffer, min(length, size));
+            if(len <= 0)
+                return -1;
+            size -= len;
+            if(send_body(connptr, buffer, len) < 0)
+                return -1;
+            capture_body(connptr, capture, buffer, len);
+        }
+
+        /* The data is followed by a bare CRLF. */
+        len = reader_line(connptr -> sreader, &line);
+        if(len <= 0 || chomp(line, len) != len)
+            return -1;
+    }
+
+    /* Trailers, up to the blank line that ends the message. */
+    do {
+        len = reader_line(connptr -> sreader, &line);
+        if(len <= 0)
+            return -1;
+    } while(chomp(line, len) != len);
+    return 0;
+}
+
+/*
+ * Forward the response body to the client as it arrives, framed the
+ * way the origin framed it: a Content-Length body is read to exactly
+ * that length and a chunked one to its last chunk, so in both cases
+ * the origin connection can be reused.  Without either the body runs
+ * to EOF and the connection cannot.  A Content-Length that is already
+ * too big for the cache skips the copy from the start.  Returns 1 if
+ * the whole response was captured, 0 if it was not, and -1 on error.
+ */
+static int relay_server_data(struct conn_s *connptr, struct request_s *request)
+{
+    static const char last_chunk[] = "0\r\n\r\n";
+    char *buffer;
+    size_t length = MAXBUFFSIZE;
+    long int left = -1;
+    int capture = buffer_size(connptr -> sbuffer) <= cache_object_limit();
+    int ret;
+
+    if(!response_has_body(connptr, request))
+        return capture;
+    if(connptr -> content_length.server >= 0){
+        left = connptr -> content_length.server;
+        if(buffer_size(connptr -> sbuffer) + left > cache_object_limit()){
+            clear_buffer(connptr -> sbuffer);
+            capture = 0;
+        }
+    } else if(!connptr -> chunked.server) {
+        connptr -> keepalive.server = 0;
+    }
+
     buffer = (char *)Malloc(length);
     if(!buffer) return -1;
+    if(connptr -> chunked.server)
+        ret = relay_chunked(connptr, buffer, length, &capture);
+    else
+        ret = relay_plain(connptr, buffer, length, left, &capture);
+    Free(buffer);
+
+    if(ret == 0 && connptr -> chunked.client
+       && safe_write(connptr -> client_fd, last_chunk,
+                     sizeof(last_chunk) - 1) < 0)
+        ret = -1;
+    return ret < 0 ? -1 : capture;
+}
+
+/*
+ * Send the request in cbuffer to the origin and read the response
+ * headers, over a pooled connection when there is one.  A pooled
+ * connection can have been closed by the origin at any moment, so a
+ * failure before the status line is retried once on a fresh connection
+ * for requests that are safe to repeat.
+ */
+static int open_server_exchange(struct conn_s *connptr,
+                                struct request_s *request,
+                                struct http_headers_s *stored)
+{
+    int reused;
+    int ret;
+    int retry = !strcasecmp(request -> method, "GET")
+                || !strcasecmp(request -> method, "HEAD");
+
     while(1){
-        len = safe_read(connptr->server_fd, buffer, length);
-        if(len < 0){
-            Free(buffer);
+        connptr -> state = CONN_CONNECT_UPSTREAM;
+        connptr -> server_fd = upstream_get(request -> host, request -> port,
+                                            &reused);
+        if(connptr -> server_fd < 0){
+            MITLogWrite(MITLOG_LEVEL_ERROR, "open server socket error!");
             return -1;
         }
+        reader_reset(connptr -> sreader, connptr -> server_fd);
 
-        if(len == 0){
-            Free(buffer);
+        MITLogWrite(MITLOG_LEVEL_COMMON, "Cache miss for client fd %d. %s connection to host \"%s\" using "
+           "file descriptor %d.", connptr -> client_fd,
+           reused ? "Reusing" : "Established", request->host,
+           connptr -> server_fd);
+
+        connptr -> keepalive.server = 1;
+        if(write_buffer(connptr -> cbuffer, connptr -> server_fd) < 0)
+            ret = -1;
+        else{
+            connptr -> state = CONN_RELAY;
+            ret = process_server_headers(connptr, stored);
+        }
+        if(ret == 0)
             return 0;
+
+        Close(connptr -> server_fd);
+        connptr -> server_fd = -1;
+        if(ret != -1 || !reused || !retry){
+            MITLogWrite(MITLOG_LEVEL_ERROR, "process_server_headers error");
+            return -1;
         }
-        add_to_buffer(connptr -> sbuffer, buffer, len);
+        clear_buffer(connptr -> sbuffer);
+        retry = 0;
     }
-    return 0;
 }
 
+/* Only these consult the cache; anything else goes to the origin. */
+static int cacheable_method(struct request_s *request)
+{
+    return !strcasecmp(request -> method, "GET")
+           || !strcasecmp(request -> method, "HEAD");
+}
+
+/*
+ * Answer from the cache while the copy there is fresh, else from the
+ * origin.  A stale copy of a GET that has an ETag or Last-Modified is
+ * revalidated: the request goes out conditional on it, and if the
+ * origin answers 304 the copy is sent as it is and good for longer.
+ */
 static int send_client_request(struct conn_s *connptr, struct request_s *request)
 {
     char* key = NULL;
     buffer_to_key(connptr -> cbuffer, &key);
     char* value = NULL;
+    struct cache_object_s* object = NULL;
+    struct cache_object_s* stale = NULL;
+    struct http_headers_s stored;
+    char *stored_copy = NULL;
+    const char *etag = NULL, *since = NULL;
+    size_t headlen, len;
+    int captured;
+    int leader = 0;
     
-    cache_query(CACHE, key, (void **)&value);
-    if(value == NULL){
-        connptr -> server_fd = opensock(request -> host, request -> port);
-        if(connptr -> server_fd < 0){
-            MITLogWrite(MITLOG_LEVEL_ERROR, "open server socket error!");
-            goto fail;
+    /* Only GETs are coalesced: anything else may not be repeatable. */
+    if(!strcasecmp(request -> method, "GET"))
+        object = cache_query_or_lead(CACHE, key, &leader);
+    else if(cacheable_method(request))
+        object = cache_query(CACHE, key);
+    if(object && (connptr -> freshreq.reload
+                  || !cache_object_fresh(object, time(NULL)))){
+        stale = object;
+        object = NULL;
+        if(!strcasecmp(request -> method, "GET")
+           && fresh_stored_headers(stale -> data, stale -> len,
+                                   &stored_copy, &stored) == 0){
+            etag = http_header_get(&stored, "ETag");
+            since = http_header_get(&stored, "Last-Modified");
+            if(!etag && !since){
+                Free(stored_copy);
+                stored_copy = NULL;
+            }
         }
-       
-        MITLogWrite(MITLOG_LEVEL_COMMON, "Cache miss for client fd %d. Established connection to host \"%s\" using "
-           "file descriptor %d.", connptr -> client_fd, request->host,
-           connptr -> server_fd);
-        
-        if(write_buffer(connptr -> cbuffer, connptr -> server_fd) < 0)
-            goto fail;
+    }
 
-        if(process_server_headers(connptr) < 0){
-            MITLogWrite(MITLOG_LEVEL_ERROR, "process_server_headers error");
+    if(end_client_headers(connptr, etag, since) < 0
+       || (connptr -> content_length.client > 0
+           && pull_client_data(connptr, connptr -> content_length.client) < 0)){
+        MITLogWrite(MITLOG_LEVEL_ERROR, "failed to read the request body");
+        goto fail;
+    }
+
+    if(object == NULL){
+        if(open_server_exchange(connptr, request,
+                                stored_copy ? &stored : NULL) < 0)
             goto fail;
+
+        if(stored_copy && connptr -> status == 304){
+            if(connptr -> keepalive.server
+               && reader_pending(connptr -> sreader) == 0){
+                upstream_put(request -> host, request -> port,
+                             connptr -> server_fd);
+                connptr -> server_fd = -1;
+            }
+            if(connptr -> freshresp.storable)
+                cache_refresh(CACHE, key, stale, connptr -> freshresp.expires);
+            clear_buffer(connptr -> sbuffer);
+
+            MITLogWrite(MITLOG_LEVEL_COMMON, "cache revalidated for client fd %d, host \"%s\"",
+                        connptr -> client_fd, request -> host);
+            if(send_response(connptr, stale -> data, stale -> len) < 0)
+                goto fail;
+            goto done;
         }
 
-        if(pull_server_data(connptr) < 0){
-            MITLogWrite(MITLOG_LEVEL_ERROR, "pull_server_data error");
-            goto fail;
+        /*
+         * Without a length the client can only see the end as a close,
+         * unless it understands chunks.
+         */
+        if(connptr -> content_length.server < 0
+           && response_has_body(connptr, request)){
+            if(client_http11(connptr))
+                connptr -> chunked.client = 1;
+            else
+                connptr -> keepalive.client = 0;
         }
+
+        /* The client gets the headers before the body is read. */
+        headlen = buffer_size(connptr -> sbuffer);
         buffer_to_str(connptr -> sbuffer, &value);
-        cache_update(CACHE, key, value, strlen(value));
+        if(send_response(connptr, value, headlen) < 0){
+            Free(value);
+            goto fail;
+        }
         Free(value);
 
+        if((captured = relay_server_data(connptr, request)) < 0){
+            MITLogWrite(MITLOG_LEVEL_ERROR, "relay_server_data error");
+            goto fail;
+        }
+        /* Anything past the response means the origin is confused. */
+        if(connptr -> keepalive.server
+           && reader_pending(connptr -> sreader) == 0){
+            upstream_put(request -> host, request -> port,
+                         connptr -> server_fd);
+            connptr -> server_fd = -1;
+        }
+        /*
+         * A 304 here answered the client's validators, not ours.  Any
+         * other response replaces what was cached, even if it cannot be
+         * kept itself.
+         */
+        if(cacheable_method(request) && connptr -> status != 304){
+            if(captured && connptr -> freshresp.storable){
+                value = cacheable_response(connptr, headlen,
+                                           response_has_body(connptr, request),
+                                           &len);
+                cache_update(CACHE, key, value, len,
+                             connptr -> freshresp.expires);
+                Free(value);
+            } else {
+                cache_remove(CACHE, key);
+            }
+        }
+        if(leader){
+            cache_flight_end(CACHE, key);
+            leader = 0;
+        }
+
     } else {
         MITLogWrite(MITLOG_LEVEL_COMMON, "cache hit for client fd %d, host \"%s\"",
                     connptr -> client_fd, request -> host);
-        buffer_from_str(connptr -> sbuffer, value);
+        connptr -> state = CONN_RELAY;
+        /* The cached object already is the whole response. */
+        if(send_response(connptr, object -> data, object -> len) < 0){
+            cache_release(object);
+            goto fail;
+        }
+        cache_release(object);
     }
 
-
-    if(write_buffer(connptr -> sbuffer, connptr -> client_fd) < 0)
-        goto fail;
-
+done:
+    connptr -> state = CONN_DONE;
+    if(stale)
+        cache_release(stale);
+    if(stored_copy)
+        Free(stored_copy);
     Free(key);
     return 0;
 
 fail:        
+    if(leader)
+        cache_flight_end(CACHE, key);
+    if(stale)
+        cache_release(stale);
+    if(stored_copy)
+        Free(stored_copy);
     if(key)Free(key);
     return -1;
 }
 
-void handle_connection(int fd)
+/*
+ * CONNECT: open the origin, tell the client it can go ahead, and relay
+ * bytes both ways until either side is done with them.  The request's
+ * headers are meant for us and go nowhere; anything the client sent
+ * after them is already for the origin.  The connection is not reused
+ * afterwards.
+ */
+static int handle_connect(struct conn_s *connptr, struct request_s *request)
 {
-    struct conn_s *connptr;
-    struct request_s *request = NULL;
-    hashmap_t hashofheaders = NULL;
+    static const char established[] =
+        "HTTP/1.1 200 Connection established\r\n\r\n";
+    static const char bad_gateway[] =
+        "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n"
+        "Connection: close\r\n\r\n";
+    static const char forbidden[] =
+        "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\n"
+        "Connection: close\r\n\r\n";
+    char buffer[READER_SIZE];
+    char *block;
+    ssize_t len;
 
-    char sock_ipaddr[IP_LENGTH];
-    char peer_ipaddr[IP_LENGTH];
-    char peer_string[HOSTNAME_LENGTH];
-    
-    getpeer_information (fd, peer_ipaddr, peer_string);
-    getsock_ip (fd, sock_ipaddr);
+    connptr -> state = CONN_READ_HEADERS;
+    if(reader_head(connptr -> creader, &block) <= 0){
+        MITLogWrite(MITLOG_LEVEL_ERROR, "failed to get all headers");
+        return -1;
+    }
 
-    //MITLogWrite(MITLOG_LEVEL_COMMON, "Connect (file descriptor %d): %s [%s] at [%s]",
-    //       fd, peer_string, peer_ipaddr, sock_ipaddr);
+    if(!tunnel_port_allowed(request -> port)){
+        MITLogWrite(MITLOG_LEVEL_ERROR, "CONNECT to %s:%d refused: port not allowed",
+                    request -> host, request -> port);
+        safe_write(connptr -> client_fd, forbidden, sizeof(forbidden) - 1);
+        return -1;
+    }
 
-    connptr = initialize_conn(fd, peer_ipaddr, peer_string, sock_ipaddr);
-    if (!connptr) {
-        Close(fd);
-        return;
+    connptr -> state = CONN_CONNECT_UPSTREAM;
+    connptr -> server_fd = opensock(request -> host, request -> port);
+    if(connptr -> server_fd < 0){
+        MITLogWrite(MITLOG_LEVEL_ERROR, "CONNECT to %s:%d failed",
+                    request -> host, request -> port);
+        safe_write(connptr -> client_fd, bad_gateway, sizeof(bad_gateway) - 1);
+        return -1;
     }
-    
+    MITLogWrite(MITLOG_LEVEL_COMMON, "Tunnel from client fd %d to \"%s:%d\" "
+                "on file descriptor %d.", connptr -> client_fd,
+                request -> host, request -> port, connptr -> server_fd);
+
+    if(safe_write(connptr -> client_fd, established,
+                  sizeof(established) - 1) < 0)
+        return -1;
+    while(reader_pending(connptr -> creader) > 0){
+        len = reader_read(connptr -> creader, buffer, sizeof(buffer));
+        if(len <= 0 || safe_write(connptr -> server_fd, buffer, len) < 0)
+            return -1;
+    }
+
+    connptr -> state = CONN_TUNNEL;
+    return tunnel_run(connptr -> client_fd, connptr -> server_fd);
+}
+
+/*
+ * Serve one request on the connection.  Returns 1 if the connection
+ * can carry another request, 0 if it is done, and -1 on error.
+ * *lingering says whether this worker already holds one of the pool's
+ * places for persistent clients (see child_linger_begin()); it asks for
+ * one before promising the client to keep the connection.
+ */
+static int handle_request(struct conn_s *connptr, unsigned int last,
+                          unsigned int *lingering)
+{
+    struct request_s *request = NULL;
+    struct http_headers_s headers;
+    char *block;
+    ssize_t len;
+    int ret = -1;
+
     if(read_request_line(connptr) < 0){
         MITLogWrite(MITLOG_LEVEL_ERROR, "failed to read request line");
-        destroy_conn(connptr);
-        return;
+        return -1;
     }
 
-    if(connptr -> request_line == NULL){
-        destroy_conn(connptr);
-        return;
-    }
+    if(connptr -> request_line == NULL)
+        return 0;
 
     request = process_request(connptr);
 
     if(!request){
         MITLogWrite(MITLOG_LEVEL_ERROR, "failed to process request");
-        destroy_conn(connptr);
-        return;
+        return -1;
     }
 
     if(connptr -> connect_method){
-        MITLogWrite(MITLOG_LEVEL_ERROR, "https not supported");
-        free_request_struct(request);
-        destroy_conn(connptr);
-        return;
+        if(handle_connect(connptr, request) == 0)
+            ret = 0;
+        goto done;
     }
 
-    hashofheaders = hashmap_create (HEADER_BUCKETS);
-    if(get_all_headers(connptr->client_fd, hashofheaders) < 0){
+    connptr -> state = CONN_READ_HEADERS;
+    /* Origin connections are pooled (see upstream.c), so ask to keep them. */
+    connptr -> keepalive.server = 1;
+    /* Parsed in place: headers points into creader until the next line. */
+    len = reader_head(connptr->creader, &block);
+    if(len <= 0 || http_parse_headers(block, len, &headers) < 0){
         MITLogWrite(MITLOG_LEVEL_ERROR, "failed to get all headers");
-        free_request_struct(request);
-        destroy_conn(connptr);
-        hashmap_delete(hashofheaders);
-        return;
+        goto done;
+    }
+    connptr -> keepalive.client = !last
+                                  && client_keepalive(connptr, &headers);
+    if(connptr -> keepalive.client){
+        if(*lingering && child_queue_depth() > 0){
+            child_linger_end();
+            *lingering = 0;
+        }
+        if(!*lingering)
+            *lingering = child_linger_begin();
+        connptr -> keepalive.client = *lingering;
     }
  
-    if (process_client_headers (connptr, hashofheaders, request) < 0) {
+    /* The head is finished, and the body read, once the cache is asked. */
+    if (process_client_headers (connptr, &headers, request) < 0) {
         MITLogWrite(MITLOG_LEVEL_ERROR, "process_client_headers error");
-        free_request_struct(request);
-        destroy_conn(connptr);
-        hashmap_delete(hashofheaders);
-        return;     
+        goto done;
     }
 
+    if(send_client_request(connptr, request) < 0)
+        goto done;
+
+    ret = connptr -> keepalive.client;
+done:
+    return ret;
+}
+
+/*
+ * Serve requests on a client connection until it closes, asks us to
+ * close, or sits idle for CLIENT_IDLE_TIMEOUT.  Pipelined requests are
+ * simply read and answered in the order they arrive.  Whether the
+ * client is kept at all depends on how busy the pool is, see
+ * child_linger_begin().
+ */
+void handle_connection(int fd)
+{
+    struct conn_s *connptr;
+    struct timeval timeout = {CLIENT_IDLE_TIMEOUT, 0};
+    unsigned int served, lingering = 0;
 
-    if(send_client_request(connptr, request) < 0){
-        free_request_struct(request);
-        destroy_conn(connptr);
-        hashmap_delete(hashofheaders);
+    char sock_ipaddr[IP_LENGTH];
+    char peer_ipaddr[IP_LENGTH];
+    char peer_string[HOSTNAME_LENGTH];
+    
+    getpeer_information (fd, peer_ipaddr, peer_string);
+    getsock_ip (fd, sock_ipaddr);
+
+    //MITLogWrite(MITLOG_LEVEL_COMMON, "Connect (file descriptor %d): %s [%s] at [%s]",
+    //       fd, peer_string, peer_ipaddr, sock_ipaddr);
+
+    connptr = initialize_conn(fd, peer_ipaddr, peer_string, sock_ipaddr);
+    if (!connptr) {
+        Close(fd);
         return;
     }
 
+    /* An idle persistent client must not hold a worker forever. */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    for(served = 0; served != CLIENT_MAXREQUESTS; served++){
+        if(served)
+            reset_conn(connptr);
+        if(handle_request(connptr, served + 1 == CLIENT_MAXREQUESTS,
+                          &lingering) <= 0)
+            break;
+    }
+    if(lingering)
+        child_linger_end();
+
     //MITLogWrite(MITLOG_LEVEL_COMMON, "Closed connection between local client (fd:%d) "
     //       "and remote client (fd:%d)",
     //       connptr->client_fd, connptr->server_fd);
-    free_request_struct (request);
-    hashmap_delete (hashofheaders);
     destroy_conn (connptr);
-    return; 
 }
-
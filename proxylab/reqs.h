@@ -1,9 +1,20 @@
 #ifndef _PROXYLAB_REQS_H_
 #define _PROXYLAB_REQS_H_
 
+#include "conns.h"
+#include "http.h"
+
 #define HTTP_PORT 80
 #define HTTP_PORT_SSL 443
-#define HEADER_BUCKETS 32
+
+#define CLIENT_IDLE_TIMEOUT 5       /* seconds to wait for the next request */
+#define CLIENT_MAXREQUESTS 100      /* requests served per client connection */
+
+#define CHECK_CRLF(header, len)                                 \
+  (((len) == 1 && header[0] == '\n') ||                         \
+   ((len) == 2 && header[0] == '\r' && header[1] == '\n'))
+#define CHECK_LWS(header, len)                                  \
+  ((len) > 0 && (header[0] == ' ' || header[0] == '\t'))
 
 struct request_s {
     char *method;
@@ -13,7 +24,17 @@ struct request_s {
     char *path;
 };
 
-
+extern int getpeer_information (int fd, char *ipaddr, char *string_addr);
+extern int getsock_ip (int fd, char *ipaddr);
+extern struct request_s *process_request (struct conn_s *connptr);
+extern int process_client_headers (struct conn_s *connptr,
+                                   struct http_headers_s *headers,
+                                   struct request_s *request);
+extern int end_client_headers (struct conn_s *connptr, const char *etag,
+                               const char *since);
+extern int pull_client_data (struct conn_s *connptr, long int length);
+extern char *cacheable_raw_response (struct conn_s *connptr,
+                                     struct request_s *request, size_t *len);
 extern void handle_connection(int fd);
 
 #endif
@@ -0,0 +1,75 @@
+#include "sbuf.h"
+
+int sbuf_init (struct sbuf_s *sp, unsigned int n)
+{
+    assert (sp != NULL);
+    assert (n > 0);
+
+    sp->buf = (int *) Calloc (n, sizeof (int));
+    if (!sp->buf)
+        return -ENOMEM;
+
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    sp->depth = sp->peak = 0;
+    Sem_init (&sp->mutex, 0, 1);
+    Sem_init (&sp->slots, 0, n);
+    Sem_init (&sp->items, 0, 0);
+    return 0;
+}
+
+void sbuf_deinit (struct sbuf_s *sp)
+{
+    assert (sp != NULL);
+
+    Free (sp->buf);
+    sp->buf = NULL;
+}
+
+/* Blocks while the queue is full. */
+void sbuf_insert (struct sbuf_s *sp, int item)
+{
+    P (&sp->slots);
+    P (&sp->mutex);
+    sp->buf[sp->rear] = item;
+    sp->rear = (sp->rear + 1) % sp->n;
+    if (++sp->depth > sp->peak)
+        sp->peak = sp->depth;
+    V (&sp->mutex);
+    V (&sp->items);
+}
+
+/* Blocks while the queue is empty. */
+int sbuf_remove (struct sbuf_s *sp)
+{
+    int item;
+
+    P (&sp->items);
+    P (&sp->mutex);
+    item = sp->buf[sp->front];
+    sp->front = (sp->front + 1) % sp->n;
+    sp->depth--;
+    V (&sp->mutex);
+    V (&sp->slots);
+    return item;
+}
+
+unsigned int sbuf_depth (struct sbuf_s *sp)
+{
+    unsigned int depth;
+
+    P (&sp->mutex);
+    depth = sp->depth;
+    V (&sp->mutex);
+    return depth;
+}
+
+unsigned int sbuf_peak (struct sbuf_s *sp)
+{
+    unsigned int peak;
+
+    P (&sp->mutex);
+    peak = sp->peak;
+    V (&sp->mutex);
+    return peak;
+}
@@ -0,0 +1,29 @@
+#ifndef _PROXYLAB_SBUF_H_
+#define _PROXYLAB_SBUF_H_
+
+#include "csapp.h"
+
+/*
+ * Bounded FIFO of connected descriptors shared by the accept thread
+ * (producer) and the worker threads (consumers).
+ */
+struct sbuf_s {
+    int *buf;               /* ring of descriptors */
+    unsigned int n;         /* maximum number of slots */
+    unsigned int front;     /* buf[front] is the first item */
+    unsigned int rear;      /* buf[rear] is the next free slot */
+    unsigned int depth;     /* items currently queued */
+    unsigned int peak;      /* high-water mark of depth */
+    sem_t mutex;            /* protects the fields above */
+    sem_t slots;            /* counts available slots */
+    sem_t items;            /* counts available items */
+};
+
+extern int sbuf_init (struct sbuf_s *sp, unsigned int n);
+extern void sbuf_deinit (struct sbuf_s *sp);
+extern void sbuf_insert (struct sbuf_s *sp, int item);
+extern int sbuf_remove (struct sbuf_s *sp);
+extern unsigned int sbuf_depth (struct sbuf_s *sp);
+extern unsigned int sbuf_peak (struct sbuf_s *sp);
+
+#endif
@@ -0,0 +1,85 @@
+#include "sketch.h"
+
+/* 64-bit FNV-1a; the two halves seed the row indexes. */
+static uint64_t sketch_hash (const char *key)
+{
+    uint64_t hash = 14695981039346656037ull;
+
+    while (*key) {
+        hash ^= (unsigned char) *key++;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/* Where key's counter sits in row. */
+static unsigned int sketch_index (struct sketch_s *sketch, uint64_t hash,
+                                  unsigned int row)
+{
+    uint32_t h1 = (uint32_t) hash, h2 = (uint32_t) (hash >> 32) | 1;
+
+    return row * sketch->width + ((h1 + row * h2) & (sketch->width - 1));
+}
+
+int sketch_init (struct sketch_s *sketch, unsigned int width)
+{
+    assert (sketch != NULL);
+
+    if (width == 0 || (width & (width - 1)) != 0)
+        return -EINVAL;
+
+    sketch->width = width;
+    sketch->additions = 0;
+    sketch->counters = (unsigned char *) Calloc (SKETCH_DEPTH, width);
+    if (sketch->counters == NULL)
+        return -ENOMEM;
+    return 0;
+}
+
+void sketch_free (struct sketch_s *sketch)
+{
+    Free (sketch->counters);
+    sketch->counters = NULL;
+}
+
+/* Halve every counter, forgetting half of the past. */
+static void sketch_age (struct sketch_s *sketch)
+{
+    unsigned int i;
+
+    for (i = 0; i != SKETCH_DEPTH * sketch->width; i++)
+        sketch->counters[i] >>= 1;
+    sketch->additions /= 2;
+}
+
+void sketch_increment (struct sketch_s *sketch, const char *key)
+{
+    uint64_t hash = sketch_hash (key);
+    unsigned char *counter;
+    unsigned int row;
+    int added = 0;
+
+    for (row = 0; row != SKETCH_DEPTH; row++) {
+        counter = &sketch->counters[sketch_index (sketch, hash, row)];
+        if (*counter < SKETCH_MAXCOUNT) {
+            ++*counter;
+            added = 1;
+        }
+    }
+
+    if (added && ++sketch->additions >= sketch->width * SKETCH_SAMPLE)
+        sketch_age (sketch);
+}
+
+unsigned int sketch_estimate (struct sketch_s *sketch, const char *key)
+{
+    uint64_t hash = sketch_hash (key);
+    unsigned int row, count, least = SKETCH_MAXCOUNT;
+
+    for (row = 0; row != SKETCH_DEPTH; row++) {
+        count = sketch->counters[sketch_index (sketch, hash, row)];
+        if (count < least)
+            least = count;
+    }
+    return least;
+}
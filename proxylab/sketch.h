@@ -0,0 +1,30 @@
+#ifndef _PROXYLAB_SKETCH_H_
+#define _PROXYLAB_SKETCH_H_
+
+#include "csapp.h"
+
+#define SKETCH_DEPTH 4
+#define SKETCH_MAXCOUNT 15          /* counters saturate here */
+#define SKETCH_SAMPLE 10            /* age after width * this increments */
+
+/*
+ * Count-min sketch of how often keys are asked for.  Each key maps to
+ * one small saturating counter per row, and its estimate is the least
+ * of them, which can only overcount.  Every width * SKETCH_SAMPLE
+ * increments all counters are halved, so the estimates follow recent
+ * popularity rather than all-time totals.  Not locked: the owner
+ * serialises access.
+ */
+struct sketch_s {
+    unsigned int width;             /* counters per row, a power of two */
+    unsigned int additions;         /* since the last halving */
+    unsigned char *counters;        /* SKETCH_DEPTH rows of width */
+};
+
+extern int sketch_init (struct sketch_s *sketch, unsigned int width);
+extern void sketch_free (struct sketch_s *sketch);
+extern void sketch_increment (struct sketch_s *sketch, const char *key);
+extern unsigned int sketch_estimate (struct sketch_s *sketch,
+                                     const char *key);
+
+#endif
@@ -0,0 +1,514 @@
+#include <dirent.h>
+
+#include "store.h"
+#include "hashmap.h"
+#include "MITLogModule.h"
+
+#define STORE_MAGIC 0x50585332u         /* "PXS2", starts every record */
+#define STORE_ALIGN 8
+#define STORE_ALIGNED(x) (((x) + STORE_ALIGN - 1) & ~(size_t)(STORE_ALIGN - 1))
+#define STORE_PATH_LENGTH 512
+#define STORE_NAME_LENGTH 32             /* "/seg-NNNNNNNN.dat" and then some */
+
+/* The start of every segment file. */
+struct store_header_s {
+    char magic[8];
+    uint32_t id;
+    uint32_t pad;
+};
+
+static const char header_magic[8] = "PXSTORE2";
+
+/*
+ * Each object is one record: this, the key with its '\0', then the
+ * value, padded to STORE_ALIGN.  The checksum covers key and value so
+ * a record cut short by a crash is recognised when the index is
+ * rebuilt.  expires is when the object goes stale, as cached.
+ */
+struct store_record_s {
+    uint32_t magic;
+    uint32_t keylen;
+    uint32_t len;
+    uint32_t checksum;
+    int64_t expires;
+};
+
+struct store_segment_s {
+    unsigned int id;
+    unsigned int live;          /* still in the list and the index */
+    int refcount;               /* the list's, plus one per user */
+    char *base;
+    size_t used;                /* records end here */
+    struct store_segment_s *next;
+};
+
+/* What the index keeps per object: 12 bytes besides the key. */
+struct store_loc_s {
+    uint32_t segment;
+    uint32_t offset;            /* of the record */
+    uint32_t len;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    int enabled;
+    char dir[STORE_PATH_LENGTH];
+    hashmap_t index;
+    struct store_segment_s *oldest, *newest;
+    unsigned int nsegments;
+    unsigned int maxsegments;
+    struct store_stats_s stats;
+} store = {PTHREAD_MUTEX_INITIALIZER};
+
+static uint32_t store_checksum (const char *key, size_t keylen,
+                                const char *value, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i != keylen; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 16777619u;
+    }
+    for (i = 0; i != len; i++) {
+        hash ^= (unsigned char) value[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void segment_path (char *path, unsigned int id)
+{
+    snprintf (path, STORE_PATH_LENGTH + STORE_NAME_LENGTH, "%s/seg-%08u.dat",
+              store.dir, id);
+}
+
+/* Map segment id; create says whether to make a new, empty one. */
+static struct store_segment_s *segment_map (unsigned int id, int create)
+{
+    struct store_segment_s *segment;
+    struct store_header_s *header;
+    char path[STORE_PATH_LENGTH + STORE_NAME_LENGTH];
+    struct stat st;
+    char *base;
+    int fd;
+
+    segment_path (path, id);
+    fd = open (path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    if (fd < 0)
+        return NULL;
+    if ((create && ftruncate (fd, STORE_SEGMENT_SIZE) < 0)
+        || fstat (fd, &st) < 0 || (size_t) st.st_size != STORE_SEGMENT_SIZE) {
+        close (fd);
+        return NULL;
+    }
+    base = (char *) mmap (NULL, STORE_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0);
+    close (fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    header = (struct store_header_s *) base;
+    if (create) {
+        memcpy (header->magic, header_magic, sizeof (header_magic));
+        header->id = id;
+    } else if (memcmp (header->magic, header_magic, sizeof (header_magic))
+               || header->id != id) {
+        munmap (base, STORE_SEGMENT_SIZE);
+        return NULL;
+    }
+
+    segment = (struct store_segment_s *) Malloc (sizeof (struct store_segment_s));
+    segment->id = id;
+    segment->live = 1;
+    segment->refcount = 1;
+    segment->base = base;
+    segment->used = sizeof (struct store_header_s);
+    segment->next = NULL;
+    return segment;
+}
+
+/* With store.lock held. */
+static void segment_put (struct store_segment_s *segment)
+{
+    if (--segment->refcount > 0)
+        return;
+    munmap (segment->base, STORE_SEGMENT_SIZE);
+    Free (segment);
+}
+
+void store_segment_release (struct store_segment_s *segment)
+{
+    pthread_mutex_lock (&store.lock);
+    segment_put (segment);
+    pthread_mutex_unlock (&store.lock);
+}
+
+/*
+ * The next whole record at offset, or NULL where the records stop: at
+ * unused space, or at a record that is torn or still being written.
+ */
+static struct store_record_s *segment_record (struct store_segment_s *segment,
+                                              size_t offset, size_t end,
+                                              int verify)
+{
+    struct store_record_s *record;
+    char *key;
+
+    if (offset + sizeof (struct store_record_s) > end)
+        return NULL;
+    record = (struct store_record_s *) (segment->base + offset);
+    if (record->magic != STORE_MAGIC || record->keylen == 0
+        || offset + sizeof (struct store_record_s) + record->keylen
+           + record->len > end)
+        return NULL;
+    key = (char *) (record + 1);
+    if (key[record->keylen - 1] != '\0')
+        return NULL;
+    if (verify && record->checksum != store_checksum (key, record->keylen,
+                                                      key + record->keylen,
+                                                      record->len))
+        return NULL;
+    return record;
+}
+
+static size_t record_size (struct store_record_s *record)
+{
+    return STORE_ALIGNED (sizeof (struct store_record_s) + record->keylen
+                          + record->len);
+}
+
+/* Point key at a record, replacing wherever it was before. */
+static void index_set (const char *key, struct store_loc_s *loc)
+{
+    void *data;
+
+    if (hashmap_entry_by_key (store.index, key, &data) > 0) {
+        memcpy (data, loc, sizeof (struct store_loc_s));
+    } else if (hashmap_insert (store.index, key, loc,
+                               sizeof (struct store_loc_s)) >= 0) {
+        store.stats.objects++;
+    }
+}
+
+/* Forget key, with the lock held.  Its record stays until its segment goes. */
+static void index_remove (const char *key)
+{
+    if (hashmap_remove (store.index, key) > 0)
+        store.stats.objects--;
+}
+
+/*
+ * Drop the oldest segment: its file goes now, its mapping once the
+ * last reader lets go.  The index entries that still point into it are
+ * found by walking its records.
+ */
+static void segment_drop_oldest (void)
+{
+    struct store_segment_s *segment = store.oldest;
+    struct store_record_s *record;
+    struct store_loc_s *loc;
+    char path[STORE_PATH_LENGTH + STORE_NAME_LENGTH];
+    size_t offset = sizeof (struct store_header_s);
+    void *data;
+    char *key;
+
+    store.oldest = segment->next;
+    if (store.newest == segment)
+        store.newest = NULL;
+    store.nsegments--;
+    segment->live = 0;
+
+    while ((record = segment_record (segment, offset, segment->used, 0))) {
+        key = (char *) (record + 1);
+        if (hashmap_entry_by_key (store.index, key, &data) > 0) {
+            loc = (struct store_loc_s *) data;
+            if (loc->segment == segment->id
+                && hashmap_remove (store.index, key) > 0)
+                store.stats.objects--;
+        }
+        offset += record_size (record);
+    }
+
+    segment_path (path, segment->id);
+    unlink (path);
+    store.stats.dropped++;
+    segment_put (segment);
+}
+
+static void segment_append (struct store_segment_s *segment)
+{
+    if (store.newest)
+        store.newest->next = segment;
+    else
+        store.oldest = segment;
+    store.newest = segment;
+    store.nsegments++;
+    while (store.nsegments > store.maxsegments)
+        segment_drop_oldest ();
+}
+
+/* Index every intact record in a segment found at startup. */
+static void segment_scan (struct store_segment_s *segment)
+{
+    struct store_record_s *record;
+    struct store_loc_s loc;
+    size_t offset = sizeof (struct store_header_s);
+
+    while ((record = segment_record (segment, offset, STORE_SEGMENT_SIZE, 1))) {
+        loc.segment = segment->id;
+        loc.offset = offset;
+        loc.len = record->len;
+        index_set ((char *) (record + 1), &loc);
+        offset += record_size (record);
+    }
+    segment->used = offset;
+}
+
+/*
+ * Whether anything was written past the last intact record, say by a
+ * writer that finished after an earlier one was cut off.  Appending
+ * there could leave an old record behind a newer one for the same key.
+ */
+static int segment_dirty_tail (struct store_segment_s *segment)
+{
+    size_t offset;
+
+    for (offset = segment->used; offset != STORE_SEGMENT_SIZE; offset++)
+        if (segment->base[offset] != 0)
+            return 1;
+    return 0;
+}
+
+static int compare_ids (const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Open the store in dir, creating the directory if need be, and
+ * rebuild the index from whatever segments are already there, oldest
+ * first so newer copies of a key win.  New objects go after the last
+ * intact record of the newest segment.
+ */
+int store_init (const char *dir, unsigned int maxsegments)
+{
+    struct store_segment_s *segment;
+    struct dirent *entry;
+    unsigned int *ids = NULL, nids = 0, capacity = 0, id, i;
+    char tail;
+    DIR *dp;
+
+    assert (dir != NULL);
+    assert (maxsegments > 0);
+
+    if (strlen (dir) >= STORE_PATH_LENGTH)
+        return -ENAMETOOLONG;
+    if (mkdir (dir, 0755) < 0 && errno != EEXIST)
+        return -errno;
+    if ((dp = opendir (dir)) == NULL)
+        return -errno;
+
+    strcpy (store.dir, dir);
+    store.maxsegments = maxsegments;
+    store.index = hashmap_create (STORE_BUCKETS);
+    if (store.index == NULL) {
+        closedir (dp);
+        return -ENOMEM;
+    }
+
+    while ((entry = readdir (dp)) != NULL) {
+        if (sscanf (entry->d_name, "seg-%u.da%c", &id, &tail) != 2
+            || tail != 't')
+            continue;
+        if (nids == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            ids = (unsigned int *) Realloc (ids, capacity * sizeof (*ids));
+        }
+        ids[nids++] = id;
+    }
+    closedir (dp);
+    qsort (ids, nids, sizeof (*ids), compare_ids);
+
+    for (i = 0; i != nids; i++) {
+        if ((segment = segment_map (ids[i], 0)) == NULL) {
+            MITLogWrite (MITLOG_LEVEL_ERROR,
+                         "store: skipping unreadable segment %u", ids[i]);
+            continue;
+        }
+        segment_scan (segment);
+        segment_append (segment);
+    }
+    if (ids)
+        Free (ids);
+    if (store.newest && segment_dirty_tail (store.newest))
+        store.newest->used = STORE_SEGMENT_SIZE;
+
+    store.enabled = 1;
+    MITLogWrite (MITLOG_LEVEL_COMMON,
+                 "store: %lu objects in %u segments under %s",
+                 store.stats.objects, store.nsegments, dir);
+    return 0;
+}
+
+int store_enabled (void)
+{
+    return store.enabled;
+}
+
+/*
+ * Append an object.  Space is reserved under the lock, but the copy
+ * into the mapping is not, and the index only learns about the record
+ * once it is complete.  If the segment was dropped in the meantime the
+ * record is simply lost.  An object that cannot be written still takes
+ * any older copy of key out of the index, so that is never served in
+ * its place.
+ */
+int store_put (const char *key, const char *value, size_t len,
+               time_t expires)
+{
+    struct store_segment_s *segment;
+    struct store_record_s *record;
+    struct store_loc_s loc;
+    size_t keylen = strlen (key) + 1;
+    size_t size = STORE_ALIGNED (sizeof (struct store_record_s) + keylen + len);
+    size_t offset;
+    unsigned int id;
+
+    if (!store.enabled)
+        return 0;
+    if (len > STORE_MAX_OBJECT
+        || size > STORE_SEGMENT_SIZE - sizeof (struct store_header_s))
+        return store_remove (key);
+
+    pthread_mutex_lock (&store.lock);
+    segment = store.newest;
+    if (!segment || segment->used + size > STORE_SEGMENT_SIZE) {
+        id = segment ? segment->id + 1 : 0;
+        if ((segment = segment_map (id, 1)) == NULL) {
+            index_remove (key);
+            pthread_mutex_unlock (&store.lock);
+            MITLogWrite (MITLOG_LEVEL_ERROR,
+                         "store: could not create segment %u", id);
+            return -1;
+        }
+        segment_append (segment);
+    }
+    offset = segment->used;
+    segment->used += size;
+    segment->refcount++;
+    pthread_mutex_unlock (&store.lock);
+
+    record = (struct store_record_s *) (segment->base + offset);
+    memcpy ((char *) (record + 1), key, keylen);
+    memcpy ((char *) (record + 1) + keylen, value, len);
+    record->keylen = keylen;
+    record->len = len;
+    record->expires = expires;
+    record->checksum = store_checksum (key, keylen, value, len);
+    __atomic_store_n (&record->magic, STORE_MAGIC, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock (&store.lock);
+    if (segment->live) {
+        loc.segment = segment->id;
+        loc.offset = offset;
+        loc.len = len;
+        index_set (key, &loc);
+        store.stats.writes++;
+    } else {
+        index_remove (key);
+    }
+    segment_put (segment);
+    pthread_mutex_unlock (&store.lock);
+    return 0;
+}
+
+/* The live segment with id, with the lock held, or NULL. */
+static struct store_segment_s *segment_find (uint32_t id)
+{
+    struct store_segment_s *ptr;
+
+    for (ptr = store.oldest; ptr && ptr->id != id; ptr = ptr->next)
+        ;
+    return ptr;
+}
+
+const char *store_get (const char *key, size_t *len, time_t *expires,
+                       struct store_segment_s **segment)
+{
+    struct store_segment_s *ptr;
+    struct store_record_s *record;
+    struct store_loc_s *loc;
+    const char *value = NULL;
+    void *data;
+
+    if (!store.enabled)
+        return NULL;
+
+    pthread_mutex_lock (&store.lock);
+    if (hashmap_entry_by_key (store.index, key, &data) > 0) {
+        loc = (struct store_loc_s *) data;
+        if ((ptr = segment_find (loc->segment))) {
+            record = (struct store_record_s *) (ptr->base + loc->offset);
+            value = (char *) (record + 1) + record->keylen;
+            *len = loc->len;
+            *expires = (time_t) record->expires;
+            *segment = ptr;
+            ptr->refcount++;
+        } else {
+            /* Its record was still being written when the segment went. */
+            index_remove (key);
+        }
+    }
+    if (value)
+        store.stats.hits++;
+    else
+        store.stats.misses++;
+    pthread_mutex_unlock (&store.lock);
+    return value;
+}
+
+/*
+ * The origin says key's object is current until expires.  Only the
+ * record's expires changes, which the checksum does not cover.
+ */
+int store_refresh (const char *key, time_t expires)
+{
+    struct store_segment_s *segment;
+    struct store_record_s *record;
+    struct store_loc_s *loc;
+    void *data;
+
+    if (!store.enabled)
+        return 0;
+    pthread_mutex_lock (&store.lock);
+    if (hashmap_entry_by_key (store.index, key, &data) > 0) {
+        loc = (struct store_loc_s *) data;
+        if ((segment = segment_find (loc->segment))) {
+            record = (struct store_record_s *) (segment->base + loc->offset);
+            record->expires = expires;
+        }
+    }
+    pthread_mutex_unlock (&store.lock);
+    return 0;
+}
+
+/* Forget key's object, once it is replaced or dropped from the cache. */
+int store_remove (const char *key)
+{
+    if (!store.enabled)
+        return 0;
+    pthread_mutex_lock (&store.lock);
+    index_remove (key);
+    pthread_mutex_unlock (&store.lock);
+    return 0;
+}
+
+void store_stats (struct store_stats_s *stats)
+{
+    pthread_mutex_lock (&store.lock);
+    *stats = store.stats;
+    pthread_mutex_unlock (&store.lock);
+}
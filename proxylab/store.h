@@ -0,0 +1,45 @@
+#ifndef _PROXYLAB_STORE_H_
+#define _PROXYLAB_STORE_H_
+
+#include "csapp.h"
+
+#define STORE_SEGMENT_SIZE ((size_t)64 << 20)   /* bytes per segment file */
+#define STORE_MAXSEGMENTS 16                    /* default, 1 GB in all */
+#define STORE_MAX_OBJECT ((size_t)8 << 20)      /* biggest object kept */
+#define STORE_BUCKETS 4096
+
+/*
+ * The cache's second tier: objects evicted from memory, and objects
+ * too big for it, are appended to segment files under a directory and
+ * read back straight from their mappings.  Only the index (key to
+ * segment, offset and length) lives on the heap, and it is rebuilt by
+ * scanning the segments when the proxy starts, so a restart comes back
+ * warm.  When the newest segment fills up a new one is started, and
+ * past the segment limit the oldest is dropped whole.
+ *
+ * store_get() returns a pointer into a segment and a reference on it;
+ * the bytes stay valid, even if the segment is dropped, until
+ * store_segment_release().
+ */
+struct store_segment_s;
+
+struct store_stats_s {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long writes;
+    unsigned long objects;          /* in the index right now */
+    unsigned long dropped;          /* segments dropped to make room */
+};
+
+extern int store_init (const char *dir, unsigned int maxsegments);
+extern int store_enabled (void);
+extern int store_put (const char *key, const char *value, size_t len,
+                      time_t expires);
+extern int store_refresh (const char *key, time_t expires);
+extern int store_remove (const char *key);
+extern const char *store_get (const char *key, size_t *len, time_t *expires,
+                              struct store_segment_s **segment);
+extern void store_segment_release (struct store_segment_s *segment);
+extern void store_stats (struct store_stats_s *stats);
+
+#endif
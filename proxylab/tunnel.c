@@ -0,0 +1,219 @@
+#define _GNU_SOURCE             /* splice */
+#include <poll.h>
+
+#include "tunnel.h"
+#include "network.h"
+#include "MITLogModule.h"
+
+static struct {
+    pthread_mutex_t lock;
+    struct tunnel_stats_s stats;
+} totals = {PTHREAD_MUTEX_INITIALIZER};
+
+static int ports[TUNNEL_MAXPORTS] = {TUNNEL_DEFAULT_PORT};
+static unsigned int nports = 1;
+
+static int half_open (struct tunnel_half_s *half, int from, int to)
+{
+    memset (half, 0, sizeof (struct tunnel_half_s));
+    half->from = from;
+    half->to = to;
+    if (pipe2 (half->pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+        half->pipefd[0] = half->pipefd[1] = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void half_close (struct tunnel_half_s *half)
+{
+    if (half->pipefd[0] < 0)
+        return;
+    close (half->pipefd[0]);
+    close (half->pipefd[1]);
+    half->pipefd[0] = half->pipefd[1] = -1;
+}
+
+int tunnel_open (struct tunnel_s *tunnel, int client_fd, int server_fd)
+{
+    assert (tunnel != NULL);
+
+    if (half_open (&tunnel->up, client_fd, server_fd) < 0
+        || half_open (&tunnel->down, server_fd, client_fd) < 0
+        || socket_nonblocking (client_fd) < 0
+        || socket_nonblocking (server_fd) < 0) {
+        MITLogWrite (MITLOG_LEVEL_ERROR, "tunnel_open failed: %s",
+                     strerror (errno));
+        half_close (&tunnel->up);
+        half_close (&tunnel->down);
+        return -1;
+    }
+    tunnel->last_active = time (NULL);
+
+    pthread_mutex_lock (&totals.lock);
+    totals.stats.opened++;
+    pthread_mutex_unlock (&totals.lock);
+    return 0;
+}
+
+/*
+ * Fill the pipe if it is empty, then empty as much of it as the far
+ * side takes.  Returns whether anything moved, or -1 on error.
+ */
+static int half_pump (struct tunnel_half_s *half)
+{
+    ssize_t len;
+    int moved = 0;
+
+    if (!half->eof && half->piped == 0) {
+        do {
+            len = splice (half->from, NULL, half->pipefd[1], NULL,
+                          NETWORK_SPLICE_SIZE,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while (len < 0 && errno == EINTR);
+        if (len == 0)
+            half->eof = 1;
+        else if (len > 0)
+            half->piped += len;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+        moved = len >= 0;
+    }
+
+    if (half->piped > 0) {
+        do {
+            len = splice (half->pipefd[0], NULL, half->to, NULL, half->piped,
+                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } while (len < 0 && errno == EINTR);
+        if (len > 0) {
+            half->piped -= len;
+            half->bytes += len;
+            moved = 1;
+        } else if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+    }
+
+    if (half->eof && half->piped == 0 && !half->shut) {
+        shutdown (half->to, SHUT_WR);
+        half->shut = 1;
+    }
+    return moved;
+}
+
+int tunnel_pump (struct tunnel_s *tunnel)
+{
+    int up, down;
+
+    assert (tunnel != NULL);
+
+    if ((up = half_pump (&tunnel->up)) < 0
+        || (down = half_pump (&tunnel->down)) < 0)
+        return -1;
+    if (up || down)
+        tunnel->last_active = time (NULL);
+    return tunnel->up.shut && tunnel->down.shut;
+}
+
+/* A socket is read while its pipe is empty and written while the other is not. */
+void tunnel_events (struct tunnel_s *tunnel, short *client_events,
+                    short *server_events)
+{
+    *client_events = *server_events = 0;
+    if (!tunnel->up.eof && tunnel->up.piped == 0)
+        *client_events |= POLLIN;
+    if (tunnel->down.piped > 0)
+        *client_events |= POLLOUT;
+    if (!tunnel->down.eof && tunnel->down.piped == 0)
+        *server_events |= POLLIN;
+    if (tunnel->up.piped > 0)
+        *server_events |= POLLOUT;
+}
+
+void tunnel_close (struct tunnel_s *tunnel, unsigned int timed_out)
+{
+    assert (tunnel != NULL);
+
+    half_close (&tunnel->up);
+    half_close (&tunnel->down);
+    MITLogWrite (MITLOG_LEVEL_COMMON,
+                 "Tunnel between fd %d and fd %d closed%s: %llu bytes up, "
+                 "%llu bytes down", tunnel->up.from, tunnel->up.to,
+                 timed_out ? " (idle)" : "", tunnel->up.bytes,
+                 tunnel->down.bytes);
+
+    pthread_mutex_lock (&totals.lock);
+    totals.stats.closed++;
+    if (timed_out)
+        totals.stats.idle_timeouts++;
+    totals.stats.bytes_up += tunnel->up.bytes;
+    totals.stats.bytes_down += tunnel->down.bytes;
+    pthread_mutex_unlock (&totals.lock);
+}
+
+/*
+ * Relay until the tunnel is over.  poll() waits at most the idle
+ * timeout at a time, so a quiet tunnel is closed once a whole timeout
+ * goes by with nothing moving.
+ */
+int tunnel_run (int client_fd, int server_fd)
+{
+    struct tunnel_s tunnel;
+    struct pollfd pfds[2];
+    int ret, timed_out = 0;
+
+    if (tunnel_open (&tunnel, client_fd, server_fd) < 0)
+        return -1;
+
+    pfds[0].fd = client_fd;
+    pfds[1].fd = server_fd;
+    while ((ret = tunnel_pump (&tunnel)) == 0) {
+        tunnel_events (&tunnel, &pfds[0].events, &pfds[1].events);
+        ret = poll (pfds, 2, TUNNEL_IDLE_TIMEOUT * 1000);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret == 0)
+            timed_out = 1;
+        if (ret <= 0
+            || ((pfds[0].revents | pfds[1].revents) & (POLLERR | POLLNVAL)))
+            break;
+    }
+
+    tunnel_close (&tunnel, timed_out);
+    return ret < 0 || timed_out ? -1 : 0;
+}
+
+void tunnel_stats (struct tunnel_stats_s *stats)
+{
+    pthread_mutex_lock (&totals.lock);
+    *stats = totals.stats;
+    pthread_mutex_unlock (&totals.lock);
+}
+
+int tunnel_set_ports (const char *list)
+{
+    unsigned int n = 0;
+    char *end;
+    long port;
+
+    do {
+        port = strtol (list, &end, 10);
+        if (end == list || port < 1 || port > 65535 || n == TUNNEL_MAXPORTS
+            || (*end != ',' && *end != '\0'))
+            return -1;
+        ports[n++] = (int) port;
+        list = end + 1;
+    } while (*end == ',');
+    nports = n;
+    return 0;
+}
+
+int tunnel_port_allowed (int port)
+{
+    unsigned int i;
+
+    for (i = 0; i != nports; i++)
+        if (ports[i] == port)
+            return 1;
+    return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef _PROXYLAB_TUNNEL_H_
+#define _PROXYLAB_TUNNEL_H_
+
+#include "csapp.h"
+
+#define TUNNEL_IDLE_TIMEOUT 300   /* seconds with no bytes either way */
+#define TUNNEL_DEFAULT_PORT 443   /* the only port CONNECT reaches unless told */
+#define TUNNEL_MAXPORTS 16
+
+/* One direction of a tunnel: from one socket, through a pipe, to the other. */
+struct tunnel_half_s {
+    int from;
+    int to;
+    int pipefd[2];
+    size_t piped;               /* read from `from', not yet written */
+    unsigned long long bytes;   /* written to `to' */
+    unsigned int eof;           /* `from' has nothing more to send */
+    unsigned int shut;          /* and `to' has been told so */
+};
+
+/*
+ * A CONNECT tunnel.  The bytes are opaque (usually TLS) and never come
+ * up into user space: each direction is spliced through its own pipe.
+ * When one side stops sending, the other side's write half is shut so
+ * half-closed connections work; the tunnel is over when both
+ * directions are, when either side fails, or after TUNNEL_IDLE_TIMEOUT.
+ */
+struct tunnel_s {
+    struct tunnel_half_s up;    /* client to origin */
+    struct tunnel_half_s down;  /* origin to client */
+    time_t last_active;
+};
+
+struct tunnel_stats_s {
+    unsigned long opened;
+    unsigned long closed;
+    unsigned long idle_timeouts;
+    unsigned long long bytes_up;
+    unsigned long long bytes_down;
+};
+
+/*
+ * tunnel_open() makes both sockets non-blocking.  tunnel_pump() moves
+ * whatever can move without blocking and returns 1 once the tunnel is
+ * over, 0 if there is more to come, or -1 on error; tunnel_events()
+ * says what each socket should be polled for in the meantime.
+ * tunnel_close() drops the pipes and adds the counts to the totals,
+ * but leaves the sockets to the caller.  tunnel_run() does all of it
+ * with poll() for a thread that can wait.
+ */
+extern int tunnel_open (struct tunnel_s *tunnel, int client_fd,
+                        int server_fd);
+extern int tunnel_pump (struct tunnel_s *tunnel);
+extern void tunnel_events (struct tunnel_s *tunnel, short *client_events,
+                           short *server_events);
+extern void tunnel_close (struct tunnel_s *tunnel, unsigned int timed_out);
+extern int tunnel_run (int client_fd, int server_fd);
+extern void tunnel_stats (struct tunnel_stats_s *stats);
+
+/*
+ * CONNECT is only let through to the listed ports, so the proxy is not
+ * an open relay for any protocol to any service.  tunnel_set_ports()
+ * takes a comma-separated list, once at startup.
+ */
+extern int tunnel_set_ports (const char *list);
+extern int tunnel_port_allowed (int port);
+
+#endif
@@ -0,0 +1,219 @@
+#include "upstream.h"
+#include "proxy.h"
+#include "hashmap.h"
+#include "network.h"
+#include "MITLogModule.h"
+
+#define UPSTREAM_KEY_LENGTH (HOSTNAME_LENGTH + 8)
+
+struct upstream_host_s;
+
+struct idle_conn_s {
+    int fd;
+    time_t since;                           /* when it went idle */
+    struct upstream_host_s *host;
+
+    struct idle_conn_s *hprev, *hnext;      /* same host:port, newest first */
+    struct idle_conn_s *gprev, *gnext;      /* every idle one, newest first */
+};
+
+struct upstream_host_s {
+    char *key;
+    unsigned int nidle;
+    struct idle_conn_s *head;
+};
+
+static struct {
+    pthread_mutex_t lock;
+    hashmap_t hosts;                        /* "host:port" -> host pointer */
+    unsigned int nidle;
+    struct idle_conn_s *head, *tail;
+} pool;
+
+static void make_key (char *key, const char *host, int port)
+{
+    snprintf (key, UPSTREAM_KEY_LENGTH, "%s:%d", host, port);
+}
+
+static struct upstream_host_s *find_host (const char *key)
+{
+    void *data;
+
+    if (hashmap_entry_by_key (pool.hosts, key, &data) <= 0)
+        return NULL;
+    return *(struct upstream_host_s **) data;
+}
+
+/* Take idle out of both lists, dropping its host once that is empty. */
+static void unlink_idle (struct idle_conn_s *idle)
+{
+    struct upstream_host_s *host = idle->host;
+
+    if (idle->hprev)
+        idle->hprev->hnext = idle->hnext;
+    else
+        host->head = idle->hnext;
+    if (idle->hnext)
+        idle->hnext->hprev = idle->hprev;
+
+    if (idle->gprev)
+        idle->gprev->gnext = idle->gnext;
+    else
+        pool.head = idle->gnext;
+    if (idle->gnext)
+        idle->gnext->gprev = idle->gprev;
+    else
+        pool.tail = idle->gprev;
+
+    pool.nidle--;
+    if (--host->nidle == 0) {
+        hashmap_remove (pool.hosts, host->key);
+        Free (host->key);
+        Free (host);
+    }
+}
+
+static void close_idle (struct idle_conn_s *idle)
+{
+    unlink_idle (idle);
+    close (idle->fd);
+    Free (idle);
+}
+
+/* Close everything that has been idle too long; oldest are at the tail. */
+static void expire_idle (time_t now)
+{
+    while (pool.tail && now - pool.tail->since >= UPSTREAM_IDLE_TIMEOUT)
+        close_idle (pool.tail);
+}
+
+static void *upstream_reaper (void *ptr_void)
+{
+    Pthread_detach (Pthread_self ());
+    while (1) {
+        sleep (UPSTREAM_IDLE_TIMEOUT / 2);
+        pthread_mutex_lock (&pool.lock);
+        expire_idle (time (NULL));
+        pthread_mutex_unlock (&pool.lock);
+    }
+    return NULL;
+}
+
+int upstream_init (void)
+{
+    pthread_t thread;
+
+    if (pthread_mutex_init (&pool.lock, NULL) != 0)
+        return -1;
+    pool.hosts = hashmap_create_nocase (UPSTREAM_BUCKETS);
+    if (!pool.hosts)
+        return -1;
+    pool.nidle = 0;
+    pool.head = pool.tail = NULL;
+
+    Pthread_create (&thread, NULL, upstream_reaper, NULL);
+    return 0;
+}
+
+/*
+ * An idle connection is only usable if the origin has neither closed
+ * it nor sent anything unsolicited.
+ */
+static int idle_usable (int fd)
+{
+    char c;
+    ssize_t len = recv (fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int upstream_get (const char *host, int port, int *reused)
+{
+    char key[UPSTREAM_KEY_LENGTH];
+    struct upstream_host_s *hostptr;
+    struct idle_conn_s *idle;
+    int fd;
+
+    make_key (key, host, port);
+    while (1) {
+        pthread_mutex_lock (&pool.lock);
+        expire_idle (time (NULL));
+        hostptr = find_host (key);
+        if (!hostptr) {
+            pthread_mutex_unlock (&pool.lock);
+            break;
+        }
+        idle = hostptr->head;
+        unlink_idle (idle);
+        pthread_mutex_unlock (&pool.lock);
+
+        fd = idle->fd;
+        Free (idle);
+        if (idle_usable (fd)) {
+            *reused = 1;
+            return fd;
+        }
+        close (fd);
+    }
+
+    *reused = 0;
+    return opensock (host, port);
+}
+
+void upstream_put (const char *host, int port, int fd)
+{
+    char key[UPSTREAM_KEY_LENGTH];
+    struct upstream_host_s *hostptr;
+    struct idle_conn_s *idle;
+
+    make_key (key, host, port);
+
+    idle = (struct idle_conn_s *) Malloc (sizeof (struct idle_conn_s));
+    idle->fd = fd;
+    idle->since = time (NULL);
+
+    pthread_mutex_lock (&pool.lock);
+    hostptr = find_host (key);
+    if (!hostptr) {
+        hostptr = (struct upstream_host_s *)
+            Calloc (1, sizeof (struct upstream_host_s));
+        hostptr->key = strdup (key);
+        if (hashmap_insert (pool.hosts, key, &hostptr,
+                            sizeof (hostptr)) < 0) {
+            pthread_mutex_unlock (&pool.lock);
+            Free (hostptr->key);
+            Free (hostptr);
+            Free (idle);
+            close (fd);
+            return;
+        }
+    }
+
+    idle->host = hostptr;
+    idle->hprev = NULL;
+    idle->hnext = hostptr->head;
+    if (hostptr->head)
+        hostptr->head->hprev = idle;
+    hostptr->head = idle;
+    hostptr->nidle++;
+
+    idle->gprev = NULL;
+    idle->gnext = pool.head;
+    if (pool.head)
+        pool.head->gprev = idle;
+    pool.head = idle;
+    if (!pool.tail)
+        pool.tail = idle;
+    pool.nidle++;
+
+    /* Over a limit: the oldest idle connection of this host goes first. */
+    if (hostptr->nidle > UPSTREAM_MAXIDLE_HOST) {
+        struct idle_conn_s *oldest = hostptr->head;
+        while (oldest->hnext)
+            oldest = oldest->hnext;
+        close_idle (oldest);
+    }
+    if (pool.nidle > UPSTREAM_MAXIDLE)
+        close_idle (pool.tail);
+    pthread_mutex_unlock (&pool.lock);
+}
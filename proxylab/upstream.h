@@ -0,0 +1,21 @@
+#ifndef _PROXYLAB_UPSTREAM_H_
+#define _PROXYLAB_UPSTREAM_H_
+
+#include "csapp.h"
+
+#define UPSTREAM_BUCKETS 64
+#define UPSTREAM_MAXIDLE_HOST 8      /* idle connections kept per host:port */
+#define UPSTREAM_MAXIDLE 256         /* idle connections kept in total */
+#define UPSTREAM_IDLE_TIMEOUT 30     /* seconds before an idle one is closed */
+
+/*
+ * Pool of idle persistent connections to origin servers, keyed by
+ * host and port.  upstream_get() prefers the most recently used idle
+ * connection and falls back to opensock(); a connection goes back with
+ * upstream_put() only once its response has been read to the end.
+ */
+extern int upstream_init (void);
+extern int upstream_get (const char *host, int port, int *reused);
+extern void upstream_put (const char *host, int port, int fd);
+
+#endif